@@ -1,12 +1,16 @@
 #include "au/AuEncoder.h"
 #include "au/AuDecoder.h"
+#include "au/BufferByteSource.h"
 #include "au/FileByteSource.h"
+#include "AuRecordHandler.h"
 
 #include <benchmark/benchmark.h>
 
+#include <chrono>
 #include <random>
 #include <sstream>
 #include <string.h>
+#include <unistd.h>
 
 static void BM_FileByteSource(benchmark::State &state) {
   size_t buffSz = state.range(0);
@@ -179,4 +183,91 @@ static void BM_valueInt(benchmark::State &state) {
 // formula
 BENCHMARK(BM_valueInt)->RangeMultiplier(2)->Range(1ul<<0, 1ul<<7);
 
+/// Visits every value, as grep and stats do, without doing anything with them.
+struct BM_ValueCounter final : au::NoopValueHandler {
+  size_t values = 0;
+
+  template <typename Source>
+  void onValue(Source &source, const au::Dictionary::Dict &) {
+    au::ValueParser<BM_ValueCounter, Source>(source, *this).value();
+  }
+
+  void onNull(size_t) override { values++; }
+  void onBool(size_t, bool) override { values++; }
+  void onInt(size_t, int64_t) override { values++; }
+  void onUint(size_t, uint64_t) override { values++; }
+  void onDouble(size_t, double) override { values++; }
+  void onTime(size_t, au::time_point) override { values++; }
+  void onDictRef(size_t, size_t) override { values++; }
+  void onStringEnd() override { values++; }
+};
+
+/// 100k log-like records: a timestamp, a few strings and numbers, and a short
+/// array, each around 100 bytes.
+static std::string BM_records() {
+  au::AuEncoder au;
+  std::string result;
+  auto write = [&](std::string_view s1, std::string_view s2) {
+    result.append(s1).append(s2);
+    return s1.size() + s2.size();
+  };
+  auto t0 = std::chrono::system_clock::now();
+  for (int i = 0; i < 100'000; ++i) {
+    au.encode([&](au::AuWriter &writer) {
+      writer.map(
+          "ts", t0 + std::chrono::milliseconds(i),
+          "host", "web-" + std::to_string(i % 16),
+          "path", "/api/v1/items/" + std::to_string(i),
+          "status", 200 + i % 5,
+          "latency", 0.001 * (i % 1000),
+          "ok", i % 7 != 0,
+          "sizes", writer.arrayVals([&]() {
+            for (int j = 0; j < 4; ++j) writer.value(i * j);
+          }));
+    }, write);
+  }
+  return result;
+}
+
+template <typename Source>
+static void BM_decode(benchmark::State &state, Source &source) {
+  size_t values = 0;
+  for (auto _ : state) {
+    au::Dictionary dictionary;
+    BM_ValueCounter counter;
+    au::AuRecordHandler recordHandler(dictionary, counter);
+    source.seek(0);
+    au::RecordParser(source, recordHandler).parseStream();
+    values += counter.values;
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(values));
+  state.SetBytesProcessed(
+      static_cast<int64_t>(state.iterations() * source.endPos()));
+}
+
+static void BM_DecodeBuffer(benchmark::State &state) {
+  auto records = BM_records();
+  au::BufferByteSource source(records);
+  BM_decode(state, source);
+}
+BENCHMARK(BM_DecodeBuffer);
+
+static void BM_DecodeFile(benchmark::State &state) {
+  auto records = BM_records();
+  char name[] = "/tmp/au-benchmark-XXXXXX";
+  auto fd = ::mkstemp(name);
+  if (fd < 0 || ::write(fd, records.data(), records.size())
+                    != static_cast<ssize_t>(records.size())) {
+    state.SkipWithError("couldn't write a temporary file");
+    return;
+  }
+  ::close(fd);
+  {
+    au::FileByteSourceImpl source(name);
+    BM_decode(state, source);
+  }
+  ::unlink(name);
+}
+BENCHMARK(BM_DecodeFile);
+
 BENCHMARK_MAIN();
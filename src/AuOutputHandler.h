@@ -61,7 +61,8 @@ public:
     str_.reserve(1u << 16);
   }
 
-  void onValue(AuByteSource &source, Dictionary::Dict &dictionary) {
+  template <typename Source>
+  void onValue(Source &source, Dictionary::Dict &dictionary) {
     encoder_.encode([&] (AuWriter &writer) {
       ValueHandler handler(writer, str_, dictionary);
       ValueParser parser(source, handler);
@@ -7,8 +7,6 @@
 
 namespace au {
 
-class AuByteSource;
-
 template<typename ValueHandler>
 class AuRecordHandler {
   Dictionary &dictionary_;
@@ -40,7 +38,8 @@ public:
       dict_ = &dictionary;
   }
 
-  void onValue(size_t relDictPos, size_t, AuByteSource &source) {
+  template<typename Source>
+  void onValue(size_t relDictPos, size_t, Source &source) {
     auto &dictionary = dictionary_.findDictionary(sor_, relDictPos);
     valueHandler_.onValue(source, dictionary);
   }
@@ -2,6 +2,7 @@
 #include "AuRecordHandler.h"
 #include "Dictionary.h"
 #include "JsonOutputHandler.h"
+#include "ParallelScan.h"
 #include "StreamDetection.h"
 #include "TclapHelper.h"
 #include "au/AuDecoder.h"
@@ -18,17 +19,75 @@ void usage(const char *cmd) {
       << " stdout. Any <path> may be \"-\" for stdin.\n"
       << "\n"
       << "  -h --help        show usage and exit\n"
-      << "  -e --encode      output au-encoded records rather than json\n";
+      << "  -e --encode      output au-encoded records rather than json\n"
+      << "     --threads <n> decode an indexed gzipped file on <n> threads, or\n"
+      << "                   inflate any other ahead of decoding on all but one\n"
+      << "                   (default: 1; 0 for one per cpu)\n"
+      << "     --read-ahead  read input on a separate thread, overlapping I/O\n"
+      << "                   (or decompression) with decoding\n"
+      << "     --no-cache    drop input from the page cache once it's been read\n"
+      << "     --mmap        map input files rather than reading them, which is\n"
+      << "                   faster, but kills au if one is truncated meanwhile\n";
+}
+
+/// What one thread of catInParallel() made of its range.
+struct CatPart {
+  std::string json;
+  std::optional<std::string> error; //< what stopped it short, if anything
+};
+
+/// Decodes the ranges of file, an indexed gzipped file, on several threads,
+/// writing what each makes of its range in turn. See scanInParallel().
+int catInParallel(const std::string &fileName, const AuByteSource &file,
+                  const std::vector<ScanRange> &ranges, size_t threads) {
+  auto result = 0;
+  scanInParallel(
+      ranges, threads, [&] { return openScanSource(file); },
+      [&](AuByteSource &source, const ScanRange &range) {
+        std::ostringstream out;
+        CatPart part;
+        try {
+          Dictionary dictionary;
+          JsonOutputHandler handler(out);
+          AuRecordHandler recordHandler(dictionary, handler);
+          withSourceType(source, [&](auto &src) {
+            startRange(src, dictionary, range);
+            parseRange(src, range, recordHandler);
+          });
+        } catch (parse_error &e) {
+          part.error = e.what();
+        }
+        part.json = std::move(out).str();
+        return part;
+      },
+      [&](CatPart &&part) {
+        std::cout << part.json << std::flush;
+        if (!part.error) return true;
+        std::cerr << *part.error << " while processing " << fileName << "\n";
+        result = 1;
+        return false;
+      });
+  return result;
 }
 
 template<typename H>
-int doCat(const std::string &fileName, H &handler, bool compressed) {
+int doCat(const std::string &fileName, H &handler, bool compressed,
+          const SourceOptions &sourceOptions, size_t threads) {
   Dictionary dictionary;
   AuRecordHandler recordHandler(dictionary, handler);
-  auto source = detectSource(fileName, std::nullopt, compressed);
+  auto source =
+      detectSource(fileName, std::nullopt, compressed, sourceOptions);
   if (!checkAuFile(*source)) return 1;
   try {
-    RecordParser<AuRecordHandler<H>>(*source, recordHandler).parseStream();
+    // the encoder's dictionary can only be built up in order
+    if constexpr (std::is_same_v<H, JsonOutputHandler>) {
+      auto ranges = scanRanges(*source, threads);
+      if (!ranges.empty())
+        return catInParallel(fileName, *source, ranges, threads);
+    }
+    withSourceType(*source, [&](auto &src) {
+      RecordParser(src, recordHandler).parseStream();
+    });
   } catch (const std::exception &e) {
     std::cerr << e.what() << " while processing " << fileName << "\n";
     return 1;
@@ -36,15 +95,16 @@ int doCat(const std::string &fileName, H &handler, bool compressed) {
   return 0;
 }
 
-int catFile(const std::string &fileName, bool encodeOutput, bool compressed) {
+int catFile(const std::string &fileName, bool encodeOutput, bool compressed,
+            const SourceOptions &sourceOptions, size_t threads) {
   if (encodeOutput) {
     AuOutputHandler handler(
         AU_STR("Re-encoded by au from original au file "
                 << (fileName == "-" ? "<stdin>" : fileName)));
-    return doCat(fileName, handler, compressed);
+    return doCat(fileName, handler, compressed, sourceOptions, threads);
   } else {
     JsonOutputHandler handler;
-    return doCat(fileName, handler, compressed);
+    return doCat(fileName, handler, compressed, sourceOptions, threads);
   }
 }
 
@@ -55,6 +115,11 @@ int catCmd(int argc, const char * const *argv, bool compressed) {
       "path", "", false, "path", tclap.cmd());
 
   TCLAP::SwitchArg encode("e", "encode", "encode", tclap.cmd());
+  TCLAP::SwitchArg readAhead("", "read-ahead", "read-ahead", tclap.cmd());
+  TCLAP::SwitchArg noCache("", "no-cache", "no-cache", tclap.cmd());
+  TCLAP::SwitchArg mmap("", "mmap", "mmap", tclap.cmd());
+  TCLAP::ValueArg<size_t> threads(
+      "", "threads", "threads", false, 1, "count", tclap.cmd());
 
   if (!tclap.parse(argc, argv)) return 1;
 
@@ -62,7 +127,12 @@ int catCmd(int argc, const char * const *argv, bool compressed) {
   if (fileNames.isSet()) inputFiles = fileNames.getValue();
 
   for (const auto &f : inputFiles) {
-    auto result = catFile(f, encode.isSet(), compressed);
+    auto result = catFile(f, encode.isSet(), compressed,
+                          {.readAhead = readAhead.isSet(),
+                           .noCache = noCache.isSet(),
+                           .mmap = mmap.isSet(),
+                           .threads = threads.getValue()},
+                          threads.getValue());
     if (result) return result;
   }
 
@@ -102,6 +102,11 @@ public:
     return *dict;
   }
 
+  /// Forget every dictionary, as when the stream they came from is gone.
+  void reset() {
+    dictionaries_.clear();
+  }
+
   Dict *latest() {
     if (dictionaries_.empty()) return nullptr;
     return dictionaries_.back().get();
@@ -3,10 +3,12 @@
 #include "JsonOutputHandler.h"
 #include "GrepHandler.h"
 #include "NumericPattern.h"
+#include "ParallelScan.h"
 #include "StreamDetection.h"
 #include "TclapHelper.h"
 #include "TimestampPattern.h"
 #include "au/AuDecoder.h"
+#include "au/ConcatByteSource.h"
 
 #include <chrono>
 #include <cstdlib>
@@ -77,30 +79,28 @@ bool setTimestampPattern(Pattern &pattern, const std::string &tsPat) {
   return pattern.timestampPattern.has_value();
 }
 
-int grepFile(Pattern &pattern,
-             const std::string &fileName,
-             bool encodeOutput,
-             bool asciiLog,
-             bool compressed,
-             const std::optional<std::string> &indexFile) {
-  auto source = detectSource(fileName, indexFile, compressed);
-
+template <typename Source>
+int grepSource(Pattern &pattern,
+               const std::string &fileName,
+               Source &source,
+               bool encodeOutput,
+               bool asciiLog) {
   if (asciiLog) {
-    if (isAuFile(*source)) {
+    if (isAuFile(source)) {
       std::cerr << fileName << " appears to be au-encoded. -l is unlikely to"
         << " to do anything useful here!" << std::endl;
       return 1;
     }
-    return AsciiGrepper(pattern, *source).doGrep();
-  } else if (isAuFile(*source)) {
+    return AsciiGrepper(pattern, source).doGrep();
+  } else if (isAuFile(source)) {
     if (encodeOutput) {
       AuOutputHandler handler(
           AU_STR("Encoded by au: grep output from au file "
                  << (fileName == "-" ? "<stdin>" : fileName)));
-      return AuGrepper(pattern, *source, handler).doGrep();
+      return AuGrepper(pattern, source, handler).doGrep();
     } else {
       JsonOutputHandler handler;
-      return AuGrepper(pattern, *source, handler).doGrep();
+      return AuGrepper(pattern, source, handler).doGrep();
     }
   } else { // assume file is json
     if (encodeOutput) {
@@ -109,9 +109,144 @@ int grepFile(Pattern &pattern,
       return 1;
     } else {
       JsonOutputHandler handler;
-      return JsonGrepper(pattern, *source, handler).doGrep();
+      return JsonGrepper(pattern, source, handler).doGrep();
+    }
+  }
+}
+
+/// Whether the matches for pattern can be looked for in parts of a file at
+/// once, which rules out a binary search, and context, which can span parts.
+bool searchableInParts(const Pattern &pattern) {
+  if (pattern.bisect) return false;
+  // -c pays no attention to context
+  return pattern.count
+         || (!pattern.beforeContext && !pattern.afterContext
+             && !pattern.forceFollow);
+}
+
+/// What one thread of grepInParallel() found in its range.
+struct GrepPart {
+  std::string json;
+  size_t matches = 0;
+  std::vector<size_t> ends; //< where each match's output ends, for -m
+  std::optional<std::string> error; //< what stopped it short, if anything
+};
+
+/// Searches the ranges of file, an indexed gzipped au file, on several threads,
+/// writing what each finds in turn, up to -m matches in all. See
+/// scanInParallel(). Each range is searched with a copy of pattern, which a
+/// grepper may change as it goes.
+int grepInParallel(const Pattern &pattern,
+                   const AuByteSource &file,
+                   const std::vector<ScanRange> &ranges,
+                   size_t threads) {
+  size_t numMatches = std::numeric_limits<size_t>::max();
+  if (pattern.numMatches) numMatches = *pattern.numMatches;
+  size_t total = 0;
+  auto result = 0;
+  scanInParallel(
+      ranges, threads,
+      [&] { return openScanSource(file); },
+      [&](AuByteSource &source, const ScanRange &range) {
+        std::ostringstream out;
+        GrepPart part;
+        try {
+          JsonOutputHandler handler(out);
+          auto rangePattern = pattern;
+          withSourceType(source, [&](auto &src) {
+            AuGrepper grepper(rangePattern, src, handler);
+            startRange(src, grepper.dictionary(), range);
+            part.matches = grepper.grepRange(range.end, [&] {
+              if (pattern.numMatches)
+                part.ends.push_back(static_cast<size_t>(out.tellp()));
+            });
+          });
+        } catch (parse_error &e) {
+          part.error = e.what();
+        }
+        part.json = std::move(out).str();
+        return part;
+      },
+      [&](GrepPart &&part) {
+        auto matches = std::min(part.matches, numMatches - total);
+        if (matches < part.matches && !pattern.count)
+          part.json.resize(matches ? part.ends[matches - 1] : 0);
+        std::cout << part.json << std::flush;
+        total += matches;
+        if (part.error) {
+          std::cerr << *part.error << std::endl;
+          result = -1;
+          return false;
+        }
+        return total < numMatches;
+      });
+  if (!result && pattern.count) std::cout << total << std::endl;
+  return result;
+}
+
+int grepFile(Pattern &pattern,
+             const std::string &fileName,
+             bool encodeOutput,
+             bool asciiLog,
+             bool compressed,
+             const std::optional<std::string> &indexFile,
+             const SourceOptions &sourceOptions,
+             size_t threads) {
+  auto source = detectSource(fileName, indexFile, compressed, sourceOptions);
+  // the samples belong to source's index, so mustn't outlive it: the next file
+  // grepped with this pattern may not have any
+  struct KeySamplesRaii {
+    Pattern &pattern;
+    ~KeySamplesRaii() { pattern.keySamples = nullptr; }
+  } keySamplesRaii{pattern};
+  if (pattern.bisect && pattern.keyPattern) {
+    auto *key = std::get_if<std::string>(&*pattern.keyPattern);
+    if (auto *zip = dynamic_cast<ZipByteSource *>(source.get()); zip && key)
+      pattern.keySamples = zip->keySamples(*key);
+  }
+  if (!encodeOutput && !asciiLog && searchableInParts(pattern)
+      && isAuFile(*source)) {
+    auto ranges = scanRanges(*source, threads);
+    // every part has to be searching for the same date
+    if (!ranges.empty() && pattern.needsDateScan()) {
+      withSourceType(*source, [&](auto &src) {
+        JsonOutputHandler handler;
+        AuGrepper(pattern, src, handler).performDateScan();
+      });
     }
+    if (!ranges.empty() && !pattern.needsDateScan())
+      return grepInParallel(pattern, *source, ranges, threads);
   }
+  return withSourceType(*source, [&](auto &src) {
+    return grepSource(pattern, fileName, src, encodeOutput, asciiLog);
+  });
+}
+
+/// Bisects files as though they were one, so that the first match can be found
+/// in O(log total size) wherever it lies, for --concat. Files must be given in
+/// order, with what's bisected on in order across all of them (see
+/// ConcatByteSource).
+int grepConcatenated(Pattern &pattern,
+                     const std::vector<std::string> &fileNames,
+                     bool encodeOutput,
+                     bool asciiLog,
+                     bool compressed,
+                     const SourceOptions &sourceOptions) {
+  // only the part being read reads ahead: see ConcatByteSource::setReadAhead()
+  auto partOptions = sourceOptions;
+  partOptions.readAhead = false;
+  std::vector<std::unique_ptr<AuByteSource>> parts;
+  for (auto &f : fileNames)
+    parts.emplace_back(detectSource(f, std::nullopt, compressed, partOptions));
+  std::unique_ptr<ConcatByteSource> source;
+  try {
+    source = std::make_unique<ConcatByteSource>(std::move(parts));
+  } catch (const std::runtime_error &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  source->setReadAhead(sourceOptions.readAhead);
+  return grepSource(pattern, source->name(), *source, encodeOutput, asciiLog);
 }
 
 bool isRePattern(std::string_view sv, const TCLAP::SwitchArg &noRegexFlag) {
@@ -162,6 +297,32 @@ void usage(const char *cmd) {
       << "  -r --no-regex       explicitly disable regex matching for all arguments,\n"
       << "                      even if they look like /.../\n"
       << "  -x --index <path>   use gzip index in <path> (only for zgrep)\n"
+      << "     --concat         with -o or -l, search all of the files as though\n"
+      << "                      they were one (see below)\n"
+      << "     --threads <n>    search an indexed gzipped au file on <n> threads\n"
+      << "                      (default: 1; 0 for one per cpu), unless -o, -A, -B\n"
+      << "                      or -F need it searched in order, when it's\n"
+      << "                      inflated ahead of the search on all but one\n"
+      << "     --build-index    binary search a gzipped file with no index by first\n"
+      << "                      building one, which takes a pass through the file.\n"
+      << "                      it's saved (see au zindex), so later searches are fast\n"
+      << "     --block-cache <dir>\n"
+      << "                      keep what's inflated of an indexed gzipped file in\n"
+      << "                      <dir>, a checkpoint's worth at a time, for later\n"
+      << "                      searches to read instead of inflating it again.\n"
+      << "                      <dir> is kept to 4GB (or $AU_BLOCK_CACHE_SIZE\n"
+      << "                      MiB), least recently used first\n"
+      << "     --read-ahead     read input on a separate thread, overlapping I/O\n"
+      << "                      (or decompression) with searching\n"
+      << "     --no-cache       drop input from the page cache once it's been read,\n"
+      << "                      so scanning huge files doesn't evict other data\n"
+      << "     --mmap           map input files rather than reading them, which is\n"
+      << "                      faster, but kills au if one is truncated meanwhile\n"
+      << "     --max-buffer <n> hold at most <n> MiB of input for -B context and long\n"
+      << "                      lines (default 64), re-reading it if need be. stdin\n"
+      << "                      and unindexed gzip can't be re-read, so may use more\n"
+      << "     --max-rate <n>   read at most <n> MiB/s, to go easy on a busy host\n"
+      << "     --max-cpu <n>    use at most <n> percent of one cpu\n"
       << "\n"
       << "  Timestamps may be specified without a date (e.g., 18:45:00.123), in which \n"
       << "  case the first few records of the stream will be scanned for timestamp matches.\n"
@@ -177,6 +338,12 @@ void usage(const char *cmd) {
       << "  matching <pattern>. Most output-controlling arguments (e.g., -m, -F, -C, -c)\n"
       << "  are accepted in combination with -l.\n"
       << "\n"
+      << "  Given several files, -o and -l search each in turn. With --concat, they\n"
+      << "  search them as though they were a single file instead, which takes far\n"
+      << "  fewer reads, but only finds everything if the files are listed in order\n"
+      << "  (e.g., rotated logs, oldest first) and what's searched for is in order\n"
+      << "  across all of them. --concat can't be combined with -c or -x.\n"
+      << "\n"
       << "  Regular Expressions:\n"
       << "    Most string patterns support regular expression mode. To enable, specify the\n"
       << "    string in the form \"/.../\", where ... can be any regular expression. For\n"
@@ -213,6 +380,8 @@ int grepCmd(int argc, const char *const *argv, bool compressed) {
       "m", "matches", "matches", false, 0, "uint32_t", tclap.cmd());
   TCLAP::ValueArg<std::string> index(
       "x", "index", "index", false, "", "string", tclap.cmd());
+  TCLAP::ValueArg<size_t> threads(
+      "", "threads", "threads", false, 1, "count", tclap.cmd());
   TCLAP::SwitchArg orGreater("g", "or-greater", "or-greater", tclap.cmd());
   TCLAP::SwitchArg followContext(
       "F", "follow-context", "follow-context", tclap.cmd());
@@ -226,12 +395,23 @@ int grepCmd(int argc, const char *const *argv, bool compressed) {
   TCLAP::SwitchArg matchString("s", "string", "string", tclap.cmd());
   TCLAP::SwitchArg matchSubstring("u", "substring", "substring", tclap.cmd());
   TCLAP::SwitchArg noRegex("r", "no-regex", "no-regex", tclap.cmd());
+  TCLAP::SwitchArg readAhead("", "read-ahead", "read-ahead", tclap.cmd());
+  TCLAP::SwitchArg noCache("", "no-cache", "no-cache", tclap.cmd());
+  TCLAP::SwitchArg mmap("", "mmap", "mmap", tclap.cmd());
+  TCLAP::SwitchArg buildIndex("", "build-index", "build-index", tclap.cmd());
+  TCLAP::SwitchArg concat("", "concat", "concat", tclap.cmd());
+  TCLAP::ValueArg<std::string> blockCache(
+      "", "block-cache", "block-cache", false, "", "dir", tclap.cmd());
+  TCLAP::ValueArg<size_t> maxBuffer(
+      "", "max-buffer", "max-buffer", false,
+      FileByteSource::DEFAULT_MAX_BUFFER_SIZE >> 20, "MiB", tclap.cmd());
+  ThrottleArgs throttle(tclap.cmd());
   TCLAP::UnlabeledValueArg<std::string> pat(
       "pattern", "", true, "", "pattern", tclap.cmd());
   TCLAP::UnlabeledMultiArg<std::string> fileNames(
       "path", "", false, "path", tclap.cmd());
 
-  if (!tclap.parse(argc, argv)) return 1;
+  if (!tclap.parse(argc, argv) || !throttle.apply()) return 1;
 
   {
     auto n = 0;
@@ -361,22 +541,52 @@ int grepCmd(int argc, const char *const *argv, bool compressed) {
 
   pattern.count = count.isSet();
 
+  // counts are per file, and -x can only name one file's index
+  if (concat.isSet() && (!pattern.bisect || pattern.count || index.isSet())) {
+    std::cerr << "--concat needs -o or -l, and can't be combined with -c or -x."
+              << std::endl;
+    return 1;
+  }
+
+  constexpr auto MaxBufferMiB = std::numeric_limits<size_t>::max() >> 20;
+  if (maxBuffer.getValue() > MaxBufferMiB) {
+    std::cerr << "--max-buffer can be at most " << MaxBufferMiB << " MiB"
+              << std::endl;
+    return 1;
+  }
+
   std::optional<std::string> indexFile;
   if (index.isSet()) indexFile = index.getValue();
-
+  // only a binary search needs an index
+  SourceOptions sourceOptions{
+      .readAhead = readAhead.isSet(),
+      .noCache = noCache.isSet(),
+      .mmap = mmap.isSet(),
+      .buildIndex = buildIndex.isSet() && pattern.bisect,
+      .blockCache = blockCache.isSet() ? std::optional{blockCache.getValue()}
+                                       : std::nullopt,
+      .maxBufferSize = maxBuffer.getValue() << 20};
+  sourceOptions.throttle = throttle.throttle();
+  sourceOptions.threads = threads.getValue();
+
+  auto result = 0;
   if (fileNames.getValue().empty()) {
-    return grepFile(pattern, "-", encode.isSet(), asciiLog.isSet(), compressed,
-                    indexFile);
+    result = grepFile(pattern, "-", encode.isSet(), asciiLog.isSet(),
+                      compressed, indexFile, sourceOptions, threads.getValue());
+  } else if (concat.isSet()) {
+    result = grepConcatenated(pattern, fileNames.getValue(), encode.isSet(),
+                              asciiLog.isSet(), compressed, sourceOptions);
   } else {
     for (auto &f : fileNames) {
-      auto result =
+      result =
           grepFile(pattern, f, encode.isSet(), asciiLog.isSet(), compressed,
-                   indexFile);
-      if (result) return result;
+                   indexFile, sourceOptions, threads.getValue());
+      if (result) break;
     }
   }
 
-  return 0;
+  throttle.report();
+  return result;
 }
 }
 
@@ -3,11 +3,13 @@
 #include "au/AuDecoder.h"
 #include "AuRecordHandler.h"
 #include "JsonProxies.h"
+#include "KeySamples.h"
 #include "Tail.h"
 #include "TimestampPattern.h"
 
 #include <cassert>
 #include <chrono>
+#include <deque>
 #include <iostream>
 #include <memory>
 #include <optional>
@@ -19,7 +21,10 @@
 namespace au {
 
 struct Pattern {
-  using StrOrRegex = std::variant<std::string, std::unique_ptr<re2::RE2>>;
+  // regexes are shared by copies of a pattern: matching doesn't change them,
+  // so threads can match with the same one at once
+  using StrOrRegex =
+      std::variant<std::string, std::shared_ptr<const re2::RE2>>;
 
   struct StrPattern {
     StrOrRegex pattern;
@@ -46,6 +51,9 @@ struct Pattern {
   bool count = false;
   bool forceFollow = false;
   bool matchOrGreater = false;
+  /// What the index of a gzipped file knows of the key being bisected on, if
+  /// anything. See au zindex -k.
+  const KeySamples *keySamples = nullptr;
 
   struct StrOrRegexVisitor {
     std::string_view value;
@@ -63,7 +71,7 @@ struct Pattern {
       return value.find(s) != std::string::npos;
     }
 
-    bool operator()(const std::unique_ptr<re2::RE2> &re) const {
+    bool operator()(const std::shared_ptr<const re2::RE2> &re) const {
       if (fullMatch)
         return re2::RE2::FullMatch(value, *re);
       return re2::RE2::PartialMatch(value, *re);
@@ -115,6 +123,11 @@ struct Pattern {
     return *doublePattern == val;
   }
 
+  bool matchesValue(const KeySample &sample) {
+    return std::visit([&](const auto &value) { return matchesValue(value); },
+                      sample.value);
+  }
+
   bool matchesValue(std::string_view sv) const {
     if (!strPattern)
       return false;
@@ -213,9 +226,10 @@ public:
     context_.back().counter++;
   }
 
-  void onValue(AuByteSource &source, const Dictionary::Dict &dict) {
+  template <typename Source>
+  void onValue(Source &source, const Dictionary::Dict &dict) {
     initializeForValue(&dict);
-    ValueParser<GrepHandler> parser(source, *this);
+    ValueParser<GrepHandler, Source> parser(source, *this);
     parser.value();
   }
 
@@ -340,15 +354,15 @@ private:
 
 namespace {
 
-template <typename This>
+template <typename This, typename Source>
 class Grepper {
 protected:
   Pattern &pattern;
-  AuByteSource &source;
+  Source &source;
   GrepHandler grepHandler;
 
 public:
-  Grepper(Pattern &pattern, AuByteSource &source)
+  Grepper(Pattern &pattern, Source &source)
   : pattern(pattern),
     source(source),
     grepHandler(pattern) {}
@@ -365,7 +379,8 @@ public:
     return reallyDoGrep();
   }
 
-private:
+  /// Settles the date of a pattern given only a time of day from the first
+  /// few records, if that hasn't been done, leaving the source where it was.
   void performDateScan() {
     if (source.peek().isEof()) return;
 
@@ -388,12 +403,13 @@ private:
     source.seek(pos);
   }
 
+private:
   int reallyDoGrep() {
     if (pattern.count) pattern.beforeContext = pattern.afterContext = 0;
 
     try {
-      std::vector<size_t> posBuffer;
-      posBuffer.reserve(pattern.beforeContext+1);
+      // a deque, so that dropping the oldest position doesn't cost O(-B)
+      std::deque<size_t> posBuffer;
       size_t force = 0;
       size_t total = 0;
       bool inMatchRegion = false;
@@ -481,6 +497,15 @@ private:
     // (and a bit beyond).
     constexpr size_t SUFFIX_AMOUNT = SCAN_THRESHOLD + PREFIX_AMOUNT + 512 * 1024;
     static_assert(SUFFIX_AMOUNT > PREFIX_AMOUNT + SCAN_THRESHOLD);
+    // enough to find the first record after a probe, usually
+    constexpr size_t PREFETCH_AMOUNT = 128 * 1024;
+
+    // where the iteration bisecting (start, end) will seek to
+    auto probeFor = [&](size_t start, size_t end) {
+      if (end - start <= SCAN_THRESHOLD)
+        return start > PREFIX_AMOUNT ? start - PREFIX_AMOUNT : 0;
+      return start + (end - start) / 2;
+    };
 
     if (!source.isSeekable()) {
       std::cerr << "Cannot binary search in non-seekable file '" << source.name()
@@ -494,6 +519,22 @@ private:
     try {
       size_t start = 0;
       size_t end = source.endPos();
+      // samples of the key are just what probes would find, but cost nothing.
+      // the first that matches bounds the search, and the one before it
+      // starts it. the search has to get as far as the record the first was
+      // taken from, which matches, even when that's where the one before
+      // starts it, as at the start of the file.
+      if (pattern.keySamples) {
+        auto &samples = *pattern.keySamples;
+        auto first = std::partition_point(
+            samples.begin(), samples.end(),
+            [&](const KeySample &sample) {
+              return !pattern.matchesValue(sample);
+            });
+        if (first != samples.end()) end = std::min(end, first->pos + 1);
+        if (first != samples.begin()) start = std::prev(first)->pos;
+        if (start > end) start = end;
+      }
       while (end > start) {
         if (end - start <= SCAN_THRESHOLD) {
           static_cast<This *>(this)->seekSync(
@@ -507,6 +548,13 @@ private:
         static_cast<This *>(this)->seekSync(next);
 
         auto startOfScan = source.pos();
+        // on cold storage each probe is mostly waiting for a read, and we
+        // already know the two places the next one might go. start on both
+        // while we decode this one.
+        if (startOfScan < end && startOfScan > start) {
+          source.prefetch(probeFor(start, startOfScan), PREFETCH_AMOUNT);
+          source.prefetch(probeFor(startOfScan, end), PREFETCH_AMOUNT);
+        }
         do {
             if (!static_cast<This *>(this)->parseValue())
             return 0;
@@ -542,9 +590,9 @@ private:
   }
 };
 
-template <typename OutputHandler>
-class AuGrepper : public Grepper<AuGrepper<OutputHandler>> {
-  friend class Grepper<AuGrepper<OutputHandler>>;
+template <typename OutputHandler, typename Source>
+class AuGrepper : public Grepper<AuGrepper<OutputHandler, Source>, Source> {
+  friend class Grepper<AuGrepper<OutputHandler, Source>, Source>;
   Dictionary dictionary_;
   AuRecordHandler<OutputHandler> outputRecordHandler_;
   AuRecordHandler<GrepHandler> grepRecordHandler_;
@@ -552,12 +600,43 @@ class AuGrepper : public Grepper<AuGrepper<OutputHandler>> {
 public:
   // clang warns too aggressively if the names of these arguments shadow the
   // base class member vars. hence "p" and "s"...
-  AuGrepper(Pattern &p, AuByteSource &s, OutputHandler &handler)
-  : Grepper<AuGrepper<OutputHandler>>(p, s),
+  AuGrepper(Pattern &p, Source &s, OutputHandler &handler)
+  : Grepper<AuGrepper<OutputHandler, Source>, Source>(p, s),
     dictionary_(32),
     outputRecordHandler_(dictionary_, handler),
     grepRecordHandler_(dictionary_, this->grepHandler) {}
 
+  Dictionary &dictionary() { return dictionary_; }
+
+  /// Outputs each matching record from the source's position, the start of a
+  /// record, to end, calling matched() after each, up to -m of them, and
+  /// returns how many there were. For searching part of a file while others
+  /// search the rest (see scanInParallel()), so -A, -B and -F don't apply, and
+  /// with -c it's left to the caller to print the count.
+  template <typename Matched>
+  size_t grepRange(size_t end, Matched &&matched) {
+    auto &source = this->source;
+    size_t total = 0;
+    size_t numMatches = std::numeric_limits<size_t>::max();
+    if (this->pattern.numMatches) numMatches = *this->pattern.numMatches;
+    auto parser = RecordParser(source, grepRecordHandler_);
+    while (total < numMatches && source.pos() < end
+           && !source.peek().isEof()) {
+      auto sor = source.pos();
+      source.setPin(sor);
+      if (!parser.record() || !this->grepHandler.matched()) continue;
+      total++;
+      if (!this->pattern.count) {
+        source.clearPin();
+        source.seek(sor);
+        outputValue();
+      }
+      matched();
+    }
+    source.clearPin();
+    return total;
+  }
+
 private:
   void seekSync(size_t pos) {
     this->source.seek(pos);
@@ -580,21 +659,21 @@ private:
   }
 };
 
-template <typename OutputHandler>
-class JsonGrepper : public Grepper<JsonGrepper<OutputHandler>> {
+template <typename OutputHandler, typename Source>
+class JsonGrepper : public Grepper<JsonGrepper<OutputHandler, Source>, Source> {
   static constexpr auto parseOpt = rapidjson::kParseStopWhenDoneFlag +
                                     rapidjson::kParseFullPrecisionFlag +
                                     rapidjson::kParseNanAndInfFlag;
 
-  friend class Grepper<JsonGrepper<OutputHandler>>;
+  friend class Grepper<JsonGrepper<OutputHandler, Source>, Source>;
   rapidjson::Reader reader_;
   OutputHandler &handler_;
 
 public:
   // clang warns too aggressively if the names of these arguments shadow the
   // base class member vars. hence "p" and "s"...
-  JsonGrepper(Pattern &p, AuByteSource &s, OutputHandler &handler)
-  : Grepper<JsonGrepper<OutputHandler>>(p, s),
+  JsonGrepper(Pattern &p, Source &s, OutputHandler &handler)
+  : Grepper<JsonGrepper<OutputHandler, Source>, Source>(p, s),
     handler_(handler) {}
 
 private:
@@ -630,14 +709,17 @@ private:
   }
 };
 
-class AsciiGrepper : public Grepper<AsciiGrepper> {
-  friend class Grepper<AsciiGrepper>;
+template <typename Source>
+class AsciiGrepper : public Grepper<AsciiGrepper<Source>, Source> {
+  friend class Grepper<AsciiGrepper<Source>, Source>;
+  using Grepper<AsciiGrepper<Source>, Source>::source;
+  using Grepper<AsciiGrepper<Source>, Source>::grepHandler;
 
 public:
   // clang warns too aggressively if the names of these arguments shadow the
   // base class member vars. hence "p" and "s"...
-  AsciiGrepper(Pattern &p, AuByteSource &s)
-  : Grepper<AsciiGrepper>(p, s) {}
+  AsciiGrepper(Pattern &p, Source &s)
+  : Grepper<AsciiGrepper<Source>, Source>(p, s) {}
 
 private:
   void seekSync(size_t pos) {
@@ -694,10 +776,12 @@ private:
   }
 };
 
-template <typename H>
-AuGrepper(Pattern &, AuByteSource &, H &) -> AuGrepper<H>;
-template <typename H>
-JsonGrepper(Pattern &, AuByteSource &, H &) -> JsonGrepper<H>;
+template <typename H, typename S>
+AuGrepper(Pattern &, S &, H &) -> AuGrepper<H, S>;
+template <typename H, typename S>
+JsonGrepper(Pattern &, S &, H &) -> JsonGrepper<H, S>;
+template <typename S>
+AsciiGrepper(Pattern &, S &) -> AsciiGrepper<S>;
 
 }
 
@@ -65,11 +65,12 @@ public:
     str_.reserve(1u << 16);
   }
 
-  void onValue(AuByteSource &source, Dictionary::Dict &dictionary) {
+  template <typename Source>
+  void onValue(Source &source, Dictionary::Dict &dictionary) {
     buffer_.Clear();
     writer_.Reset(buffer_);
     dictionary_ = &dictionary;
-    ValueParser<JsonOutputHandler> parser(source, *this);
+    ValueParser<JsonOutputHandler, Source> parser(source, *this);
     parser.value();
     if (!writer_.IsComplete()) {
       AU_THROW("rapidjson writer does not report a complete value after parse of"
@@ -128,11 +129,13 @@ public:
     auto s = duration_cast<seconds>(nanos); // Because to_time_t might round
     auto tp = system_clock::time_point(s);
     std::time_t tt = system_clock::to_time_t(tp);
-    std::tm *tm = gmtime(&tt);
+    // not gmtime(), whose result is shared: this can be on any thread
+    std::tm tm;
+    gmtime_r(&tt, &tm);
 
     //                   12345678901234567890123456
     char strTime[sizeof("yyyy-mm-ddThh:mm:ss.mmmuuunnn")];
-    strftime(strTime, 21, "%FT%T.", tm);
+    strftime(strTime, 21, "%FT%T.", &tm);
 
     // Isolate the sub-second (fractional portion)
     uint64_t fraction = static_cast<uint64_t>(
@@ -0,0 +1,265 @@
+#pragma once
+
+#include "au/AuDecoder.h"
+#include "au/ParseError.h"
+#include "Dictionary.h"
+#include "JsonProxies.h"
+
+#include <cstring>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+namespace au {
+
+using KeyValue =
+    std::variant<int64_t, uint64_t, double, time_point, std::string>;
+
+/// The value of a key in the first record that has it after some point in a
+/// file, and where the search for that record (as grep -o would do it) starts.
+/// zindex -k stores these for each checkpoint, so that a binary search can
+/// narrow itself down to a single checkpoint without inflating anything.
+struct KeySample {
+  size_t pos;
+  KeyValue value;
+};
+
+using KeySamples = std::vector<KeySample>;
+
+/// Key samples are written as a count of keys, then for each its name and a
+/// count of samples, then the samples: each a position, a type (the index of
+/// the value's type in KeyValue), and the value. Numbers and timestamps are 8
+/// bytes, and strings have a 4-byte length before them.
+inline std::string encodeKeySamples(const std::vector<std::string> &keys,
+                                    const std::vector<KeySamples> &samples) {
+  std::string out;
+  auto put = [&](auto value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+  put(static_cast<uint32_t>(keys.size()));
+  for (size_t i = 0; i < keys.size(); i++) {
+    put(static_cast<uint32_t>(keys[i].size()));
+    out += keys[i];
+    put(static_cast<uint64_t>(samples[i].size()));
+    for (auto &sample : samples[i]) {
+      put(static_cast<uint64_t>(sample.pos));
+      put(static_cast<uint8_t>(sample.value.index()));
+      std::visit(
+          [&](const auto &value) {
+            using T = std::decay_t<decltype(value)>;
+            if constexpr (std::is_same_v<T, std::string>) {
+              put(static_cast<uint32_t>(value.size()));
+              out += value;
+            } else if constexpr (std::is_same_v<T, time_point>) {
+              put(static_cast<int64_t>(value.time_since_epoch().count()));
+            } else {
+              put(value);
+            }
+          },
+          sample.value);
+    }
+  }
+  return out;
+}
+
+/// The inverse of encodeKeySamples(), giving the samples of each key by name.
+/// Throws if in is cut short or makes no sense.
+inline std::map<std::string, KeySamples, std::less<>>
+decodeKeySamples(std::string_view in) {
+  auto get = [&](auto &value) {
+    if (in.size() < sizeof(value)) THROW_RT("Key samples are truncated");
+    ::memcpy(&value, in.data(), sizeof(value));
+    in.remove_prefix(sizeof(value));
+  };
+  auto getString = [&](uint32_t len) {
+    if (in.size() < len) THROW_RT("Key samples are truncated");
+    auto result = std::string(in.substr(0, len));
+    in.remove_prefix(len);
+    return result;
+  };
+  std::map<std::string, KeySamples, std::less<>> result;
+  if (in.empty()) return result;
+  uint32_t numKeys, len;
+  get(numKeys);
+  for (uint32_t i = 0; i < numKeys; i++) {
+    get(len);
+    auto &samples = result[getString(len)];
+    uint64_t numSamples, pos;
+    get(numSamples);
+    for (uint64_t j = 0; j < numSamples; j++) {
+      get(pos);
+      uint8_t type;
+      get(type);
+      KeyValue value;
+      switch (type) {
+        case 0: { int64_t v; get(v); value = v; break; }
+        case 1: { uint64_t v; get(v); value = v; break; }
+        case 2: { double v; get(v); value = v; break; }
+        case 3: {
+          int64_t v;
+          get(v);
+          value = time_point(std::chrono::nanoseconds(v));
+          break;
+        }
+        case 4: get(len); value = getString(len); break;
+        default: THROW_RT("Unknown type of key sample: " << int{type});
+      }
+      samples.push_back(KeySample{pos, std::move(value)});
+    }
+  }
+  return result;
+}
+
+/**
+ * A ValueHandler that picks out the value of each of a set of keys, wherever
+ * they appear in a record. Only the first value of each is kept, and only if
+ * it's a number, timestamp or string: nothing else can be bisected on.
+ */
+class KeyCapture {
+  const std::vector<std::string> &keys_;
+  std::vector<std::optional<KeyValue>> values_;
+  const Dictionary::Dict *dictionary_ = nullptr;
+  std::string str_;
+
+  struct Context {
+    bool object;
+    size_t counter;
+    std::optional<size_t> key; //< The value being read is this key's
+  };
+  std::vector<Context> context_;
+
+public:
+  explicit KeyCapture(const std::vector<std::string> &keys)
+      : keys_(keys), values_(keys.size()) {}
+
+  /// What the last record had for each key, if anything.
+  std::vector<std::optional<KeyValue>> &values() { return values_; }
+
+  template <typename Source>
+  void onValue(Source &source, const Dictionary::Dict &dict) {
+    initializeForValue(&dict);
+    ValueParser<KeyCapture, Source> parser(source, *this);
+    parser.value();
+  }
+
+  void initializeForValue(const Dictionary::Dict *dict = nullptr) {
+    dictionary_ = dict;
+    context_.clear();
+    context_.push_back(Context{false, 0, std::nullopt});
+    for (auto &value : values_) value.reset();
+  }
+
+  void onNull(size_t) { incrCounter(); }
+  void onBool(size_t, bool) { incrCounter(); }
+  void onInt(size_t, int64_t value) { capture(value); }
+  void onUint(size_t, uint64_t value) { capture(value); }
+  void onTime(size_t, time_point value) { capture(value); }
+  void onDouble(size_t, double value) { capture(value); }
+
+  void onDictRef(size_t, size_t dictIdx) {
+    onString(dictionary_->at(dictIdx));
+  }
+
+  void onObjectStart() { context_.push_back(Context{true, 0, std::nullopt}); }
+  void onArrayStart() { context_.push_back(Context{false, 0, std::nullopt}); }
+
+  void onObjectEnd() {
+    context_.pop_back();
+    incrCounter();
+  }
+
+  void onArrayEnd() {
+    context_.pop_back();
+    incrCounter();
+  }
+
+  void onStringStart(size_t, size_t len) {
+    str_.clear();
+    str_.reserve(len);
+  }
+
+  void onStringFragment(std::string_view frag) { str_.append(frag); }
+
+  void onStringEnd() { onString(str_); }
+
+private:
+  bool isKey() const {
+    auto &c = context_.back();
+    return c.object && c.counter % 2 == 0;
+  }
+
+  void incrCounter() {
+    context_.back().key.reset();
+    context_.back().counter++;
+  }
+
+  void onString(std::string_view sv) {
+    if (!isKey()) {
+      capture(std::string(sv));
+      return;
+    }
+    context_.back().counter++;
+    for (size_t i = 0; i < keys_.size(); i++)
+      if (keys_[i] == sv) context_.back().key = i;
+  }
+
+  template <typename T>
+  void capture(T &&value) {
+    if (auto key = context_.back().key; key && !values_[*key])
+      values_[*key] = std::forward<T>(value);
+    incrCounter();
+  }
+};
+
+/// Takes KeySamples from a json file, record by record from a given point, for
+/// which Source must be seekable. (An au file's are taken as its records are
+/// walked: see CheckpointWalker in Zindex.cpp.)
+template <typename Source>
+class KeySampler {
+  Source &source_;
+  const std::vector<std::string> &keys_;
+  KeyCapture capture_;
+  rapidjson::Reader reader_;
+
+public:
+  KeySampler(Source &source, const std::vector<std::string> &keys)
+      : source_(source), keys_(keys), capture_(keys) {}
+
+  /// Adds to samples (one per key) the first value of each key in the records
+  /// starting between from and to. Keys not found by then go without.
+  void sample(size_t from, size_t to, std::vector<KeySamples> &samples) {
+    // as grep does it, so the samples are what a probe would find
+    source_.seek(from);
+    if (from != 0 && !source_.scanTo("\n")) return;
+    std::vector<bool> found(keys_.size());
+    auto left = keys_.size();
+    while (left && source_.pos() < to) {
+      auto pos = source_.pos();
+      if (!parseValue()) return;
+      auto &values = capture_.values();
+      for (size_t i = 0; i < keys_.size(); i++) {
+        if (found[i] || !values[i]) continue;
+        samples[i].push_back(KeySample{pos, std::move(*values[i])});
+        found[i] = true;
+        left--;
+      }
+    }
+  }
+
+private:
+  bool parseValue() {
+    static constexpr auto parseOpt = rapidjson::kParseStopWhenDoneFlag +
+                                     rapidjson::kParseFullPrecisionFlag +
+                                     rapidjson::kParseNanAndInfFlag;
+    capture_.initializeForValue();
+    JsonSaxProxy proxy(capture_);
+    AuByteSourceStream wrappedSource(source_);
+    return reader_.Parse<parseOpt>(wrappedSource, proxy);
+  }
+};
+
+}
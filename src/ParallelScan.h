@@ -0,0 +1,142 @@
+#pragma once
+
+#include "au/AuDecoder.h"
+#include "Dictionary.h"
+#include "Tail.h"
+#include "Zindex.h"
+
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace au {
+
+/// Part of an au file that can be decoded by itself, given the dictionary it
+/// starts with: from the value record at start (or the start of the file) to
+/// the one at end, not included.
+struct ScanRange {
+  size_t start;
+  size_t end;
+};
+
+/// The ranges an indexed gzipped au file divides into for scanInParallel(),
+/// one from each record the index knows of to the next (see
+/// ZipByteSource::recordStarts()), the first from the start of the file and
+/// the last to its end, wherever that's got to. Empty if there's no point, as
+/// with only one thread (0 meaning one per cpu), or no way, in which case the
+/// file should be read as usual.
+inline std::vector<ScanRange> scanRanges(AuByteSource &source,
+                                         size_t threads) {
+  if (!threads) threads = std::max(std::thread::hardware_concurrency(), 1u);
+  auto *zip = dynamic_cast<ZipByteSource *>(&source);
+  if (threads < 2 || !zip) return {};
+  auto starts = zip->recordStarts();
+  if (starts.empty()) return {};
+  std::vector<ScanRange> ranges;
+  size_t start = 0;
+  for (auto pos : starts) {
+    ranges.push_back(ScanRange{start, pos});
+    start = pos;
+  }
+  ranges.push_back(ScanRange{start, std::numeric_limits<size_t>::max()});
+  return ranges;
+}
+
+/// A source for one of the threads of scanInParallel(): another cursor over
+/// the file that source reads, so that it isn't opened again, nor its index
+/// read again, for every thread. Cursors don't read or inflate ahead of
+/// themselves: the other threads have the cpus.
+inline std::unique_ptr<AuByteSource> openScanSource(
+    const AuByteSource &source) {
+  if (auto *zip = dynamic_cast<const ZipByteSource *>(&source))
+    return zip->cursor();
+  if (auto *pread = dynamic_cast<const PreadByteSource *>(&source))
+    return pread->cursor();
+  THROW_RT("Can't read " << source.name() << " on more than one thread");
+}
+
+/// Positions source at the start of range, with dictionary as it would be
+/// there had everything before been read: past the header at the start of the
+/// file, as RecordParser::parseStream() reads it, and elsewhere synced with
+/// the record the index knows of.
+template <typename Source>
+void startRange(Source &source, Dictionary &dictionary,
+                const ScanRange &range) {
+  source.seek(range.start);
+  if (!range.start) {
+    NoopRecordHandler header;
+    RecordParser(source, header).record();
+    return;
+  }
+  if (!TailHandler(dictionary, source).sync() || source.pos() != range.start)
+    AU_THROW("Couldn't sync with the record at " << range.start);
+}
+
+/// Hands handler every record from source's position to the end of range.
+template <typename Source, typename Handler>
+void parseRange(Source &source, const ScanRange &range, Handler &handler) {
+  RecordParser parser(source, handler);
+  while (source.pos() < range.end && !source.peek().isEof()) parser.record();
+}
+
+/**
+ * Calls scan(source, range) for each of ranges, on up to threads threads at
+ * once (0 meaning one per cpu), each with a source of its own from open(),
+ * kept for the next range it's given. Then, on this thread and in order,
+ * done() is handed each result, and returns false to stop there: no more
+ * ranges are started, and those under way are waited for and dropped.
+ *
+ * A parse_error that ends a range early belongs in its result, for done() to
+ * report after what was made of the range up to there, as it would have
+ * been reading in order. Any other exception from scan() isn't caught: it's
+ * rethrown here in the result's place, to be handled as it would be on one
+ * thread.
+ *
+ * Results wait to be handed over until those before them have been, so no
+ * more than threads of them are held at once.
+ */
+template <typename Open, typename Scan, typename Done>
+void scanInParallel(const std::vector<ScanRange> &ranges, size_t threads,
+                    Open &&open, Scan &&scan, Done &&done) {
+  using Result = decltype(scan(std::declval<AuByteSource &>(), ranges[0]));
+  if (!threads) threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+  std::mutex mutex;
+  std::vector<std::unique_ptr<AuByteSource>> idle;
+  // last, so the threads using the above are finished before they're gone
+  std::deque<std::future<Result>> inFlight;
+
+  auto run = [&](const ScanRange &range) {
+    std::unique_ptr<AuByteSource> source;
+    {
+      std::scoped_lock lock(mutex);
+      if (!idle.empty()) {
+        source = std::move(idle.back());
+        idle.pop_back();
+      }
+    }
+    if (!source) source = open();
+    auto result = scan(*source, range);
+    std::scoped_lock lock(mutex);
+    idle.emplace_back(std::move(source));
+    return result;
+  };
+
+  for (size_t next = 0; next < ranges.size() || !inFlight.empty();) {
+    while (inFlight.size() < threads && next < ranges.size())
+      inFlight.emplace_back(
+          std::async(std::launch::async, run, std::cref(ranges[next++])));
+    auto result = inFlight.front().get();
+    inFlight.pop_front();
+    if (!done(std::move(result))) return;
+  }
+}
+
+}
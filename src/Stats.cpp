@@ -1,6 +1,7 @@
 #include "au/AuDecoder.h"
 #include "AuRecordHandler.h"
 #include "DoubleAnalysis.h"
+#include "ParallelScan.h"
 #include "StreamDetection.h"
 #include "TclapHelper.h"
 
@@ -56,6 +57,12 @@ std::string prettyBytes(size_t bytes) {
   return std::string(buf);
 }
 
+/// Adds each count in from to the one in to, which grows to fit.
+void mergeBuckets(std::vector<size_t> &to, const std::vector<size_t> &from) {
+  if (from.size() > to.size()) to.resize(from.size());
+  for (auto i = 0u; i < from.size(); i++) to[i] += from[i];
+}
+
 struct SizeHistogram {
   std::string name;
   size_t totalValBytes = 0;
@@ -73,6 +80,11 @@ struct SizeHistogram {
     buckets[bucket]++;
   }
 
+  void merge(const SizeHistogram &other) {
+    totalValBytes += other.totalValBytes;
+    mergeBuckets(buckets, other.buckets);
+  }
+
   void dumpStats(std::optional<size_t> totalBytes) {
     size_t totalStrings = 0;
     for (auto count : buckets) totalStrings += count;
@@ -104,6 +116,10 @@ struct VarintHistogram {
     buckets[size - 1]++;
   }
 
+  void merge(const VarintHistogram &other) {
+    mergeBuckets(buckets, other.buckets);
+  }
+
   void dumpStats(size_t totalBytes) {
     size_t totalInts = 0;
     auto onePastLastPopulated = 0u;
@@ -126,27 +142,43 @@ struct VarintHistogram {
   }
 };
 
-void dictStats(const Dictionary::Dict &dictionary,
+/// A dictionary's entries, and how often each was referred to.
+struct DictUsage {
+  size_t startPos;
+  std::vector<std::string> entries;
+  std::vector<size_t> frequency;
+
+  /// Counts the references from a later part of the file too, by which time
+  /// there may be more entries.
+  void merge(DictUsage &&later) {
+    mergeBuckets(frequency, later.frequency);
+    if (later.entries.size() > entries.size())
+      entries = std::move(later.entries);
+    if (frequency.size() < entries.size()) frequency.resize(entries.size());
+  }
+};
+
+void dictStats(const std::vector<std::string> &entries,
                const std::vector<size_t> &dictFrequency,
                const char *event,
                bool fullDump) {
   std::cout
       << "Dictionary stats " << event << ":\n"
-      << "  Total entries: " << commafy(dictionary.size()) << '\n';
+      << "  Total entries: " << commafy(entries.size()) << '\n';
   SizeHistogram hist {"Dictionary entries"};
-  for (auto &&entry : dictionary.entries()) hist.add(entry.size());
+  for (auto &&entry : entries) hist.add(entry.size());
   hist.dumpStats({});
 
-  auto numEntries = dictionary.size();
+  auto numEntries = entries.size();
   if (!fullDump) numEntries = std::min(numEntries, DEFAULT_DICT_ENTRIES);
 
   std::vector<std::pair<size_t, std::string>> byFreq;
-  for (auto i = 0u; i < dictionary.size(); i++)
-    byFreq.emplace_back(dictFrequency[i], dictionary.at(i));
+  for (auto i = 0u; i < entries.size(); i++)
+    byFreq.emplace_back(dictFrequency[i], entries[i]);
   std::sort(byFreq.begin(), byFreq.end(),
             std::greater<std::pair<size_t, std::string>>());
   std::cout << "     Referral count";
-  if (numEntries != dictionary.size())
+  if (numEntries != entries.size())
     std::cout << " (top " << numEntries << " entries)";
   std::cout << ":\n";
   for (auto i = 0u; i < numEntries; i++)
@@ -220,7 +252,8 @@ struct StatsValueHandler : public NoopValueHandler {
     }
   }
 
-  void onValue(AuByteSource &source, const Dictionary::Dict &dict) {
+  template <typename Source>
+  void onValue(Source &source, const Dictionary::Dict &dict) {
     dictionary = &dict;
     source_ = &source;
     if (analyzeDoubles) {
@@ -228,7 +261,7 @@ struct StatsValueHandler : public NoopValueHandler {
       context.emplace_back(Context::Kind::Bare);
       doubleAnalysis.onRecordStart();
     }
-    ValueParser<StatsValueHandler> parser(source, *this);
+    ValueParser<StatsValueHandler, Source> parser(source, *this);
     parser.value();
     if (analyzeDoubles) doubleAnalysis.onRecordEnd();
     source_ = nullptr;
@@ -330,6 +363,24 @@ struct StatsValueHandler : public NoopValueHandler {
     advance();
   }
 
+  /// Counts what other saw of a later part of the file too. Not the analysis
+  /// of doubles, which needs to see it all in order.
+  void merge(const StatsValueHandler &other) {
+    doubles += other.doubles;
+    doubleBytes += other.doubleBytes;
+    timestamps += other.timestamps;
+    timestampBytes += other.timestampBytes;
+    bools += other.bools;
+    boolBytes += other.boolBytes;
+    nulls += other.nulls;
+    nullBytes += other.nullBytes;
+    stringHist.merge(other.stringHist);
+    dictStringHist.merge(other.dictStringHist);
+    intValues.merge(other.intValues);
+    dictRefs.merge(other.dictRefs);
+    stringLengths.merge(other.stringLengths);
+  }
+
   void dumpStats(size_t totalBytes) {
     std::cout
         << "  Values:\n"
@@ -374,6 +425,10 @@ struct StatsRecordHandler {
   size_t dictAdds = 0;
   std::vector<Header> headers;
   size_t sor = 0;
+  /// For a handler given only part of the file (see StatsDecoder): the
+  /// dictionaries cleared in it, in order, which can't be reported until the
+  /// counts from the parts before are in.
+  std::optional<std::vector<DictUsage>> cleared;
 
   StatsRecordHandler(bool fullDictDump, bool analyzeDoubles, bool quiet)
   : vh(dictFrequency),
@@ -397,8 +452,11 @@ struct StatsRecordHandler {
   void onDictClear() {
     dictClears++;
     auto *dict = dictionary.latest();
-    if (!quiet && dict && dict->size())
-      dictStats(*dict, dictFrequency, "upon clear", fullDictDump);
+    if (cleared && dict)
+      cleared->push_back(
+          DictUsage{dict->startPos_, dict->entries(), dictFrequency});
+    else if (!quiet && dict && dict->size())
+      dictStats(dict->entries(), dictFrequency, "upon clear", fullDictDump);
     dictFrequency.clear();
     next.onDictClear();
   }
@@ -408,7 +466,8 @@ struct StatsRecordHandler {
     next.onDictAddStart(relDictPos);
   }
 
-  void onValue(size_t relDictPos, size_t len, AuByteSource &source) {
+  template <typename Source>
+  void onValue(size_t relDictPos, size_t len, Source &source) {
     valueHist.add(len);
     next.onValue(relDictPos, len, source);
   }
@@ -425,40 +484,92 @@ struct StatsRecordHandler {
   void onStringFragment(std::string_view fragment) {
     next.onStringFragment(fragment);
   }
+
+  /// The dictionary as of the last record, if there is one.
+  std::optional<DictUsage> latest() {
+    auto *dict = dictionary.latest();
+    if (!dict) return std::nullopt;
+    return DictUsage{dict->startPos_, dict->entries(), dictFrequency};
+  }
+
+  /// Counts what part saw of a later part of the file too. Its dictionaries
+  /// are left to the caller.
+  void merge(const StatsRecordHandler &part) {
+    for (auto header : part.headers) {
+      header.recordNum += numRecords;
+      headers.push_back(std::move(header));
+    }
+    valueHist.merge(part.valueHist);
+    numRecords += part.numRecords;
+    dictClears += part.dictClears;
+    dictAdds += part.dictAdds;
+    vh.merge(part.vh);
+  }
 };
 
 class StatsDecoder {
   std::string filename_;
   bool json_;
+  SourceOptions sourceOptions_;
+  size_t threads_;
+
+  /// How far decoding got, and the dictionary in use there.
+  struct Decoded {
+    size_t end = 0;
+    bool truncated = false;
+    std::optional<DictUsage> dict;
+  };
+
+  /// What one thread of decodeInParallel() saw of its range.
+  struct Part {
+    std::unique_ptr<StatsRecordHandler> handler;
+    size_t end;
+    std::optional<std::string> error; //< what stopped it short, if anything
+  };
 
 public:
-  StatsDecoder(const std::string &filename, bool json)
-      : filename_(filename), json_(json) {}
+  StatsDecoder(const std::string &filename, bool json,
+               const SourceOptions &sourceOptions, size_t threads)
+      : filename_(filename), json_(json), sourceOptions_(sourceOptions),
+        threads_(threads) {}
 
   int decode(StatsRecordHandler &handler) const {
-    auto source = detectSource(filename_, std::nullopt, false);
+    auto source = detectSource(filename_, std::nullopt, false, sourceOptions_);
     if (!checkAuFile(*source)) return 1;
-    bool truncated = false;
-    try {
-      RecordParser(*source, handler).parseStream();
-    } catch (parse_error &e) {
-      // report what we did read rather than discarding it, which is what
-      // makes sampling a prefix of a very large file practical
-      std::cerr << filename_ << ": stopped after "
-                << prettyBytes(source->pos()) << ": " << e.what() << std::endl;
-      truncated = true;
+    Decoded decoded;
+    // the analysis of doubles has to see every record in order
+    auto ranges = handler.vh.analyzeDoubles
+                      ? std::vector<ScanRange>{}
+                      : scanRanges(*source, threads_);
+    if (!ranges.empty()) {
+      decoded = decodeInParallel(*source, ranges, handler);
+    } else {
+      try {
+        withSourceType(*source, [&](auto &src) {
+          RecordParser(src, handler).parseStream();
+        });
+      } catch (parse_error &e) {
+        // report what we did read rather than discarding it, which is what
+        // makes sampling a prefix of a very large file practical
+        std::cerr << filename_ << ": stopped after "
+                  << prettyBytes(source->pos()) << ": " << e.what()
+                  << std::endl;
+        decoded.truncated = true;
+      }
+      decoded.end = source->pos();
+      decoded.dict = handler.latest();
     }
+    auto truncated = decoded.truncated;
 
     if (json_) {
       // one object per file, so a corpus aggregates by concatenation
       handler.vh.doubleAnalysis.reportJson(std::cout, filename_,
-                                           source->pos(), truncated);
+                                           decoded.end, truncated);
       return truncated ? 1 : 0;
     }
 
-    auto *dict = handler.dictionary.latest();
-    if (dict && dict->size())
-      dictStats(*dict, handler.dictFrequency, "at end of file",
+    if (auto &dict = decoded.dict; dict && !dict->entries.empty())
+      dictStats(dict->entries, dict->frequency, "at end of file",
                 handler.fullDictDump);
 
     std::cout << "Stats for " << filename_ << ":\n";
@@ -478,29 +589,96 @@ public:
     }
 
     std::cout
-        << "  Total read: " << prettyBytes(source->pos()) << '\n'
+        << "  Total read: " << prettyBytes(decoded.end) << '\n'
         << "  Records: " << commafy(handler.numRecords) << '\n'
         << "     Version headers: " << commafy(handler.headers.size()) << '\n'
         << "     Dictionary resets: " << commafy(handler.dictClears) << '\n'
         << "     Dictionary adds: " << commafy(handler.dictAdds) << '\n';
-    handler.valueHist.dumpStats(source->pos());
-    handler.vh.dumpStats(source->pos());
+    handler.valueHist.dumpStats(decoded.end);
+    handler.vh.dumpStats(decoded.end);
     if (handler.vh.analyzeDoubles)
-      handler.vh.doubleAnalysis.report(std::cout, source->pos());
+      handler.vh.doubleAnalysis.report(std::cout, decoded.end);
 
     return truncated ? 1 : 0;
   }
+
+private:
+  /// Decodes the ranges of file, an indexed gzipped file, on several threads
+  /// (see scanInParallel()), adding what each saw to handler in turn, and
+  /// reporting each dictionary cleared once every part of the file that used
+  /// it has.
+  Decoded decodeInParallel(const AuByteSource &file,
+                           const std::vector<ScanRange> &ranges,
+                           StatsRecordHandler &handler) const {
+    Decoded decoded;
+    auto &dict = decoded.dict;
+    auto carry = [&](DictUsage &&usage) {
+      if (dict && dict->startPos == usage.startPos)
+        dict->merge(std::move(usage));
+      else
+        dict = std::move(usage);
+    };
+    scanInParallel(
+        ranges, threads_,
+        [&] { return openScanSource(file); },
+        [&](AuByteSource &source, const ScanRange &range) {
+          Part part{std::make_unique<StatsRecordHandler>(
+                        handler.fullDictDump, false, handler.quiet),
+                    range.start, std::nullopt};
+          auto &partHandler = *part.handler;
+          partHandler.cleared.emplace();
+          try {
+            withSourceType(source, [&](auto &src) {
+              startRange(src, partHandler.dictionary, range);
+              // references to entries from before the range count too
+              if (auto *synced = partHandler.dictionary.latest())
+                partHandler.dictFrequency.resize(synced->size());
+              parseRange(src, range, partHandler);
+            });
+          } catch (parse_error &e) {
+            part.error = e.what();
+          }
+          part.end = source.pos();
+          return part;
+        },
+        [&](Part &&part) {
+          for (auto &usage : *part.handler->cleared) {
+            carry(std::move(usage));
+            if (!handler.quiet && !dict->entries.empty())
+              dictStats(dict->entries, dict->frequency, "upon clear",
+                        handler.fullDictDump);
+            dict.reset();
+          }
+          if (auto latest = part.handler->latest()) carry(std::move(*latest));
+          handler.merge(*part.handler);
+          decoded.end = part.end;
+          if (!part.error) return true;
+          std::cerr << filename_ << ": stopped after "
+                    << prettyBytes(decoded.end) << ": " << *part.error
+                    << std::endl;
+          decoded.truncated = true;
+          return false;
+        });
+    return decoded;
+  }
 };
 
 void usage() {
   std::cout
       << "usage: au stats [options] [--] <path>...\n"
       << "\n"
-      << "  -h --help        show usage and exit\n"
-      << "  -d --dict        dump full dictionary\n"
-      << "     --doubles     analyze how well doubles would compress\n"
-      << "     --json        emit the --doubles analysis as json, one\n"
-      << "                   object per file, for aggregation\n";
+      << "  -h --help         show usage and exit\n"
+      << "  -d --dict         dump full dictionary\n"
+      << "     --threads <n>  decode an indexed gzipped file on <n> threads\n"
+      << "                    (default: 1; 0 for one per cpu; --doubles uses 1)\n"
+      << "     --doubles      analyze how well doubles would compress\n"
+      << "     --json         emit the --doubles analysis as json, one\n"
+      << "                    object per file, for aggregation\n"
+      << "     --no-cache     drop input from the page cache once it's been read\n"
+      << "     --mmap         map input files rather than reading them, which is\n"
+      << "                    faster, but kills au if one is truncated meanwhile\n"
+      << "     --max-rate <n> read at most <n> MiB/s, to go easy on a busy host\n"
+      << "     --max-cpu <n>  use at most <n> percent of one cpu\n";
 }
 
 }
@@ -511,10 +689,15 @@ int stats(int argc, const char * const *argv) {
   TCLAP::SwitchArg dictDump("d", "dict", "dict", tclap.cmd(), false);
   TCLAP::SwitchArg doubles("", "doubles", "doubles", tclap.cmd(), false);
   TCLAP::SwitchArg json("", "json", "json", tclap.cmd(), false);
+  TCLAP::SwitchArg noCache("", "no-cache", "no-cache", tclap.cmd(), false);
+  TCLAP::SwitchArg mmap("", "mmap", "mmap", tclap.cmd(), false);
+  TCLAP::ValueArg<size_t> threads(
+      "", "threads", "threads", false, 1, "count", tclap.cmd());
+  ThrottleArgs throttle(tclap.cmd());
   TCLAP::UnlabeledMultiArg<std::string> fileNames(
       "path", "", false, "path", tclap.cmd());
 
-  if (!tclap.parse(argc, argv)) return 1;
+  if (!tclap.parse(argc, argv) || !throttle.apply()) return 1;
 
   if (json.isSet() && !doubles.isSet()) {
     std::cerr << "--json currently only applies to --doubles.\n";
@@ -524,14 +707,22 @@ int stats(int argc, const char * const *argv) {
   std::vector<std::string> inputFiles{"-"};
   if (fileNames.isSet()) inputFiles = fileNames.getValue();
 
+  SourceOptions sourceOptions{.noCache = noCache.isSet(),
+                              .mmap = mmap.isSet()};
+  sourceOptions.throttle = throttle.throttle();
+  sourceOptions.threads = threads.getValue();
+
+  auto result = 0;
   for (auto &f : inputFiles) {
     StatsRecordHandler handler(dictDump.isSet(), doubles.isSet(),
                                json.isSet());
-    auto result = StatsDecoder(f, json.isSet()).decode(handler);
-    if (result) return result;
+    result = StatsDecoder(f, json.isSet(), sourceOptions, threads.getValue())
+                 .decode(handler);
+    if (result) break;
   }
 
-  return 0;
+  throttle.report();
+  return result;
 }
 
 }
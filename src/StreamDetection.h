@@ -24,21 +24,83 @@ static inline bool isGzipFile(AuByteSource &source) {
   return magicMatched;
 }
 
-static inline std::unique_ptr<FileByteSource> detectSource(
+/// How the command line would like its input read.
+struct SourceOptions {
+  bool follow = false;    //< wait for more data at eof (tail -f)
+  bool readAhead = false; //< read on a helper thread while parsing
+  bool noCache = false;   //< drop what we've read from the page cache
+  bool mmap = false;      //< map plain regular files (see MmapByteSource)
+  bool buildIndex = false; //< see ZipByteSource::buildIndex()
+  /// see ZipByteSource::setBlockCache()
+  std::optional<std::string> blockCache = std::nullopt;
+  /// see FileByteSource::setMaxBufferSize()
+  size_t maxBufferSize = FileByteSource::DEFAULT_MAX_BUFFER_SIZE;
+  /// Limits on reading, shared by every source opened with these options.
+  /// Must outlive them.
+  Throttle *throttle = nullptr;
+  /// see ZipByteSource::setThreads()
+  size_t threads = 1;
+};
+
+/// Picks the cheapest source that can serve fileName: a mapping for plain
+/// regular files, if asked for, a ZipByteSource for gzipped input, and a
+/// buffered reader for everything else (stdin, pipes, and anything we've been
+/// asked to follow). Read-ahead also rules out the mapping, whose page faults
+/// would land on the parsing thread, as does noCache, since only a read
+/// position can be trailed, and throttling, since page faults can't be
+/// counted.
+static inline std::unique_ptr<AuByteSource> detectSource(
     const std::string &fileName,
     const std::optional<std::string> &indexFile,
-    bool compressed) {
+    bool compressed,
+    const SourceOptions &options = {}) {
+  if (options.mmap && !options.follow && !options.readAhead
+      && !options.noCache && !options.throttle && !compressed
+      && MmapByteSource::canMap(fileName)) {
+    auto mapped = std::make_unique<MmapByteSource>(fileName);
+    if (!isGzipFile(*mapped)) return mapped;
+    auto zip = std::make_unique<ZipByteSource>(fileName, indexFile);
+    if (options.buildIndex) zip->buildIndex();
+    if (options.blockCache) zip->setBlockCache(*options.blockCache);
+    zip->setThreads(options.threads);
+    zip->setMaxBufferSize(options.maxBufferSize);
+    return zip;
+  }
+
   std::unique_ptr<FileByteSource> source;
   auto fbs = std::make_unique<FileByteSourceImpl>(fileName);
+  fbs->setThrottle(options.throttle);
   if (compressed || isGzipFile(*fbs)) {
-    auto *ptr = fbs.get();
-    source.reset(new ZipByteSource(*ptr, indexFile));
+    auto zip = std::make_unique<ZipByteSource>(*fbs, indexFile);
+    zip->setNoCache(options.noCache);
+    zip->setThrottle(options.throttle);
+    if (options.buildIndex) zip->buildIndex();
+    if (options.blockCache) zip->setBlockCache(*options.blockCache);
+    zip->setThreads(options.threads);
+    source = std::move(zip);
   } else {
+    fbs->setNoCache(options.noCache);
     source = std::move(fbs);
   }
+  source->setFollow(options.follow);
+  source->setReadAhead(options.readAhead); // ignored when following
+  source->setMaxBufferSize(options.maxBufferSize);
   return source;
 }
 
+/// Calls f with source cast to the concrete type detectSource() built, so that
+/// the parsers instantiated beneath f make direct calls for every byte rather
+/// than virtual ones. Any other kind of source falls back to the virtual
+/// interface.
+template <typename F>
+decltype(auto) withSourceType(AuByteSource &source, F &&f) {
+  if (auto *mapped = dynamic_cast<MmapByteSource *>(&source))
+    return f(*mapped);
+  if (auto *buffered = dynamic_cast<FileByteSource *>(&source))
+    return f(*buffered);
+  return f(source);
+}
+
 static inline bool checkAuFile(AuByteSource &source) {
   if (source.peek().isEof()) return true;
 
@@ -16,7 +16,13 @@ void usage(const char *cmd) {
       << "  -h --help           show usage and exit\n"
       << "  -f --follow         output appended data as the file grows\n"
       << "  -b --bytes <n>      start <n> bytes from end of file (default 5k)\n"
-      << "  -x --index <path>   use gzip index in <path>\n";
+      << "  -x --index <path>   use gzip index in <path>\n"
+      << "     --block-cache <dir>\n"
+      << "                      keep what's inflated of an indexed gzipped file in\n"
+      << "                      <dir>, a checkpoint's worth at a time, for later\n"
+      << "                      runs to read instead of inflating it again.\n"
+      << "                      <dir> is kept to 4GB (or $AU_BLOCK_CACHE_SIZE\n"
+      << "                      MiB), least recently used first\n";
 }
 
 int tailCmd(int argc, const char *const *argv, bool compressed) {
@@ -30,6 +36,8 @@ int tailCmd(int argc, const char *const *argv, bool compressed) {
       "path", "", true, "path", "", tclap.cmd());
   TCLAP::ValueArg<std::string> index(
       "x", "index", "index", false, "", "string", tclap.cmd());
+  TCLAP::ValueArg<std::string> blockCache(
+      "", "block-cache", "block-cache", false, "", "dir", tclap.cmd());
 
   if (!tclap.parse(argc, argv)) return 1;
 
@@ -42,16 +50,19 @@ int tailCmd(int argc, const char *const *argv, bool compressed) {
     std::optional<std::string> indexFile =
         index.isSet() ? std::optional{index.getValue()}
                       : std::nullopt;
-    auto source = detectSource(fileName, indexFile, compressed);
+    SourceOptions sourceOptions{.follow = follow};
+    if (blockCache.isSet()) sourceOptions.blockCache = blockCache.getValue();
+    auto source = detectSource(fileName, indexFile, compressed, sourceOptions);
     if (!source->isSeekable()) {
       std::cerr << "Cannot tail non-seekable file '" << source->name() << "'"
           << std::endl;
       return 1;
     }
-    source->setFollow(follow);
     source->tail(startOffset);
-    TailHandler tailHandler(dictionary, *source);
-    tailHandler.parseStream(jsonHandler);
+    withSourceType(*source, [&](auto &src) {
+      TailHandler tailHandler(dictionary, src);
+      tailHandler.parseStream(jsonHandler);
+    });
   }
 
   return 0;
@@ -8,7 +8,13 @@
 
 namespace au {
 
-class DictionaryBuilder : public BaseParser {
+template <typename Source = AuByteSource>
+class DictionaryBuilder : public BaseParser<Source> {
+  using BaseParser<Source>::source_;
+  using BaseParser<Source>::readBackref;
+  using BaseParser<Source>::parseFormatVersion;
+  using BaseParser<Source>::parseFullString;
+  using BaseParser<Source>::term;
   std::list<std::string> newEntries_;
   Dictionary &dictionary_;
   /// A valid dictionary must end before this point
@@ -16,10 +22,10 @@ class DictionaryBuilder : public BaseParser {
   size_t lastDictPos_;
 
 public:
-  DictionaryBuilder(AuByteSource &source,
+  DictionaryBuilder(Source &source,
                     Dictionary &dictionary,
                     size_t endOfDictAbsPos)
-      : BaseParser(source),
+      : BaseParser<Source>(source),
         dictionary_(dictionary),
         endOfDictAbsPos_(endOfDictAbsPos),
         lastDictPos_(source.pos())
@@ -92,6 +98,25 @@ private:
   }
 };
 
+/// Keeps a Dictionary up to date with the records it's handed, skipping over
+/// their values without looking at them.
+class DictionaryTracker : public AuRecordHandler<NoopValueHandler> {
+public:
+  explicit DictionaryTracker(Dictionary &dictionary)
+      : AuRecordHandler(dictionary, noValues()) {}
+
+  template <typename Source>
+  void onValue(size_t, size_t len, Source &source) {
+    source.skip(len);
+  }
+
+private:
+  static NoopValueHandler &noValues() {
+    static NoopValueHandler handler;
+    return handler;
+  }
+};
+
 /** This handler simply checks that the value we're unpacking doesn't go on past
  * the expected end of the value record. If we start decoding an endless string
  * of T's, we don't want to wait until the whole "record" has been unpacked
@@ -145,31 +170,49 @@ private:
   }
 };
 
-class TailHandler : public BaseParser {
+template <typename Source = AuByteSource>
+class TailHandler : public BaseParser<Source> {
+  using BaseParser<Source>::source_;
+  using BaseParser<Source>::expect;
+  using BaseParser<Source>::readBackref;
+  using BaseParser<Source>::readVarint;
+  using BaseParser<Source>::term;
   Dictionary &dictionary_;
 
 public:
-  TailHandler(Dictionary &dictionary, AuByteSource &source)
-      : BaseParser(source), dictionary_(dictionary) {}
+  TailHandler(Dictionary &dictionary, Source &source)
+      : BaseParser<Source>(source), dictionary_(dictionary) {}
 
   template <typename OutputHandler>
   void parseStream(OutputHandler &handler) {
-    if (!sync()) {
-      std::cerr
-          << "Unable to find the start of a valid value record. "
-             "Consider starting earlier in the file. See the -b option.\n";
-      return;
-    }
+    while (true) {
+      try {
+        if (!sync()) {
+          std::cerr
+              << "Unable to find the start of a valid value record. "
+                 "Consider starting earlier in the file. See the -b option.\n";
+          return;
+        }
 
-    // At this point we should have a full/valid dictionary and be positioned
-    // at the start of a value record.
-    AuRecordHandler<OutputHandler> recordHandler(dictionary_, handler);
-    RecordParser<decltype(recordHandler)>(source_, recordHandler)
-      .parseStream(false);
+        // At this point we should have a full/valid dictionary and be
+        // positioned at the start of a value record.
+        AuRecordHandler<OutputHandler> recordHandler(dictionary_, handler);
+        RecordParser<decltype(recordHandler), Source>(source_, recordHandler)
+          .parseStream(false);
+        return;
+      } catch (const stream_restarted &e) {
+        // a followed file was rotated or truncated. the source is already at
+        // the start of the new data, so sync up with that.
+        std::cerr << e.what() << "\n";
+        dictionary_.reset();
+      }
+    }
   }
 
   bool sync() {
     if (source_.peek().isEof()) return true;
+    if (auto known = source_.knownRecord(source_.pos()))
+      if (syncKnown(*known)) return true;
 
     while (true) {
       size_t sor = source_.pos();
@@ -190,7 +233,7 @@ public:
 
         if (!dictionary_.search(sor - backDictRef)) {
           source_.seek(sor - backDictRef);
-          DictionaryBuilder builder(source_, dictionary_, sor);
+          DictionaryBuilder<Source> builder(source_, dictionary_, sor);
           builder.build();
           // We seem to have a complete dictionary. Let's try validating this val.
           source_.seek(sor);
@@ -206,7 +249,7 @@ public:
         auto &dict = dictionary_.findDictionary(sor, backDictRef);
         ValidatingHandler validatingHandler(
             dict, source_, startOfValue + valueLen);
-        ValueParser<ValidatingHandler> valueValidator(
+        ValueParser<ValidatingHandler, Source> valueValidator(
             source_, validatingHandler);
         valueValidator.value();
         term();
@@ -218,6 +261,8 @@ public:
         // We seem to have a good value record. Reset stream to start of record.
         source_.seek(sor);
         return true; // Sync was successful
+      } catch (const stream_restarted &) {
+        throw;
       } catch (std::exception &e) {
         std::cerr << "Ignoring exception while synchronizing start of tailing "
                      "(attempted start-of-record: " << sor << "): "
@@ -226,6 +271,44 @@ public:
       }
     }
   }
+
+private:
+  /// Sync with a record the source knows of, reading its dictionary forward
+  /// from the dict-clear it starts with, or from as far as we already have
+  /// it. Returns false, leaving the source where it was, if that fails.
+  bool syncKnown(const AuByteSource::KnownRecord &known) {
+    auto pos = source_.pos();
+    try {
+      source_.seek(known.pos);
+      expect('V');
+      auto backDictRef = readBackref();
+      if (backDictRef > known.pos || known.dictClear > known.pos - backDictRef)
+        THROW_RT("Back dictionary reference is outside its dictionary");
+      auto dictPos = known.pos - backDictRef;
+      if (!dictionary_.search(dictPos)) {
+        auto *partial = dictionary_.search(known.dictClear);
+        if (partial && partial->startPos_ != known.dictClear) partial = nullptr;
+        source_.seek(partial ? partial->lastDictPos_ : known.dictClear);
+        DictionaryTracker tracker(dictionary_);
+        RecordParser<DictionaryTracker, Source> parser(source_, tracker);
+        while (source_.pos() < known.pos && parser.parseUntilValue()) {}
+        if (!dictionary_.search(dictPos))
+          THROW_RT("Dictionary doesn't reach " << dictPos);
+      }
+      source_.seek(known.pos);
+      return true;
+    } catch (const stream_restarted &) {
+      throw;
+    } catch (std::exception &e) {
+      std::cerr << "Ignoring exception while synchronizing with known record "
+                   "at " << known.pos << ": " << e.what() << "\n";
+      source_.seek(pos);
+      return false;
+    }
+  }
 };
 
+template <typename Source>
+TailHandler(Dictionary &, Source &) -> TailHandler<Source>;
+
 }
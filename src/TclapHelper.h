@@ -1,8 +1,14 @@
 #pragma once
 
+#include "au/Throttle.h"
+
 #include <tclap/CmdLine.h>
 
+#include <algorithm>
+#include <cmath>
 #include <functional>
+#include <iostream>
+#include <limits>
 
 namespace au {
 
@@ -56,4 +62,45 @@ public:
   }
 };
 
+/// --max-rate and --max-cpu, for commands that can be held to them, and the
+/// Throttle they ask for.
+class ThrottleArgs {
+  TCLAP::ValueArg<double> maxRate_;
+  TCLAP::ValueArg<double> maxCpu_;
+  Throttle throttle_;
+
+public:
+  explicit ThrottleArgs(TCLAP::CmdLine &cmd)
+      : maxRate_("", "max-rate", "max-rate", false, 0, "MiB/s", cmd),
+        maxCpu_("", "max-cpu", "max-cpu", false, 0, "percent", cmd) {}
+
+  /// Set up the throttle from the args, once they're parsed. If they make no
+  /// sense, says so on cerr and returns false.
+  bool apply() {
+    auto positive = [](TCLAP::ValueArg<double> &arg) {
+      if (!arg.isSet() || (std::isfinite(arg.getValue()) && arg.getValue() > 0))
+        return true;
+      std::cerr << "--" << arg.getName() << " must be more than 0\n";
+      return false;
+    };
+    if (!positive(maxRate_) || !positive(maxCpu_)) return false;
+    if (maxRate_.isSet()) {
+      // a double past what a size_t holds doesn't convert to one
+      auto bytes = std::min(
+          maxRate_.getValue() * (1 << 20),
+          static_cast<double>(std::numeric_limits<size_t>::max() / 2));
+      throttle_.setBytesPerSecond(
+          std::max(size_t(1), static_cast<size_t>(bytes)));
+    }
+    if (maxCpu_.isSet()) throttle_.setCpuShare(maxCpu_.getValue() / 100);
+    return true;
+  }
+
+  /// The throttle, or null if the args don't ask for one.
+  Throttle *throttle() { return throttle_.enabled() ? &throttle_ : nullptr; }
+
+  /// How long we were held back, on cerr, if we were throttled at all.
+  void report() const { throttle_.report(std::cerr); }
+};
+
 }
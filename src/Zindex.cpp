@@ -1,16 +1,35 @@
-#include "au/AuEncoder.h"
 #include "au/ParseError.h"
+#include "AuMagic.h"
 #include "DocumentParser.h"
+#include "KeySamples.h"
+#include "Tail.h"
 #include "Zindex.h"
 
 #include <zlib.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <future>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <utility>
+#include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 // this file contains code adapted from https://github.com/mattgodbolt/zindex
 
@@ -19,12 +38,79 @@ namespace au {
 namespace {
 
 constexpr size_t DefaultIndexEvery = 8 * 1024 * 1024u;
+// zindex --refine adds checkpoints this often where seeks have been landing,
+// so long as there've been at least RefineSeeks of them since the last, each
+// at least this far past the checkpoint before it. a seek there then inflates
+// at most about 1MB to get where it's going, rather than up to 8; any closer,
+// and the windows of the extra checkpoints start to weigh on the index.
+constexpr size_t RefineEvery = DefaultIndexEvery / 8;
+// one seek could be a one-off, but two suggest that searches keep landing
+// there.
+constexpr size_t RefineSeeks = 2;
 constexpr size_t WindowSize = 32768u;
 // TODO to ensure upgrading from an uncompressed stream works, this must
 // currently be at least as big as the buf_ in the FileByteStream. this is NOT
 // the best way to do this.
 constexpr size_t ChunkSize = 256 * 1024u; //16384u;
-constexpr auto Version = 1u;
+// a context a seek has picked up keeps this much of what it inflated last, for
+// when a later seek goes back to it (see ZipByteSource::Impl::resumeNearest()).
+// grep starts reading a bit before what a bisect finds, so this needs to cover
+// that.
+constexpr size_t RecentSize = 1024 * 1024;
+// on a seek, up to this much of what we inflate on the way from a checkpoint
+// is kept as history. a seek lands in the middle of a record, and reading it
+// means going back to where it starts and to where its dictionary was cleared,
+// then following the dictionary's backrefs from there. with the default index,
+// half a checkpoint's worth covers that for the files we see; a 1MB history
+// made grep -o about 40% slower, with every bisect step inflating some of it
+// again from the checkpoint.
+constexpr size_t HistorySize = DefaultIndexEvery / 2;
+// inflated data goes straight into the FileByteSource's buffer, which is only
+// grown to this by the first seek: reading straight through needs no more than
+// the usual. it must be twice the history: the buffer is compacted down to
+// what's being read once less than a quarter of it is free, so with much less
+// room than this after the history, the first read on from a seek would throw
+// the history away.
+constexpr size_t SeekBufferSize = 2 * HistorySize;
+// version 2 added entries for the starts of gzip members, which have no window.
+// version 3 is binary (see IndexHeader); 1 and 2 were au files, still read.
+// version 4 added key samples (see au zindex -k).
+// version 5 added where records start at each entry (see RecordStart).
+constexpr auto Version = 5u;
+constexpr auto FirstBinaryVersion = 3u;
+constexpr auto LastAuVersion = 2u;
+constexpr size_t GzipTrailerSize = 8u; // crc32 and length
+// after the first, ranges of the file are inflated up to this far ahead of a
+// sequential read, on other threads, if it's been given them (see
+// ZipByteSource::setThreads()). see ZipByteSource::Impl::readParallel().
+constexpr size_t MaxRangesInFlight = 8u;
+// a file's index in AU_INDEX_DIR is named for a hash of this much of its start
+constexpr size_t IdentityLen = 64 * 1024u;
+// a block cache directory is kept to this, unless AU_BLOCK_CACHE_SIZE says
+// otherwise (see blockCacheBudget()). once it's past it, it's trimmed, least
+// recently used blocks first, down to BlockCacheLowWater of it: trimming scans
+// the whole directory, so it's left with room for a good few blocks more
+// before it needs doing again.
+constexpr uintmax_t DefaultBlockCacheBudget = 4ull * 1024 * 1024 * 1024;
+constexpr double BlockCacheLowWater = 0.875;
+
+/// The most a block cache directory is kept to: AU_BLOCK_CACHE_SIZE, in MiB,
+/// if that's set, otherwise DefaultBlockCacheBudget.
+uintmax_t blockCacheBudget() {
+  auto *size = ::getenv("AU_BLOCK_CACHE_SIZE");
+  if (!size || !*size) return DefaultBlockCacheBudget;
+  char *end;
+  errno = 0;
+  auto mib = std::strtoull(size, &end, 10);
+  if (*end || *size == '-' || (errno && errno != ERANGE)) {
+    std::cerr << "Ignoring AU_BLOCK_CACHE_SIZE of " << size
+              << ", which isn't a number of MiB\n";
+    return DefaultBlockCacheBudget;
+  }
+  constexpr auto Max = std::numeric_limits<uintmax_t>::max();
+  if (errno == ERANGE || mib > (Max >> 20)) return Max;
+  return static_cast<uintmax_t>(mib) << 20;
+}
 
 std::string getRealPath(const std::string &relPath) {
   char realPathBuf[PATH_MAX];
@@ -48,25 +134,32 @@ void X(int zlibErr) {
   if (zlibErr != Z_OK) throw ZlibError(zlibErr);
 }
 
-size_t makeWindow(uint8_t *out, size_t outSize, const uint8_t *in,
-                  uint64_t left) {
-  uint8_t temp[WindowSize];
-  // Could compress directly into out if I (mgodbolt, that is) wasn't so lazy.
+/// The last WindowSize bytes inflated, in order. inflate writes them round the
+/// circular buffer in, and has left bytes still to go before it wraps.
+std::vector<uint8_t> linearWindow(const uint8_t *in, uint64_t left) {
+  std::vector<uint8_t> window(WindowSize);
   if (left)
-    memcpy(temp, in + WindowSize - left, left);
+    memcpy(window.data(), in + WindowSize - left, left);
   if (left < WindowSize)
-    memcpy(temp + left, in, WindowSize - left);
-  uLongf destLen = outSize;
-  X(compress2(out, &destLen, temp, WindowSize, 9));
-  return destLen;
+    memcpy(window.data() + left, in, WindowSize - left);
+  return window;
+}
+
+std::string compressWindow(const std::vector<uint8_t> &window) {
+  std::string compressed(compressBound(WindowSize), '\0');
+  uLongf destLen = compressed.size();
+  X(compress2(reinterpret_cast<uint8_t *>(compressed.data()), &destLen,
+              window.data(), WindowSize, 9));
+  compressed.resize(destLen);
+  return compressed;
 }
 
-void uncompressWindow(const std::vector<uint8_t> &compressed, uint8_t *to,
-                      size_t len) {
-    uLongf destLen = len;
-    X(::uncompress(to, &len, &compressed[0], compressed.size()));
-    if (destLen != len)
-        THROW_RT("Unable to decompress a full window");
+void uncompressWindow(const uint8_t *compressed, size_t compressedLen,
+                      uint8_t *to, size_t len) {
+  uLongf destLen = len;
+  X(::uncompress(to, &destLen, compressed, compressedLen));
+  if (destLen != len)
+    THROW_RT("Unable to decompress a full window");
 }
 
 struct ZStream {
@@ -85,6 +178,11 @@ struct ZStream {
     X(inflateReset(&stream));
   }
 
+  void reset(Type newType) {
+    X(inflateReset2(&stream, static_cast<int>(newType)));
+    type = newType;
+  }
+
   ~ZStream() {
     (void)inflateEnd(&stream);
   }
@@ -93,97 +191,597 @@ struct ZStream {
   ZStream &operator=(ZStream &) = delete;
 };
 
+/// Everything needed to carry on inflating from some point in the stream,
+/// input buffer included. Output goes straight to whoever's reading. A context
+/// reads its input with pread() from its own offset, so it can be built up on
+/// another thread and handed over whole (see ZipByteSource::Impl's
+/// prefetch()). Only input that can't be pread() (stdin, say) is read from
+/// the FILE instead.
 struct CachedContext {
   ZStream zs_;
   size_t pos_ = 0; // current absolute position in stream
-  size_t cur_ = 0; // current offset into ZipByteSource::output_
-  size_t limit_ = 0; // number of valid bytes in ZipByteSource::output_
   bool eof_ = false;
+  // where to pread() the next input from, or nullopt to read the FILE
+  std::optional<size_t> compressedPos_;
+  std::unique_ptr<uint8_t[]> input_;
+  // what came just before pos_, for a context built in the background. it
+  // has no FileByteSource buffer to leave that in.
+  std::unique_ptr<char[]> history_;
+  size_t historyLen_ = 0;
+  // the last RecentSize bytes it inflated, in a ring, once a seek has picked it
+  // up: a later seek that picks it up again gets those as history too. reading
+  // straight through never seeks, and doesn't pay for copying it all twice.
+  std::unique_ptr<char[]> recent_;
+  size_t recentLen_ = 0; //< Everything written to recent_, wrapping included
 
   explicit CachedContext()
-      : zs_(ZStream::Type::ZlibOrGzip) {}
+      : zs_(ZStream::Type::ZlibOrGzip),
+        input_(new uint8_t[ChunkSize]) {}
+
+  CachedContext(size_t uncompressedOffset, size_t compressedOffset,
+                ZStream::Type type)
+      : zs_(type),
+        pos_(uncompressedOffset),
+        compressedPos_(compressedOffset),
+        input_(new uint8_t[ChunkSize]) {}
+
+  void keepRecent() {
+    if (!recent_) recent_.reset(new char[RecentSize]);
+  }
 
-  explicit CachedContext(size_t uncompressedOffset)
-      : zs_(ZStream::Type::Raw),
-        pos_(uncompressedOffset) {}
+  void remember(const char *buf, size_t len) {
+    if (!recent_ || !len) return;
+    if (len > RecentSize) {
+      recentLen_ += len - RecentSize;
+      buf += len - RecentSize;
+      len = RecentSize;
+    }
+    auto at = recentLen_ % RecentSize;
+    auto first = std::min(len, RecentSize - at);
+    ::memcpy(recent_.get() + at, buf, first);
+    ::memcpy(recent_.get(), buf + first, len - first);
+    recentLen_ += len;
+  }
+
+  /// Copies up to the last len bytes before pos_ to to. Returns how many.
+  size_t recall(char *to, size_t len) const {
+    if (!recent_) return 0;
+    len = std::min({len, recentLen_, RecentSize});
+    auto at = (recentLen_ - len) % RecentSize;
+    auto first = std::min(len, RecentSize - at);
+    ::memcpy(to, recent_.get() + at, first);
+    ::memcpy(to + first, recent_.get(), len - first);
+    return len;
+  }
 };
 
-std::string getIndexFilename(const std::string &filename,
-                          const std::optional<std::string> &indexFilename) {
-  if (indexFilename) return *indexFilename;
-  return getRealPath(filename) + ".auzx";
+/// Inflated data, left uninitialized until it's written: a block (see
+/// BlockCache) is 8MB or more, and always written over in full.
+class InflatedData {
+  std::unique_ptr<char[]> data_;
+  size_t size_;
+
+public:
+  explicit InflatedData(size_t size) : data_(new char[size]), size_(size) {}
+
+  char *data() { return data_.get(); }
+  const char *data() const { return data_.get(); }
+  size_t size() const { return size_; }
+};
+
+/// The inflated data between pairs of index entries (blocks), so a seek that
+/// lands in one can read from it without inflating anything: the last few used
+/// in memory, and all of them in a directory, if there is one, for later runs.
+/// Files there are named for the compressed file's device, inode, size and
+/// mtime, and where the block starts and ends, so a changed file (or index)
+/// can't be served stale data. Blocks of an earlier version of the file are
+/// removed when it's opened again, and the directory is kept to
+/// blockCacheBudget() by removing whichever blocks were used longest ago (a
+/// block's mtime is when it was last read). What's there is totted up when
+/// it's opened, and kept count of as blocks are added, so the directory is
+/// only scanned again once that's past the budget: blocks other runs add in
+/// the meantime only count from then on.
+class BlockCache {
+public:
+  using Block = std::shared_ptr<const InflatedData>;
+
+private:
+  static constexpr size_t MaxInMemory = 8;
+
+  std::string dir_;
+  std::string prefix_; //< Empty if in memory only
+  std::mutex mutex_;
+  std::deque<std::pair<size_t, Block>> blocks_; //< Most recently used last
+  std::atomic<bool> writable_ = true;
+  uintmax_t budget_ = 0;
+  std::atomic<uintmax_t> total_ = 0; //< Bytes of blocks in dir_, of any file
+  std::mutex trimMutex_;
+
+public:
+  BlockCache(const std::string &dir, const struct stat &compressedStat) {
+    if (dir.empty()) return;
+    if (::mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {
+      std::cerr << "Unable to create block cache " << dir << "\n";
+      writable_ = false;
+    }
+    dir_ = dir;
+    auto file = std::to_string(compressedStat.st_dev) + "-"
+                + std::to_string(compressedStat.st_ino) + "-";
+    prefix_ = file + std::to_string(compressedStat.st_size) + "-"
+              + std::to_string(compressedStat.st_mtime) + "-";
+    budget_ = blockCacheBudget();
+    std::error_code ec;
+    uintmax_t total = 0;
+    for (auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+      auto name = entry.path().filename().string();
+      if (!name.ends_with(".block")) continue;
+      // the file's been appended to or rewritten since these were written
+      if (name.starts_with(file) && !name.starts_with(prefix_)) {
+        std::filesystem::remove(entry.path(), ec);
+        continue;
+      }
+      auto size = entry.file_size(ec);
+      if (!ec) total += size;
+    }
+    total_ = total;
+    prefix_ = dir + "/" + prefix_;
+  }
+
+  /// The block from pos to pos + len, or null if we don't have it. Safe to
+  /// call from any thread.
+  Block find(size_t pos, size_t len) {
+    {
+      std::lock_guard lock(mutex_);
+      for (auto it = blocks_.begin(); it != blocks_.end(); ++it) {
+        if (it->first != pos) continue;
+        std::rotate(it, it + 1, blocks_.end());
+        return blocks_.back().second;
+      }
+    }
+    if (prefix_.empty()) return nullptr;
+    auto name = fileName(pos, len);
+    std::ifstream in(name, std::ios_base::binary);
+    if (!in) return nullptr;
+    auto block = std::make_shared<InflatedData>(len);
+    in.read(block->data(), static_cast<std::streamsize>(len));
+    if (static_cast<size_t>(in.gcount()) != len || in.peek() != EOF)
+      return nullptr;
+    // used just now, so last in line to be trimmed
+    ::utimes(name.c_str(), nullptr);
+    remember(pos, block);
+    return block;
+  }
+
+  /// Keep block, which starts at pos. Safe to call from any thread.
+  void add(size_t pos, const Block &block) {
+    remember(pos, block);
+    if (prefix_.empty() || !writable_) return;
+    // another run could be writing the same block, as could another source
+    // of this one (see scanInParallel())
+    auto name = fileName(pos, block->size());
+    auto temp = name + ".partial." + std::to_string(::getpid()) + "."
+                + std::to_string(
+                    std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    std::ofstream out(temp, std::ios_base::binary | std::ios_base::trunc);
+    out.write(block->data(), static_cast<std::streamsize>(block->size()));
+    out.close();
+    if (!out.fail() && ::rename(temp.c_str(), name.c_str()) == 0) {
+      if ((total_ += block->size()) > budget_) trim(name);
+      return;
+    }
+    ::unlink(temp.c_str());
+    if (writable_.exchange(false))
+      std::cerr << "Unable to write " << name << ", so blocks of "
+                << "this file will only be kept in memory\n";
+  }
+
+private:
+  std::string fileName(size_t pos, size_t len) const {
+    return prefix_ + std::to_string(pos) + "-" + std::to_string(pos + len)
+           + ".block";
+  }
+
+  /// Remove the blocks used longest ago, of any file, until what's left is
+  /// down to BlockCacheLowWater of budget_, and count what's left afresh. keep
+  /// is never removed. Other runs may be trimming too, so blocks that have
+  /// already gone are no matter.
+  void trim(const std::string &keep) {
+    std::lock_guard lock(trimMutex_);
+    // another thread got here first
+    if (total_ <= budget_) return;
+    struct Entry {
+      std::filesystem::file_time_type used;
+      uintmax_t size;
+      std::filesystem::path path;
+    };
+    auto kept = std::filesystem::path(keep).filename();
+    std::vector<Entry> entries;
+    uintmax_t total = 0;
+    std::error_code ec;
+    for (auto &entry : std::filesystem::directory_iterator(dir_, ec)) {
+      if (entry.path().extension() != ".block") continue;
+      auto size = entry.file_size(ec);
+      if (ec) continue;
+      total += size;
+      if (entry.path().filename() != kept)
+        entries.push_back(Entry{entry.last_write_time(ec), size, entry.path()});
+    }
+    auto lowWater = static_cast<uintmax_t>(
+        static_cast<double>(budget_) * BlockCacheLowWater);
+    if (total > lowWater) {
+      std::sort(entries.begin(), entries.end(),
+                [](const Entry &a, const Entry &b) { return a.used < b.used; });
+      for (auto &entry : entries) {
+        if (total <= lowWater) break;
+        std::filesystem::remove(entry.path, ec);
+        total -= entry.size;
+      }
+    }
+    total_ = total;
+  }
+
+  void remember(size_t pos, const Block &block) {
+    std::lock_guard lock(mutex_);
+    for (auto &kept : blocks_)
+      if (kept.first == pos) return; // another thread's
+    blocks_.emplace_back(pos, block);
+    if (blocks_.size() > MaxInMemory) blocks_.pop_front();
+  }
+};
+
+bool isGzipMagic(const uint8_t *p) { return p[0] == 0x1f && p[1] == 0x8b; }
+
+size_t preadRetrying(int fd, void *buf, size_t len, size_t offset) {
+  while (true) {
+    auto bytesRead = ::pread(fd, buf, len, static_cast<off_t>(offset));
+    if (bytesRead >= 0) return static_cast<size_t>(bytesRead);
+    if (errno != EINTR) throw ZlibError(Z_ERRNO);
+  }
 }
 
+/// bgzip (like anything else writing BGZF) writes a separate gzip member for
+/// every 64K of input, with its compressed size in an extra header field. So
+/// we can find the members without inflating anything, and then inflate them
+/// on separate threads. Returns where to start batches of members which each
+/// inflate to about batchSize, from the member at from on, then the end of
+/// the file. nullopt if any member lacks the size field.
+std::optional<std::vector<size_t>> bgzfBatches(int fd, size_t fileSize,
+                                               size_t batchSize,
+                                               size_t from) {
+  std::vector<size_t> batches;
+  std::vector<uint8_t> extra;
+  size_t inBatch = 0;
+  for (size_t pos = from; pos < fileSize;) {
+    uint8_t header[12];
+    if (preadRetrying(fd, header, sizeof(header), pos) != sizeof(header)
+        || !isGzipMagic(header) || header[2] != Z_DEFLATED
+        || !(header[3] & 0x04)) // FEXTRA
+      return std::nullopt;
+    extra.resize(header[10] | header[11] << 8u);
+    if (preadRetrying(fd, extra.data(), extra.size(), pos + sizeof(header))
+        != extra.size())
+      return std::nullopt;
+    std::optional<size_t> memberSize;
+    for (size_t i = 0; i + 4 <= extra.size();) {
+      size_t fieldLen = extra[i + 2] | extra[i + 3] << 8u;
+      if (extra[i] == 'B' && extra[i + 1] == 'C' && fieldLen == 2
+          && i + 6 <= extra.size())
+        memberSize = (extra[i + 4] | extra[i + 5] << 8u) + 1u;
+      i += 4 + fieldLen;
+    }
+    if (!memberSize || pos + *memberSize > fileSize) return std::nullopt;
+    // the trailer ends with the uncompressed size (mod 2^32, but these are
+    // never more than 64K)
+    uint8_t isize[4];
+    if (preadRetrying(fd, isize, sizeof(isize), pos + *memberSize - 4)
+        != sizeof(isize))
+      return std::nullopt;
+    if (batches.empty() || inBatch >= batchSize) {
+      batches.push_back(pos);
+      inBatch = 0;
+    }
+    inBatch += isize[0] | isize[1] << 8u | isize[2] << 16u
+               | static_cast<size_t>(isize[3]) << 24u;
+    pos += *memberSize;
+  }
+  if (batches.empty()) return std::nullopt;
+  batches.push_back(fileSize);
+  return batches;
 }
 
-int zindexFile(const std::string &fileName,
-               const std::optional<std::string> &indexFilename) {
-  size_t indexEvery = DefaultIndexEvery; // TODO extract
+/// Inflate (and so check) the whole gzip members between from and to,
+/// returning how much they inflate to.
+size_t inflateMembers(int fd, size_t from, size_t to, Throttle *throttle) {
+  ZStream zs(ZStream::Type::ZlibOrGzip);
+  auto input = std::make_unique<uint8_t[]>(ChunkSize);
+  uint8_t output[WindowSize];
+  size_t total = 0;
+  while (true) {
+    if (zs.stream.avail_in == 0) {
+      if (from == to) throw ZlibError(Z_DATA_ERROR);
+      auto bytesRead = preadRetrying(fd, input.get(),
+                                     std::min(ChunkSize, to - from), from);
+      if (!bytesRead) throw ZlibError(Z_DATA_ERROR);
+      if (throttle) throttle->account(bytesRead);
+      from += bytesRead;
+      zs.stream.next_in = input.get();
+      zs.stream.avail_in = static_cast<uInt>(bytesRead);
+    }
+    zs.stream.next_out = output;
+    zs.stream.avail_out = WindowSize;
+    auto ret = inflate(&zs.stream, Z_NO_FLUSH);
+    if (ret == Z_NEED_DICT) throw ZlibError(Z_DATA_ERROR);
+    if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) throw ZlibError(ret);
+    total += WindowSize - zs.stream.avail_out;
+    if (ret == Z_STREAM_END) {
+      if (zs.stream.avail_in == 0 && from == to) return total;
+      zs.reset();
+    }
+  }
+}
 
-  auto ifn = getIndexFilename(fileName, indexFilename);
-  std::cout << "Indexing " << fileName << " to " << ifn << "...\n";
+/// An index entry, as zindex writes it.
+struct Checkpoint {
+  uint64_t uncompressedOffset = 0;
+  uint64_t compressedOffset = 0;
+  int bitOffset = 0;
+  std::string window; //< Compressed. Empty at the start of a member
+};
 
-  // open gzipped file, or fail...
-  File from(fopen(fileName.c_str(), "rb"));
-  if (from.get() == nullptr) {
-      std::cerr << "Could not open " << fileName << " for reading\n";
-      return 1;
+/// A bounded queue between two stages of a pipeline. push() waits while it's
+/// full, and pop() while it's empty. Either end can close() it, after which
+/// pop() returns nullopt once it's drained and push() returns false, so a
+/// stage that stops (or fails) lets the others finish.
+template <typename T>
+class Channel {
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<T> items_;
+  const size_t capacity_;
+  bool closed_ = false;
+
+public:
+  explicit Channel(size_t capacity) : capacity_(capacity) {}
+
+  bool push(T item) {
+    std::unique_lock lock(mutex_);
+    cond_.wait(lock, [&] { return closed_ || items_.size() < capacity_; });
+    if (closed_) return false;
+    items_.push_back(std::move(item));
+    cond_.notify_all();
+    return true;
   }
-  struct stat compressedStat;
-  if (fstat(fileno(from.get()), &compressedStat) != 0)
-    throw ZlibError(Z_DATA_ERROR);
 
-  // open index file, or fail...
-  // TODO fail if file exists...
-  if (unlink(ifn.c_str()) == 0)
-    std::cout << "Rebuilding existing index " << ifn << std::endl;
-  std::ofstream out;
-  out.open(ifn, std::ios_base::binary);
-  if (!out) {
-    std::cerr << "Unable to open output " << ifn << std::endl; // TODO strerror, etc
-    return 1;
+  std::optional<T> pop() {
+    std::unique_lock lock(mutex_);
+    cond_.wait(lock, [&] { return closed_ || !items_.empty(); });
+    if (items_.empty()) return std::nullopt;
+    auto item = std::move(items_.front());
+    items_.pop_front();
+    cond_.notify_all();
+    return item;
   }
 
-  AuEncoder idx(AU_STR("Index of " << fileName << ", written by au"));
-  auto emit = [&](auto &&f) {
-    idx.encode(f, [&](std::string_view dict, std::string_view val) {
-      out << dict << val; // TODO error if write fails
-      return dict.size() + val.size();
-    });
+  void close() {
+    std::scoped_lock lock(mutex_);
+    closed_ = true;
+    cond_.notify_all();
+  }
+};
+
+/// Reads the whole of a FILE, a ChunkSize at a time, on a thread of its own,
+/// so inflating never waits on the disk (or the throttle).
+class ChunkReader {
+public:
+  struct Chunk {
+    std::unique_ptr<uint8_t[]> data;
+    size_t len = 0;
   };
 
-  emit([&](AuWriter &au) {
-    au.map(
-      "fileType", "zindex",
-      "version", Version,
-      "compressedFile", getBaseName(fileName),
-      "compressedSize", static_cast<uint64_t>(compressedStat.st_size),
-      "compressedModTime", static_cast<uint64_t>(compressedStat.st_mtime)
-    );
-  });
+private:
+  FILE *file_;
+  Throttle *throttle_;
+  Channel<Chunk> chunks_;
+  std::exception_ptr error_;
+  std::thread thread_;
+
+public:
+  ChunkReader(FILE *file, Throttle *throttle)
+      : file_(file), throttle_(throttle), chunks_(4),
+        thread_([this] { run(); }) {}
+
+  ~ChunkReader() {
+    chunks_.close();
+    thread_.join();
+  }
 
-  // actually build the index...
+  /// The next chunk, or nullopt at eof. Errors reading are rethrown here.
+  std::optional<Chunk> next() {
+    auto chunk = chunks_.pop();
+    if (!chunk && error_) std::rethrow_exception(error_);
+    return chunk;
+  }
+
+private:
+  void run() {
+    try {
+      while (true) {
+        Chunk chunk{std::unique_ptr<uint8_t[]>(new uint8_t[ChunkSize]), 0};
+        chunk.len = fread(chunk.data.get(), 1, ChunkSize, file_);
+        if (ferror(file_)) throw ZlibError(Z_ERRNO);
+        if (throttle_) throttle_->account(chunk.len);
+        if (!chunk.len || !chunks_.push(std::move(chunk))) break;
+      }
+    } catch (...) {
+      error_ = std::current_exception();
+    }
+    chunks_.close();
+  }
+};
+
+/// Compresses checkpoint windows (compress2() at level 9 isn't cheap) on a set
+/// of threads of its own.
+class WindowCompressor {
+  Channel<std::packaged_task<Checkpoint()>> tasks_;
+  std::vector<std::thread> threads_;
+
+public:
+  explicit WindowCompressor(size_t threads) : tasks_(threads) {
+    for (size_t i = 0; i < threads; i++)
+      threads_.emplace_back([this] {
+        while (auto task = tasks_.pop()) (*task)();
+      });
+  }
+
+  ~WindowCompressor() {
+    tasks_.close();
+    for (auto &thread : threads_) thread.join();
+  }
+
+  /// The checkpoint, with window (see linearWindow()) compressed into it.
+  std::future<Checkpoint> compress(Checkpoint checkpoint,
+                                   std::vector<uint8_t> window) {
+    std::packaged_task<Checkpoint()> task(
+        [checkpoint = std::move(checkpoint),
+         window = std::move(window)]() mutable {
+          checkpoint.window = compressWindow(window);
+          return std::move(checkpoint);
+        });
+    auto result = task.get_future();
+    tasks_.push(std::move(task)); // only we close it, so this can't fail
+    return result;
+  }
+};
+
+std::future<Checkpoint> ready(Checkpoint checkpoint) {
+  std::promise<Checkpoint> promise;
+  promise.set_value(std::move(checkpoint));
+  return promise.get_future();
+}
+
+/// How fast indexing is going, shown every so often and at the end. The
+/// inflating stage updates it, and the writing stage reports it.
+class Progress {
+  using Clock = std::chrono::steady_clock;
+  static constexpr auto ReportEvery = std::chrono::seconds(1);
+
+  const Clock::time_point start_ = Clock::now();
+  Clock::time_point lastReport_ = start_;
+  const uint64_t fromIn_;
+  const uint64_t fromOut_;
+  const uint64_t compressedSize_;
+  std::atomic<uint64_t> in_ = 0;
+  std::atomic<uint64_t> out_ = 0;
+
+public:
+  /// Counts what's read and inflated from from on, of compressedSize in all.
+  Progress(uint64_t compressedSize, const Checkpoint &from)
+      : fromIn_(from.compressedOffset), fromOut_(from.uncompressedOffset),
+        compressedSize_(compressedSize - fromIn_) {}
+
+  void update(uint64_t in, uint64_t out) {
+    in_.store(in - fromIn_, std::memory_order_relaxed);
+    out_.store(out - fromOut_, std::memory_order_relaxed);
+  }
+
+  void maybeReport(std::ostream &os) {
+    auto now = Clock::now();
+    if (now - lastReport_ < ReportEvery) return;
+    lastReport_ = now;
+    auto in = in_.load(std::memory_order_relaxed);
+    os << "Read " << mib(in) << " of " << mib(compressedSize_) << " MiB ("
+       << std::fixed << std::setprecision(1)
+       << (compressedSize_ ? 100.0 * static_cast<double>(in)
+                                 / static_cast<double>(compressedSize_)
+                           : 100.0)
+       << "%) at " << rate(in, now) << " MiB/s, inflating at "
+       << rate(out_.load(std::memory_order_relaxed), now) << " MiB/s\n";
+  }
+
+  void reportTotal(std::ostream &os) const {
+    auto now = Clock::now();
+    auto in = in_.load(std::memory_order_relaxed);
+    auto out = out_.load(std::memory_order_relaxed);
+    os << "Inflated " << mib(in) << " MiB to " << mib(out) << " MiB in "
+       << std::fixed << std::setprecision(1)
+       << std::chrono::duration<double>(now - start_).count() << "s ("
+       << rate(in, now) << " MiB/s in, " << rate(out, now) << " MiB/s out)\n";
+  }
+
+private:
+  static std::string mib(uint64_t bytes) {
+    return AU_STR(std::fixed << std::setprecision(1)
+                             << static_cast<double>(bytes) / (1 << 20));
+  }
+
+  std::string rate(uint64_t bytes, Clock::time_point now) const {
+    auto secs = std::chrono::duration<double>(now - start_).count();
+    return mib(secs > 0 ? static_cast<uint64_t>(static_cast<double>(bytes)
+                                                / secs)
+                        : 0);
+  }
+};
+
+/// How the inflating stage finished.
+struct Ending {
+  Checkpoint end; //< Marks the end of the data; it has no window
+  size_t members = 0;
+  bool trailingData = false;
+};
+
+/// For any gzip (or zlib) file: inflate it in order from start, which must be
+/// the start of a member, on this thread, handing each checkpoint on to be
+/// written as it's found. Reading the input and compressing windows are done
+/// on other threads.
+Ending inflateInOrder(FILE *from, const Checkpoint &start,
+                      uint64_t compressedSize, size_t indexEvery,
+                      size_t threads, Throttle *throttle, Progress &progress,
+                      Channel<std::future<Checkpoint>> &checkpoints) {
+  auto handOn = [&](std::future<Checkpoint> checkpoint) {
+    if (!checkpoints.push(std::move(checkpoint)))
+      THROW_RT("Stopped writing the index");
+  };
+  if (start.compressedOffset
+      && fseeko(from, static_cast<off_t>(start.compressedOffset), SEEK_SET))
+    throw ZlibError(Z_ERRNO);
+  WindowCompressor compressor(threads);
+  ChunkReader reader(from, throttle);
   ZStream zs(ZStream::Type::ZlibOrGzip);
-  uint8_t input[ChunkSize];
+  std::unique_ptr<uint8_t[]> input;
   uint8_t window[WindowSize];
-  std::vector<uint8_t> apWindow(compressBound(WindowSize));
 
-  int ret = 0;
-  uint64_t totalIn = 0;
-  uint64_t totalOut = 0;
-  uint64_t last = 0;
-  bool emitInitialAccessPoint = true;
-
-  do {
-    if (zs.stream.avail_in == 0) {
-      zs.stream.avail_in =
-        static_cast<uInt>(fread(input, 1, ChunkSize, from.get()));
-      if (ferror(from.get()))
-        throw ZlibError(Z_ERRNO);
-      if (zs.stream.avail_in == 0)
-        throw ZlibError(Z_DATA_ERROR);
-      zs.stream.next_in = input;
+  // take the next chunk of input, after whatever of it is still unused
+  auto fill = [&]() -> size_t {
+    auto chunk = reader.next();
+    if (!chunk) return 0;
+    if (zs.stream.avail_in) {
+      // only ever a byte or so, looking for the next member
+      auto joined = std::unique_ptr<uint8_t[]>(
+          new uint8_t[zs.stream.avail_in + chunk->len]);
+      ::memcpy(joined.get(), zs.stream.next_in, zs.stream.avail_in);
+      ::memcpy(joined.get() + zs.stream.avail_in, chunk->data.get(),
+               chunk->len);
+      chunk->data = std::move(joined);
     }
+    input = std::move(chunk->data);
+    zs.stream.next_in = input.get();
+    zs.stream.avail_in += static_cast<uInt>(chunk->len);
+    return chunk->len;
+  };
+
+  int ret = 0;
+  uint64_t totalIn = start.compressedOffset;
+  uint64_t totalOut = start.uncompressedOffset;
+  uint64_t last = totalOut;
+  Ending ending;
+  ending.members = 1;
+
+  // inflate needs nothing but the compressed data at the start of a member,
+  // so those make for the cheapest checkpoints: no window to store.
+  handOn(ready(start));
+  while (true) {
+    if (zs.stream.avail_in == 0 && !fill())
+      throw ZlibError(Z_DATA_ERROR);
     do {
       if (zs.stream.avail_out == 0) {
         zs.stream.avail_out = WindowSize;
@@ -200,70 +798,579 @@ int zindexFile(const std::string &fileName,
         throw ZlibError(ret);
       if (ret == Z_STREAM_END)
         break;
-      auto sinceLast = totalOut - last;
-      bool needsIndex = sinceLast > indexEvery
-                        || emitInitialAccessPoint;
+      bool needsIndex = totalOut - last > indexEvery;
       bool endOfBlock = zs.stream.data_type & 0x80;
       bool lastBlockInStream = zs.stream.data_type & 0x40;
       if (endOfBlock && !lastBlockInStream && needsIndex) {
-        std::cout << "Creating checkpoint at " << totalOut <<
-          " (compressed offset " << totalIn << ")\n";
-        auto size = makeWindow(apWindow.data(), apWindow.size(), window,
-            zs.stream.avail_out);
-        auto windowStr =
-            std::string_view(reinterpret_cast<char *>(apWindow.data()), size);
-        emit([&](AuWriter &au) {
-          au.map(
-            "uncompressedOffset", totalOut,
-            "compressedOffset", totalIn,
-            "bitOffset", zs.stream.data_type & 0x7,
-            "window", windowStr
-          );
-        });
-
+        handOn(compressor.compress(
+            Checkpoint{totalOut, totalIn, zs.stream.data_type & 0x7, {}},
+            linearWindow(window, zs.stream.avail_out)));
         last = totalOut;
-        emitInitialAccessPoint = false;
       }
-      //progress.update<PrettyBytes>(totalIn, compressedStat.st_size); TODO?
     } while (zs.stream.avail_in);
-  } while (ret != Z_STREAM_END);
+    progress.update(totalIn, totalOut);
+    if (ret != Z_STREAM_END) continue;
+
+    // that's the end of a gzip member. pigz, bgzip and plain old cat can
+    // all leave another one after it.
+    while (zs.stream.avail_in < 2 && fill()) {}
+    if (zs.stream.avail_in < 2 || !isGzipMagic(zs.stream.next_in)) break;
+    zs.reset();
+    ending.members++;
+    // members are checkpoints when one is due, rather than every time:
+    // bgzip's are only 64K each.
+    if (totalOut - last > indexEvery) {
+      handOn(ready(Checkpoint{totalOut, totalIn, 0, {}}));
+      last = totalOut;
+    }
+  }
+
+  ending.trailingData = zs.stream.avail_in || fill();
+  // it's not ours to read, but the index covers the whole file
+  ending.end = Checkpoint{totalOut,
+                          ending.trailingData ? compressedSize : totalIn,
+                          zs.stream.data_type & 0x7, {}};
+  return ending;
+}
 
-  if (zs.stream.avail_in || !feof(from.get())) {
-    std::cout << "\n"
-              << "WARNING: this file appears to contain multiple gzip blocks.\n"
-              << "This tool does not currently support such files!\n"
-              << "Data beyond the first block will not be indexed.\n\n";
+/// For BGZF files: inflate (and so check) each batch of members (see
+/// bgzfBatches()) on a thread of its own, and hand on a checkpoint at the
+/// start of each, in order.
+Ending inflateBatches(int fd, const Checkpoint &start,
+                      const std::vector<size_t> &batches, size_t threads,
+                      Throttle *throttle, Progress &progress,
+                      Channel<std::future<Checkpoint>> &checkpoints) {
+  std::deque<std::future<size_t>> inflating;
+  size_t next = 0;
+  uint64_t totalOut = start.uncompressedOffset;
+  for (size_t batch = 0; batch + 1 < batches.size(); batch++) {
+    for (; inflating.size() < threads && next + 1 < batches.size(); next++)
+      inflating.emplace_back(
+          std::async(std::launch::async, inflateMembers, fd, batches[next],
+                     batches[next + 1], throttle));
+    auto size = inflating.front().get();
+    inflating.pop_front();
+    if (!checkpoints.push(ready(Checkpoint{totalOut, batches[batch], 0, {}})))
+      THROW_RT("Stopped writing the index");
+    totalOut += size;
+    progress.update(batches[batch + 1], totalOut);
   }
+  Ending ending;
+  ending.end = Checkpoint{totalOut, batches.back(), 0, {}};
+  return ending;
+}
 
-  // TODO find a better way to record the total uncompressed size...
-  std::cout << "Writing final entry...\n";
-  emit([&](AuWriter &au) {
-    au.map(
-        "uncompressedOffset", totalOut,
-        "compressedOffset", totalIn,
-        "bitOffset", zs.stream.data_type & 0x7,
-        "window", ""
-    );
+/// The layout of a binary index, which is made to be mapped and searched in
+/// place: an IndexHeader, then the compressed windows, then the table of
+/// IndexEntrys pointing into them, then the compressed file's name, then the
+/// RecordStart of each entry if it's an au file, then any key samples (see
+/// encodeKeySamples()). Everything is in the byte order of the machine that
+/// wrote it.
+struct IndexHeader {
+  static constexpr char Magic[8] = {'a', 'u', 'z', 'i', 'n', 'd', 'e', 'x'};
+  static constexpr uint32_t ByteOrder = 0x01020304u;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder; //< ByteOrder, as written
+  uint64_t numEntries;
+  uint64_t entriesOffset;
+  uint64_t compressedSize;
+  uint64_t compressedModTime;
+  uint64_t nameOffset;
+  uint64_t nameLen;
+  // version 3 stopped here
+  uint64_t keysOffset; //< Zero if there are none
+  uint64_t keysLen;
+  // version 4 stopped here
+  uint64_t recordsOffset; //< Zero if there are none
+};
+
+struct IndexEntry {
+  uint64_t uncompressedOffset;
+  uint64_t compressedOffset;
+  uint64_t windowOffset; //< From the start of the index
+  /// Zero at the start of a gzip member, where inflate needs no history, and
+  /// in the final entry, which just marks the end.
+  uint32_t windowLen;
+  uint32_t bitOffset;
+};
+
+/// Where the first au record at or after an entry starts, and the dict-clear
+/// record its dictionary starts with: see AuByteSource::knownRecord().
+struct RecordStart {
+  static constexpr uint64_t None = ~uint64_t{0};
+
+  uint64_t pos; //< None if there's no record after the entry
+  uint64_t dictClear;
+};
+
+static_assert(sizeof(IndexHeader) == 88 && sizeof(IndexEntry) == 32
+                  && sizeof(RecordStart) == 16,
+              "The index layout mustn't depend on the compiler");
+
+/// Writes an index out: the windows as they come, then the entries and the
+/// header once they're all known. It's written to a temporary file, and only
+/// takes the index's name in commit(), so an interrupted build leaves no
+/// half-written index to trip over later.
+class IndexWriter {
+  std::string fileName_;
+  std::string tempName_;
+  std::ofstream out_;
+  IndexHeader header_{};
+  std::string compressedName_;
+  std::vector<IndexEntry> entries_;
+  uint64_t written_ = 0;
+  bool finished_ = false;
+
+public:
+  IndexWriter(const std::string &fileName)
+      : fileName_(fileName),
+        tempName_(fileName + ".partial"),
+        out_(tempName_, std::ios_base::binary | std::ios_base::trunc) {
+    write(&header_, sizeof(header_)); // for now
+  }
+
+  ~IndexWriter() {
+    if (out_.is_open()) ::unlink(tempName_.c_str());
+  }
+
+  bool ok() const { return static_cast<bool>(out_); }
+
+  void header(const std::string &compressedName,
+              const struct stat &compressedStat) {
+    compressedName_ = getBaseName(compressedName);
+    header_.compressedSize = static_cast<uint64_t>(compressedStat.st_size);
+    header_.compressedModTime = static_cast<uint64_t>(compressedStat.st_mtime);
+  }
+
+  void entry(const Checkpoint &checkpoint) {
+    entries_.emplace_back(IndexEntry{
+        checkpoint.uncompressedOffset, checkpoint.compressedOffset, written_,
+        static_cast<uint32_t>(checkpoint.window.size()),
+        static_cast<uint32_t>(checkpoint.bitOffset)});
+    write(checkpoint.window.data(), checkpoint.window.size());
+  }
+
+  /// Where the index is until commit(). Once finish()ed, it can be read from
+  /// there.
+  const std::string &tempName() const { return tempName_; }
+
+  /// Finish writing the index, all but for any key samples. Returns false if
+  /// writing failed.
+  bool finish() {
+    if (finished_) return ok();
+    finished_ = true;
+    // the entries are read in place, so must be aligned
+    align();
+    ::memcpy(header_.magic, IndexHeader::Magic, sizeof(header_.magic));
+    header_.version = Version;
+    header_.byteOrder = IndexHeader::ByteOrder;
+    header_.numEntries = entries_.size();
+    header_.entriesOffset = written_;
+    write(entries_.data(), entries_.size() * sizeof(IndexEntry));
+    header_.nameOffset = written_;
+    header_.nameLen = compressedName_.size();
+    write(compressedName_.data(), compressedName_.size());
+    writeHeader();
+    return ok();
+  }
+
+  /// Add the RecordStart of each entry to a finish()ed index.
+  void records(const std::vector<RecordStart> &records) {
+    out_.seekp(static_cast<std::streamoff>(written_));
+    align();
+    header_.recordsOffset = written_;
+    write(records.data(), records.size() * sizeof(RecordStart));
+    writeHeader();
+  }
+
+  /// Add key samples to a finish()ed index: see encodeKeySamples().
+  void keys(const std::vector<std::string> &keys,
+            const std::vector<KeySamples> &samples) {
+    auto encoded = encodeKeySamples(keys, samples);
+    out_.seekp(static_cast<std::streamoff>(written_));
+    header_.keysOffset = written_;
+    header_.keysLen = encoded.size();
+    write(encoded.data(), encoded.size());
+    writeHeader();
+  }
+
+  /// Returns false, leaving any existing index alone, if writing failed.
+  bool commit() {
+    finish();
+    out_.close();
+    if (out_.fail() || ::rename(tempName_.c_str(), fileName_.c_str()) != 0) {
+      ::unlink(tempName_.c_str());
+      return false;
+    }
+    return true;
+  }
+
+private:
+  void align() {
+    static const char padding[alignof(IndexEntry)] = {};
+    write(padding, (alignof(IndexEntry) - written_ % alignof(IndexEntry))
+                       % alignof(IndexEntry));
+  }
+
+  void writeHeader() {
+    out_.seekp(0);
+    out_.write(reinterpret_cast<const char *>(&header_), sizeof(header_));
+    out_.flush();
+  }
+
+  void write(const void *data, size_t len) {
+    out_.write(static_cast<const char *>(data),
+               static_cast<std::streamsize>(len));
+    written_ += len;
+  }
+};
+
+/// Builds the index of from, handing each entry to keep as it's made, in
+/// order but on a thread of its own. It starts at start, which must be the
+/// start of a gzip member, and is the first entry. Returns the final entry,
+/// which marks the end. Progress goes to log, if there is one.
+template <typename Keep>
+Checkpoint indexFile(FILE *from, const Checkpoint &start,
+                     const ZindexOptions &options, std::ostream *log,
+                     Keep &&keep) {
+  size_t indexEvery = DefaultIndexEvery; // TODO extract
+  auto threads =
+      options.threads
+          ? options.threads
+          : size_t{std::max(std::thread::hardware_concurrency(), 1u)};
+  auto fd = fileno(from);
+  struct stat compressedStat;
+  if (fstat(fd, &compressedStat) != 0)
+    throw ZlibError(Z_DATA_ERROR);
+  auto compressedSize = static_cast<uint64_t>(compressedStat.st_size);
+
+  auto batches =
+      bgzfBatches(fd, compressedSize, indexEvery, start.compressedOffset);
+  if (batches && log)
+    *log << "Inflating BGZF members on " << threads << " threads\n";
+
+  // the pipeline: a thread reading the input, this one inflating, threads
+  // compressing windows, and a thread writing the index (and reporting
+  // progress) in order
+  Progress progress(compressedSize, start);
+  Channel<std::future<Checkpoint>> checkpoints(2 * threads + 2);
+  std::exception_ptr writeError;
+  std::thread writer([&] {
+    try {
+      while (auto next = checkpoints.pop()) {
+        keep(next->get());
+        if (log) progress.maybeReport(*log);
+      }
+    } catch (...) {
+      writeError = std::current_exception();
+      checkpoints.close();
+    }
   });
+  Ending ending;
+  try {
+    ending = batches ? inflateBatches(fd, start, *batches, threads,
+                                      options.throttle, progress, checkpoints)
+                     : inflateInOrder(from, start, compressedSize, indexEvery,
+                                      threads, options.throttle, progress,
+                                      checkpoints);
+  } catch (...) {
+    checkpoints.close();
+    writer.join();
+    if (writeError) std::rethrow_exception(writeError);
+    throw;
+  }
+  checkpoints.close();
+  writer.join();
+  if (writeError) std::rethrow_exception(writeError);
+
+  if (log) {
+    if (ending.members > 1)
+      *log << "Indexed " << ending.members << " gzip members\n";
+    if (ending.trailingData)
+      *log << "\n"
+           << "WARNING: ignoring data after the last gzip member\n\n";
+    progress.reportTotal(*log);
+  }
+  return ending.end;
+}
 
-  std::cout << "Index complete.\n";
-  return 0;
+/// The name of a file's index in AU_INDEX_DIR: its base name, and a hash of
+/// its first IdentityLen bytes, read from fd. That's the same wherever the file
+/// is mounted or copied to, and appending gzip members (see au zindex
+/// --update) doesn't change it; the index itself says which size and mtime
+/// it's good for, and ZipByteSource checks that what it covers hasn't changed.
+std::string getCachedIndexName(const std::string &filename, int fd) {
+  std::vector<char> start(IdentityLen);
+  size_t len = 0;
+  while (len < start.size()) {
+    auto n = preadRetrying(fd, start.data() + len, start.size() - len, len);
+    if (!n) break;
+    len += n;
+  }
+  auto hash = crc32(crc32(0, nullptr, 0),
+                    reinterpret_cast<const Bytef *>(start.data()),
+                    static_cast<uInt>(len));
+  std::ostringstream name;
+  name << getBaseName(filename) << "-" << std::hex << std::setfill('0')
+       << std::setw(8) << hash << ".auzx";
+  return name.str();
 }
 
-struct Zindex {
-  struct IndexEntry {
-    size_t compressedOffset = 0;
-    size_t uncompressedOffset = 0;
-    int bitOffset = 0;
-    std::vector<uint8_t> window;
-  };
+/// -x if given, otherwise <path>.auzx, unless AU_INDEX_DIR names a directory
+/// to keep indexes in (see getCachedIndexName()), such as for files on a
+/// read-only mount, and there isn't one next to the file already. Only
+/// regular files are kept there: fd, filename opened already, is only read
+/// from if it's one, as anything else (a pipe, say) would lose what was read.
+std::string getIndexFilename(const std::string &filename,
+                             const std::optional<std::string> &indexFilename,
+                             int fd) {
+  if (indexFilename) return *indexFilename;
+  auto beside = getRealPath(filename) + ".auzx";
+  auto *dir = ::getenv("AU_INDEX_DIR");
+  if (!dir || !*dir || ::access(beside.c_str(), F_OK) == 0) return beside;
+  struct stat stats;
+  if (fstat(fd, &stats) != 0 || !S_ISREG(stats.st_mode)) return beside;
+  return std::string(dir) + "/" + getCachedIndexName(filename, fd);
+}
+
+/// Make AU_INDEX_DIR, if indexFilename (from getIndexFilename()) is to be
+/// written there and it isn't there yet.
+void makeIndexDir(const std::string &indexFilename) {
+  auto *dir = ::getenv("AU_INDEX_DIR");
+  if (!dir || !*dir || indexFilename.rfind(std::string(dir) + "/", 0) != 0)
+    return;
+  if (::mkdir(dir, 0777) != 0 && errno != EEXIST)
+    std::cerr << "Unable to create index directory " << dir << "\n";
+}
 
-  std::vector<IndexEntry> index_;
+/// Where seeks in a file indexed at indexFilename are noted for au zindex
+/// --refine, as 8-byte offsets into the uncompressed data. Only if it's there
+/// already: --refine starts it.
+std::string getSeekLogFilename(const std::string &indexFilename) {
+  return indexFilename + ".seeks";
+}
+
+}
+
+/// A whole file, mapped read-only.
+class MappedFile {
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+
+public:
+  MappedFile() = default;
+
+  /// Empty if filename can't be mapped, or is empty.
+  explicit MappedFile(const std::string &filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd == -1) return;
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+      auto size = static_cast<size_t>(sb.st_size);
+      auto *data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        data_ = static_cast<const uint8_t *>(data);
+        size_ = size;
+      }
+    }
+    ::close(fd);
+  }
+
+  MappedFile(MappedFile &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)),
+        size_(std::exchange(other.size_, 0)) {}
+
+  MappedFile &operator=(MappedFile &&other) noexcept {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    return *this;
+  }
+
+  ~MappedFile() {
+    if (data_) ::munmap(const_cast<uint8_t *>(data_), size_);
+  }
+
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+};
+
+/// An index, either mapped from a version 3 or later file, read from an older
+/// one, or built as we go. Entries are binary searched where they lie, and
+/// their windows left compressed until a seek needs one.
+class Zindex {
+  MappedFile mapped_;
+  // when not mapped
+  std::vector<IndexEntry> entries_;
+  std::vector<uint8_t> windows_;
+  const RecordStart *records_ = nullptr; //< If mapped, and there are any
+  std::string_view keys_; //< Encoded; decoded on first use
+  std::optional<std::map<std::string, KeySamples, std::less<>>> keySamples_;
+
+public:
   std::string compressedFilename;
   size_t compressedSize = 0;
   size_t compressedModTime = 0;
 
-  Zindex(const std::string &filename) {
+  /// An empty index of compressedName, for add()ing entries to as they're
+  /// made.
+  Zindex(const std::string &compressedName, const struct stat &compressedStat)
+      : compressedFilename(getBaseName(compressedName)),
+        compressedSize(static_cast<size_t>(compressedStat.st_size)),
+        compressedModTime(static_cast<size_t>(compressedStat.st_mtime)) {}
+
+  void add(const Checkpoint &checkpoint) {
+    entries_.emplace_back(IndexEntry{
+        checkpoint.uncompressedOffset, checkpoint.compressedOffset,
+        windows_.size(), static_cast<uint32_t>(checkpoint.window.size()),
+        static_cast<uint32_t>(checkpoint.bitOffset)});
+    windows_.insert(windows_.end(), checkpoint.window.begin(),
+                    checkpoint.window.end());
+  }
+
+  Zindex(const std::string &filename) : mapped_(filename) {
+    if (mapped_.size() < sizeof(IndexHeader)
+        || ::memcmp(mapped_.data(), IndexHeader::Magic,
+                    sizeof(IndexHeader::Magic)) != 0) {
+      mapped_ = MappedFile();
+      readAuIndex(filename);
+    } else {
+      readHeader(filename);
+    }
+
+    if (!numEntries())
+      THROW_RT("Index " << filename <<  " should contain at least one entry!");
+
+    const auto &last = entry(numEntries() - 1);
+    if (last.windowLen) {
+      THROW_RT("Index " << filename << " appears to be incomplete: Final entry"
+               " has non-empty compression window data.");
+    }
+
+    if (last.compressedOffset != compressedSize) {
+      THROW_RT("Index " << filename << " appears to be incomplete: Final entry"
+               " has compressed offset " << last.compressedOffset
+               << " but metadata shows compressed size " << compressedSize);
+    }
+  }
+
+  size_t numEntries() const {
+    return mapped_.data() ? header().numEntries : entries_.size();
+  }
+
+  const IndexEntry &entry(size_t i) const {
+    return entries()[i];
+  }
+
+  size_t uncompressedSize() const {
+    // total stream size is "start" of dummy final entry
+    return entry(numEntries() - 1).uncompressedOffset;
+  }
+
+  const IndexEntry &find(size_t abspos) const {
+    auto next = after(abspos);
+    if (next == 0)
+      THROW_RT("Couldn't find index entry containing " << abspos);
+    return entry(next - 1);
+  }
+
+  /// The index of the first entry starting after abspos.
+  size_t after(size_t abspos) const {
+    auto *begin = entries();
+    return static_cast<size_t>(
+        std::upper_bound(begin, begin + numEntries(), abspos,
+                         [](size_t pos, const IndexEntry &entry) {
+                           return pos < entry.uncompressedOffset;
+                         })
+        - begin);
+  }
+
+  /// Decompress entry's window (which mustn't be empty) into to, which has
+  /// room for WindowSize bytes.
+  void window(const IndexEntry &entry, uint8_t *to) const {
+    auto compressed = compressedWindow(entry);
+    uncompressWindow(reinterpret_cast<const uint8_t *>(compressed.data()),
+                     compressed.size(), to, WindowSize);
+  }
+
+  /// Each entry's RecordStart, or null if they aren't known.
+  const RecordStart *records() const { return records_; }
+
+  /// The first record at or after abspos, if the index knows where it is.
+  std::optional<AuByteSource::KnownRecord> knownRecord(size_t abspos) const {
+    auto next = after(abspos);
+    if (!records_ || next == 0 || next == numEntries()) return std::nullopt;
+    auto &record = records_[next - 1];
+    if (record.pos == RecordStart::None || abspos > record.pos)
+      return std::nullopt;
+    return AuByteSource::KnownRecord{record.pos, record.dictClear};
+  }
+
+  /// Key samples (see au zindex -k) by key. Empty if there are none.
+  const std::map<std::string, KeySamples, std::less<>> &keySamples() {
+    if (!keySamples_) keySamples_ = decodeKeySamples(keys_);
+    return *keySamples_;
+  }
+
+  std::string_view compressedWindow(const IndexEntry &entry) const {
+    const uint8_t *windows = mapped_.data() ? mapped_.data() : windows_.data();
+    auto size = mapped_.data() ? mapped_.size() : windows_.size();
+    if (entry.windowOffset > size
+        || entry.windowLen > size - entry.windowOffset)
+      THROW_RT("Window at " << entry.windowOffset << " runs off the end of the"
+               " index");
+    return {reinterpret_cast<const char *>(windows + entry.windowOffset),
+            entry.windowLen};
+  }
+
+private:
+  const IndexHeader &header() const {
+    return *reinterpret_cast<const IndexHeader *>(mapped_.data());
+  }
+
+  const IndexEntry *entries() const {
+    if (!mapped_.data()) return entries_.data();
+    return reinterpret_cast<const IndexEntry *>(mapped_.data()
+                                                + header().entriesOffset);
+  }
+
+  void readHeader(const std::string &filename) {
+    auto &h = header();
+    if (h.byteOrder != IndexHeader::ByteOrder)
+      THROW_RT("Index " << filename << " was written on a machine with a"
+               " different byte order");
+    if (h.version < FirstBinaryVersion || h.version > Version)
+      THROW_RT("Wrong version in index " << filename
+               << ", expected version " << Version << " or earlier");
+    auto size = mapped_.size();
+    if (h.entriesOffset % alignof(IndexEntry) || h.entriesOffset > size
+        || h.numEntries > (size - h.entriesOffset) / sizeof(IndexEntry)
+        || h.nameOffset > size || h.nameLen > size - h.nameOffset)
+      THROW_RT("Index " << filename << " is truncated or corrupt");
+    if (h.version > FirstBinaryVersion && h.keysOffset) {
+      if (h.keysOffset > size || h.keysLen > size - h.keysOffset)
+        THROW_RT("Index " << filename << " is truncated or corrupt");
+      keys_ = std::string_view(
+          reinterpret_cast<const char *>(mapped_.data() + h.keysOffset),
+          h.keysLen);
+    }
+    if (h.version > 4 && h.recordsOffset) {
+      if (h.recordsOffset % alignof(RecordStart) || h.recordsOffset > size
+          || h.numEntries > (size - h.recordsOffset) / sizeof(RecordStart))
+        THROW_RT("Index " << filename << " is truncated or corrupt");
+      records_ = reinterpret_cast<const RecordStart *>(mapped_.data()
+                                                       + h.recordsOffset);
+    }
+    compressedFilename = std::string(
+        reinterpret_cast<const char *>(mapped_.data() + h.nameOffset),
+        h.nameLen);
+    compressedSize = h.compressedSize;
+    compressedModTime = h.compressedModTime;
+  }
+
+  /// Versions 1 and 2 were au files: a header record, then one per entry.
+  void readAuIndex(const std::string &filename) {
     FileByteSourceImpl source(filename);
     Dictionary dictionary;
 
@@ -277,8 +1384,10 @@ struct Zindex {
                                      meta["fileType"].GetStringLength());
     if (fileType != "zindex")
       THROW_RT("Wrong fileType in index " << filename << ", expected 'zindex'");
-    if (!meta["version"].IsInt() || meta["version"].GetInt() != 1)
-      THROW_RT("Wrong version in index " << filename << ", expected version 1");
+    if (!meta["version"].IsInt() || meta["version"].GetInt() < 1
+        || meta["version"].GetInt() > static_cast<int>(LastAuVersion))
+      THROW_RT("Wrong version in index " << filename
+               << ", expected version " << Version << " or earlier");
     compressedFilename =
         std::string_view(meta["compressedFile"].GetString(),
                          meta["compressedFile"].GetStringLength());
@@ -289,89 +1398,611 @@ struct Zindex {
       DocumentParser entryParser;
       entryParser.parse(source, dictionary);
       auto &entry = entryParser.document();
-      auto compressedOffset = entry["compressedOffset"].GetUint64();
-      auto uncompressedStartOffset = entry["uncompressedOffset"].GetUint64();
-      auto bitOffset = entry["bitOffset"].GetInt();
       auto window = std::string_view(entry["window"].GetString(),
           entry["window"].GetStringLength());
-      index_.emplace_back(IndexEntry {
-        compressedOffset,
-        uncompressedStartOffset,
-        bitOffset,
-        std::vector<uint8_t>(window.begin(), window.end())
-      });
+      add(Checkpoint{entry["uncompressedOffset"].GetUint64(),
+                     entry["compressedOffset"].GetUint64(),
+                     entry["bitOffset"].GetInt(), std::string(window)});
     }
+  }
+};
 
-    if (index_.empty())
-      THROW_RT("Index " << filename <<  " should contain at least one entry!");
+namespace {
 
-    const auto &last = index_.back();
-    if (!last.window.empty()) {
-      THROW_RT("Index " << filename << " appears to be incomplete: Final entry"
-               " has non-empty compression window data.");
+/// Whether the data between the last two entries of index still inflates as
+/// it did, ending a gzip member just where the index ends. That's as much as
+/// we can cheaply check that the file has only been appended to since.
+bool stillEndsWhereItDid(int fd, const Zindex &index) {
+  auto numEntries = index.numEntries();
+  if (numEntries < 2) return false;
+  auto &from = index.entry(numEntries - 2);
+  auto &end = index.entry(numEntries - 1);
+  auto pos = from.compressedOffset;
+  ZStream zs(from.windowLen ? ZStream::Type::Raw : ZStream::Type::ZlibOrGzip);
+  if (from.windowLen) {
+    uint8_t window[WindowSize];
+    index.window(from, window);
+    if (from.bitOffset) {
+      uint8_t ch;
+      if (preadRetrying(fd, &ch, 1, pos - 1) != 1) return false;
+      X(inflatePrime(&zs.stream, static_cast<int>(from.bitOffset),
+                     ch >> (8 - from.bitOffset)));
     }
+    X(inflateSetDictionary(&zs.stream, window, WindowSize));
+  }
 
-    if (last.compressedOffset != compressedSize) {
-      THROW_RT("Index " << filename << " appears to be incomplete: Final entry"
-               " has compressed offset " << last.compressedOffset
-               << " but metadata shows compressed size " << compressedSize);
+  std::unique_ptr<uint8_t[]> input(new uint8_t[ChunkSize]);
+  uint8_t discard[WindowSize];
+  auto out = from.uncompressedOffset;
+  bool memberEnded = false;
+  size_t trailerLeft = 0;
+  while (true) {
+    if (memberEnded && !trailerLeft) {
+      if (pos - zs.stream.avail_in == end.compressedOffset)
+        return out == end.uncompressedOffset;
+      zs.reset(ZStream::Type::ZlibOrGzip);
+      memberEnded = false;
+    }
+    if (!zs.stream.avail_in) {
+      // no further than the end: the member must be over by then
+      auto len = std::min(uint64_t{ChunkSize}, end.compressedOffset - pos);
+      if (!len || preadRetrying(fd, input.get(), len, pos) != len)
+        return false;
+      pos += len;
+      zs.stream.next_in = input.get();
+      zs.stream.avail_in = static_cast<uInt>(len);
+    }
+    if (trailerLeft) {
+      auto n = std::min(trailerLeft, size_t{zs.stream.avail_in});
+      zs.stream.next_in += n;
+      zs.stream.avail_in -= static_cast<uInt>(n);
+      trailerLeft -= n;
+      continue;
+    }
+    zs.stream.next_out = discard;
+    zs.stream.avail_out = WindowSize;
+    auto ret = inflate(&zs.stream, Z_NO_FLUSH);
+    out += WindowSize - zs.stream.avail_out;
+    if (ret == Z_STREAM_END) {
+      memberEnded = true;
+      // raw deflate data stops short of the member's trailer
+      if (zs.type == ZStream::Type::Raw) trailerLeft = GzipTrailerSize;
+    } else if (ret != Z_OK) {
+      return false;
     }
   }
+}
 
-  size_t numEntries() const { return index_.size(); }
+/// Checkpoints every RefineEvery or so between entry and the next of index,
+/// found just as indexFile() finds them, by inflating from one to the other.
+std::vector<Checkpoint> refineSpan(int fd, const Zindex &index, size_t entry) {
+  auto &from = index.entry(entry);
+  auto end = index.entry(entry + 1).uncompressedOffset;
+  auto pos = from.compressedOffset;
+  ZStream zs(from.windowLen ? ZStream::Type::Raw : ZStream::Type::ZlibOrGzip);
+  uint8_t window[WindowSize];
+  if (from.windowLen) {
+    index.window(from, window);
+    if (from.bitOffset) {
+      uint8_t ch;
+      if (preadRetrying(fd, &ch, 1, pos - 1) != 1)
+        throw ZlibError(Z_DATA_ERROR);
+      X(inflatePrime(&zs.stream, static_cast<int>(from.bitOffset),
+                     ch >> (8 - from.bitOffset)));
+    }
+    X(inflateSetDictionary(&zs.stream, window, WindowSize));
+  }
 
-  size_t uncompressedSize() const {
-    // total stream size is "start" of dummy final entry
-    return index_.back().uncompressedOffset;
+  std::unique_ptr<uint8_t[]> input(new uint8_t[ChunkSize]);
+  auto fill = [&] {
+    auto len = preadRetrying(fd, input.get(), ChunkSize, pos);
+    if (!len) throw ZlibError(Z_DATA_ERROR);
+    pos += len;
+    zs.stream.next_in = input.get();
+    zs.stream.avail_in = static_cast<uInt>(len);
+  };
+
+  std::vector<Checkpoint> result;
+  uint64_t totalIn = from.compressedOffset;
+  uint64_t totalOut = from.uncompressedOffset;
+  uint64_t last = totalOut;
+  // none so close to the next entry as to be no use
+  auto due = [&] {
+    return totalOut - last > RefineEvery && totalOut + RefineEvery < end;
+  };
+  while (totalOut < end) {
+    if (!zs.stream.avail_in) fill();
+    if (zs.stream.avail_out == 0) {
+      zs.stream.avail_out = WindowSize;
+      zs.stream.next_out = window;
+    }
+    totalIn += zs.stream.avail_in;
+    totalOut += zs.stream.avail_out;
+    auto ret = inflate(&zs.stream, Z_BLOCK);
+    totalIn -= zs.stream.avail_in;
+    totalOut -= zs.stream.avail_out;
+    if (ret == Z_NEED_DICT) throw ZlibError(Z_DATA_ERROR);
+    if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) throw ZlibError(ret);
+    if (ret == Z_STREAM_END) {
+      if (totalOut >= end) break;
+      // on to the next member, past the trailer raw deflate data stops short
+      // of
+      auto trailer = zs.type == ZStream::Type::Raw ? GzipTrailerSize : 0;
+      while (trailer) {
+        if (!zs.stream.avail_in) fill();
+        auto n = std::min(trailer, size_t{zs.stream.avail_in});
+        zs.stream.next_in += n;
+        zs.stream.avail_in -= static_cast<uInt>(n);
+        totalIn += n;
+        trailer -= n;
+      }
+      if (!zs.stream.avail_in) fill();
+      zs.reset(ZStream::Type::ZlibOrGzip);
+      if (due()) {
+        result.push_back(Checkpoint{totalOut, totalIn, 0, {}});
+        last = totalOut;
+      }
+      continue;
+    }
+    bool endOfBlock = zs.stream.data_type & 0x80;
+    bool lastBlockInStream = zs.stream.data_type & 0x40;
+    if (endOfBlock && !lastBlockInStream && due()) {
+      result.push_back(Checkpoint{
+          totalOut, totalIn, zs.stream.data_type & 0x7,
+          compressWindow(linearWindow(window, zs.stream.avail_out))});
+      last = totalOut;
+    }
+  }
+  return result;
+}
+
+/// Walks the records of an au file in order, noting each entry's RecordStart,
+/// and sampling keys from there to the next entry. Values are only parsed
+/// while there are keys left to sample: the rest are skipped over.
+class CheckpointWalker : public DictionaryTracker {
+  Dictionary &dictionary_;
+  const Zindex &index_;
+  std::vector<RecordStart> &records_;
+  std::vector<KeySamples> &samples_;
+  KeyCapture capture_;
+  std::vector<bool> sampled_;
+  size_t unsampled_ = 0;
+  size_t next_ = 0; //< The next entry to find the record after
+  size_t sor_ = 0;
+
+public:
+  CheckpointWalker(Dictionary &dictionary, const Zindex &index,
+                   const std::vector<std::string> &keys,
+                   std::vector<RecordStart> &records,
+                   std::vector<KeySamples> &samples)
+      : DictionaryTracker(dictionary), dictionary_(dictionary), index_(index),
+        records_(records), samples_(samples), capture_(keys),
+        sampled_(keys.size()) {}
+
+  /// The next entry to find the record after.
+  size_t next() const { return next_; }
+
+  /// Start again at entry, with the source synced to the first record after
+  /// it.
+  void resume(size_t entry) {
+    next_ = entry;
+    unsampled_ = 0;
   }
 
-  IndexEntry &find(size_t abspos) {
-    auto it = std::upper_bound(
-        index_.begin(), index_.end(), abspos,
-        [](size_t pos, const IndexEntry &entry) {
-          return pos < entry.uncompressedOffset;
-        });
-    if (it == index_.begin())
-      THROW_RT("Couldn't find index entry containing " << abspos);
-    --it;
-    return *it;
+  void onRecordStart(size_t pos) {
+    sor_ = pos;
+    DictionaryTracker::onRecordStart(pos);
+  }
+
+  template <typename Source>
+  void onValue(size_t relDictPos, size_t len, Source &source) {
+    auto &dict = dictionary_.findDictionary(sor_, relDictPos);
+    // a long enough record is the first after more than one entry
+    while (next_ + 1 < index_.numEntries()
+           && index_.entry(next_).uncompressedOffset <= sor_) {
+      records_[next_++] = RecordStart{sor_, dict.startPos_};
+      sampled_.assign(sampled_.size(), false);
+      unsampled_ = sampled_.size();
+    }
+    if (!unsampled_) {
+      source.skip(len);
+      return;
+    }
+    capture_.onValue(source, dict);
+    auto &values = capture_.values();
+    for (size_t i = 0; i < values.size(); i++) {
+      if (sampled_[i] || !values[i]) continue;
+      samples_[i].push_back(KeySample{sor_, std::move(*values[i])});
+      sampled_[i] = true;
+      unsampled_--;
+    }
   }
 };
 
+/// Fills in records (if fileName is an au file; it's left empty if not) and
+/// samples (one per key) for each entry of the index at indexName, from entry
+/// first on, up to entry last if given.
+void walkCheckpoints(const std::string &fileName, const std::string &indexName,
+                     const std::vector<std::string> &keys, size_t first,
+                     std::vector<RecordStart> &records,
+                     std::vector<KeySamples> &samples,
+                     size_t last = std::numeric_limits<size_t>::max()) {
+  Zindex index(indexName);
+  ZipByteSource source(fileName, indexName);
+  if (!isAuFile(source)) {
+    records.clear();
+    if (keys.empty()) return;
+    KeySampler sampler(source, keys);
+    for (size_t i = first; i + 1 < index.numEntries(); i++) {
+      try {
+        sampler.sample(index.entry(i).uncompressedOffset,
+                       index.entry(i + 1).uncompressedOffset, samples);
+      } catch (parse_error &) {
+        // then this checkpoint goes without. a binary search will find its
+        // way there the usual way.
+      }
+    }
+    return;
+  }
+
+  if (records.size() < first) {
+    // there are none to keep, so start again from the top
+    first = 0;
+    for (auto &keySamples : samples) keySamples.clear();
+  }
+  records.resize(index.numEntries(), RecordStart{RecordStart::None, 0});
+  Dictionary dictionary(32);
+  CheckpointWalker walker(dictionary, index, keys, records, samples);
+  for (auto i = first; i + 1 < index.numEntries() && i < last;) {
+    try {
+      source.seek(index.entry(i).uncompressedOffset);
+      if (!TailHandler(dictionary, source).sync()) return;
+      walker.resume(i);
+      RecordParser parser(source, walker);
+      while (walker.next() < last && !source.peek().isEof()) parser.record();
+      return;
+    } catch (std::exception &) {
+      // then the rest of this checkpoint goes without (as does a record cut
+      // short at the end of the file), and we start again from the next
+      i = std::max(i + 1, walker.next());
+    }
+  }
+}
+
+/// au zindex --refine: add checkpoints to the up-to-date index ifn of
+/// fileName between those that the seek log (see getSeekLogFilename()) says
+/// seeks keep landing far from, and start the log afresh.
+int refineIndex(const std::string &fileName, const std::string &ifn) {
+  File from(fopen(fileName.c_str(), "rb"));
+  if (from.get() == nullptr) {
+    std::cerr << "Could not open " << fileName << " for reading\n";
+    return 1;
+  }
+  struct stat compressedStat;
+  if (fstat(fileno(from.get()), &compressedStat) != 0)
+    throw ZlibError(Z_DATA_ERROR);
+  if (::access(ifn.c_str(), F_OK) != 0) {
+    std::cerr << "There's no index " << ifn << " to refine: run au zindex"
+              << " first\n";
+    return 1;
+  }
+  Zindex existing(ifn);
+  if (existing.compressedFilename != getBaseName(fileName)
+      || existing.compressedSize
+             != static_cast<size_t>(compressedStat.st_size)
+      || existing.compressedModTime
+             != static_cast<size_t>(compressedStat.st_mtime)) {
+    std::cerr << "Index " << ifn << " is out of date: bring it up to date with"
+              << " au zindex --update first\n";
+    return 1;
+  }
+
+  auto seekLog = getSeekLogFilename(ifn);
+  std::ifstream log(seekLog, std::ios_base::binary);
+  if (!log) {
+    if (!std::ofstream(seekLog, std::ios_base::binary)) {
+      std::cerr << "Unable to create " << seekLog << std::endl;
+      return 1;
+    }
+    std::cout << "Noting seeks in " << fileName << " in " << seekLog
+              << " from now on. Run au zindex --refine again once it's been"
+              << " searched a while.\n";
+    return 0;
+  }
+
+  // seeks between each entry and the next
+  std::vector<size_t> seeks(existing.numEntries());
+  uint64_t pos;
+  while (log.read(reinterpret_cast<char *>(&pos), sizeof(pos)))
+    seeks[existing.after(pos) - 1]++;
+  log.close();
+  std::vector<size_t> hot;
+  for (size_t i = 0; i + 1 < existing.numEntries(); i++)
+    if (seeks[i] >= RefineSeeks
+        && existing.entry(i + 1).uncompressedOffset
+                   - existing.entry(i).uncompressedOffset
+               > 2 * RefineEvery)
+      hot.push_back(i);
+  if (hot.empty()) {
+    std::cout << "Nothing to refine: no part of " << fileName << " has been"
+              << " sought often enough yet.\n";
+    return 0;
+  }
+
+  std::cout << "Refining " << ifn << "...\n";
+  IndexWriter out(ifn);
+  if (!out.ok()) {
+    std::cerr << "Unable to open output " << ifn << std::endl;
+    return 1;
+  }
+  out.header(fileName, compressedStat);
+  auto copy = [&](const IndexEntry &entry) {
+    out.entry(Checkpoint{
+        entry.uncompressedOffset, entry.compressedOffset,
+        static_cast<int>(entry.bitOffset),
+        entry.windowLen ? std::string(existing.compressedWindow(entry))
+                        : std::string()});
+  };
+  // where the records are known, they're still known; those after the new
+  // entries are found below. each span is that of the new entries in one of
+  // the hot ones, up to the next of the old.
+  auto *existingRecords = existing.records();
+  std::vector<RecordStart> records;
+  std::vector<std::pair<size_t, size_t>> spans;
+  auto nextHot = hot.begin();
+  for (size_t i = 0; i < existing.numEntries(); i++) {
+    copy(existing.entry(i));
+    if (existingRecords) records.push_back(existingRecords[i]);
+    if (nextHot == hot.end() || *nextHot != i) continue;
+    ++nextHot;
+    auto added = refineSpan(fileno(from.get()), existing, i);
+    std::cout << "Adding " << added.size() << " checkpoints after "
+              << existing.entry(i).uncompressedOffset << ", sought "
+              << seeks[i] << " times\n";
+    if (added.empty()) continue;
+    spans.emplace_back(records.size(), records.size() + added.size());
+    for (auto &checkpoint : added) {
+      out.entry(checkpoint);
+      if (existingRecords)
+        records.push_back(RecordStart{RecordStart::None, 0});
+    }
+  }
+
+  if (out.finish() && existingRecords) {
+    std::cout << "Reading the first record after each new checkpoint...\n";
+    std::vector<KeySamples> noSamples;
+    for (auto [first, last] : spans)
+      walkCheckpoints(fileName, out.tempName(), {}, first, records, noSamples,
+                      last);
+    out.records(records);
+  }
+  // the samples are still good, just no closer together than they were
+  auto &existingSamples = existing.keySamples();
+  if (!existingSamples.empty()) {
+    std::vector<std::string> keys;
+    std::vector<KeySamples> samples;
+    for (auto &[key, keySamples] : existingSamples) {
+      keys.push_back(key);
+      samples.push_back(keySamples);
+    }
+    out.keys(keys, samples);
+  }
+  if (!out.commit()) {
+    std::cerr << "Unable to write " << ifn << std::endl;
+    return 1;
+  }
+  // those seeks won't land so far from a checkpoint again
+  std::ofstream(seekLog, std::ios_base::binary | std::ios_base::trunc);
+  std::cout << "Index refined.\n";
+  return 0;
+}
+
+}
+
+int zindexFile(const std::string &fileName,
+               const std::optional<std::string> &indexFilename,
+               const ZindexOptions &options) {
+  // open gzipped file, or fail...
+  File from(fopen(fileName.c_str(), "rb"));
+  if (from.get() == nullptr) {
+      std::cerr << "Could not open " << fileName << " for reading\n";
+      return 1;
+  }
+  auto ifn = getIndexFilename(fileName, indexFilename, fileno(from.get()));
+  if (options.refine) return refineIndex(fileName, ifn);
+  std::cout << "Indexing " << fileName << " to " << ifn << "...\n";
+  struct stat compressedStat;
+  if (fstat(fileno(from.get()), &compressedStat) != 0)
+    throw ZlibError(Z_DATA_ERROR);
+
+  // with --update, keep what we can of the existing index, and only inflate
+  // the gzip members appended since
+  std::optional<Zindex> existing;
+  if (options.update && ::access(ifn.c_str(), F_OK) == 0) {
+    std::string why;
+    try {
+      existing.emplace(ifn);
+      auto size = static_cast<size_t>(compressedStat.st_size);
+      if (existing->compressedFilename != getBaseName(fileName))
+        why = "it's an index of " + existing->compressedFilename;
+      else if (size < existing->compressedSize)
+        why = "the file has shrunk since";
+      else if (size == existing->compressedSize
+               && existing->compressedModTime
+                      == static_cast<size_t>(compressedStat.st_mtime)) {
+        std::cout << "Index is up to date.\n";
+        return 0;
+      } else if (size == existing->compressedSize
+                 || !stillEndsWhereItDid(fileno(from.get()), *existing))
+        why = "the file has been modified, not just appended to";
+    } catch (std::exception &e) {
+      why = e.what();
+    }
+    if (!why.empty()) {
+      std::cout << "Can't update existing index " << ifn << ": " << why
+                << "\n";
+      existing.reset();
+    }
+  }
+
+  // open index file, or fail...
+  // TODO fail if file exists...
+  if (!existing && ::access(ifn.c_str(), F_OK) == 0)
+    std::cout << "Rebuilding existing index " << ifn << std::endl;
+  makeIndexDir(ifn);
+  IndexWriter out(ifn);
+  if (!out.ok()) {
+    std::cerr << "Unable to open output " << ifn << std::endl; // TODO strerror, etc
+    return 1;
+  }
+  out.header(fileName, compressedStat);
+
+  Checkpoint start;
+  size_t keep = 0;
+  auto keys = options.keys;
+  std::vector<RecordStart> records;
+  std::vector<KeySamples> samples;
+  if (existing) {
+    // all but the final entry, which is where we start again
+    keep = existing->numEntries() - 1;
+    for (size_t i = 0; i < keep; i++) {
+      auto &entry = existing->entry(i);
+      out.entry(Checkpoint{
+          entry.uncompressedOffset, entry.compressedOffset,
+          static_cast<int>(entry.bitOffset),
+          entry.windowLen ? std::string(existing->compressedWindow(entry))
+                          : std::string()});
+    }
+    auto &end = existing->entry(keep);
+    start = Checkpoint{end.uncompressedOffset, end.compressedOffset, 0, {}};
+    std::cout << "Keeping " << keep << " checkpoints of existing index, and"
+              << " resuming at compressed offset " << start.compressedOffset
+              << "\n";
+    // and the same for where records start, and key samples, unless we're
+    // asked for different keys
+    if (auto *existingRecords = existing->records())
+      records.assign(existingRecords, existingRecords + keep);
+    auto &existingSamples = existing->keySamples();
+    if (keys.empty())
+      for (auto &[key, _] : existingSamples) keys.push_back(key);
+    if (std::all_of(keys.begin(), keys.end(), [&](const std::string &key) {
+          return existingSamples.count(key);
+        }))
+      for (auto &key : keys)
+        samples.push_back(existingSamples.find(key)->second);
+    existing.reset();
+  }
+
+  auto end = indexFile(
+      from.get(), start, options, &std::cout,
+      [&](const Checkpoint &checkpoint) { out.entry(checkpoint); });
+
+  // TODO find a better way to record the total uncompressed size...
+  std::cout << "Writing final entry...\n";
+  out.entry(end);
+  if (out.finish()) {
+    auto first = samples.size() == keys.size() ? keep : 0;
+    if (!first) samples.assign(keys.size(), {});
+    std::cout << "Reading the first record after each checkpoint...\n";
+    walkCheckpoints(fileName, out.tempName(), keys, first, records, samples);
+    if (!records.empty()) out.records(records);
+    for (size_t i = 0; i < keys.size(); i++)
+      std::cout << "Sampled " << keys[i] << " at " << samples[i].size()
+                << " checkpoints\n";
+    if (!keys.empty()) out.keys(keys, samples);
+  }
+  if (!out.commit()) {
+    std::cerr << "Unable to write " << ifn << std::endl;
+    return 1;
+  }
+
+  std::cout << "Index complete.\n";
+  return 0;
+}
+
 struct ZipByteSource::Impl {
+  // at most this many contexts are being prefetched at once. a bisect asks
+  // for two at a time: one for each way the current probe might go.
+  static constexpr size_t MaxPrefetches = 2;
+  // contexts kept from before a seek, in case another comes back their way.
+  // a bisect narrowing in on something goes back and forth over the same
+  // ground, and can carry on from where it left off on either side.
+  static constexpr size_t MaxParked = 4;
+  // windows kept decompressed, for starting contexts at their checkpoints
+  static constexpr size_t MaxWindows = 16;
+  static inline const std::atomic<bool> NotCancelled = false;
+
+  struct Prefetch {
+    size_t pos;
+    std::atomic<bool> cancelled = false;
+    std::future<std::unique_ptr<CachedContext>> context;
+  };
+
+  struct Window {
+    uint64_t offset; //< IndexEntry::windowOffset
+    std::unique_ptr<uint8_t[]> data;
+  };
+
+  /// The inflated data between two index entries, from another thread.
+  struct Range {
+    std::atomic<bool> cancelled = false;
+    std::future<BlockCache::Block> data;
+  };
+
+  /// For cursor(): another reader of the same file.
+  struct Cursor {};
+
+  // input that can't be pread() (stdin, pipes) is read from here. anything
+  // else is read from file_, which cursors share.
   File compressed_;
-  std::optional<Zindex> index_;
-  // based on the average block size, used to determine whether to seek forward
-  // by decompressing or seeking to a new block. also used to determine the size
-  // of the decompression lookback buffer to use after each seek
-  std::optional<size_t> blockSize_;
+  std::shared_ptr<const PreadFile> file_;
+  std::string fname_;
+  std::string indexName_; //< Where the index is, or would be
+  CacheDropper cacheDropper_;
+  Throttle *throttle_ = nullptr;
+  std::shared_ptr<Zindex> index_;
+  // if set, seeks read whole blocks from here (see setBlockCache())
+  std::shared_ptr<BlockCache> blocks_;
+  // most recently used last. contexts are started on other threads too.
+  std::mutex windowsMutex_;
+  std::deque<Window> windows_;
+  // null while we're reading ranges inflated in parallel, or blocks, below
   std::unique_ptr<CachedContext> context_;
-  uint8_t input_[ChunkSize];
-  size_t outputSize_;
-  uint8_t *output_;
+  std::deque<std::unique_ptr<CachedContext>> parked_; //< Most recent last
+  size_t seekPos_ = 0; //< Where the last seek went
+  // how much the members appended since the index was built inflate to, as of
+  // when the file was the size noted (see endPos())
+  size_t tailCountedTo_ = 0;
+  size_t tailLen_ = 0;
+  size_t nextRange_ = 0; //< Index entry at the start of the next range to start
+  BlockCache::Block inflated_;
+  size_t inflatedUsed_ = 0;
+  size_t threads_ = 1; //< see setThreads()
+  // seeks far from a checkpoint, for the seek log (see getSeekLogFilename())
+  // if there is one, written out all at once when we're done
+  std::string seekLog_;
+  std::vector<uint64_t> seeks_;
+  // last, so the threads building these are gone before anything they use
+  std::deque<std::unique_ptr<Prefetch>> prefetches_;
+  std::deque<std::unique_ptr<Range>> ranges_;
 
   Impl(File &&file,
        const std::string &fname,
        const std::optional<std::string> &indexFname)
-      : compressed_(std::move(file)),
-        index_([&]() -> std::optional<Zindex> {
-          auto name = getIndexFilename(fname, indexFname);
-          if (::access(name.c_str(), F_OK) == 0) {
-            return Zindex(name);
-          }
-          return std::nullopt;
-        }()),
-        blockSize_([&]() -> std::optional<size_t> {
-          if (index_.has_value()) {
-            return 2 * index_->uncompressedSize() / index_->numEntries();
-          }
-          return std::nullopt;
-        }()),
-        context_(new CachedContext()),
-        outputSize_(blockSize_ ? *blockSize_ : ChunkSize * 4), // Chosen at random
-        output_(new uint8_t[outputSize_]) {
-    if (compressed_.get() == nullptr)
+      : fname_(fname),
+        context_(new CachedContext()) {
+    if (file.get() == nullptr)
       THROW_RT("Could not open " << fname << " for reading");
+    if (::lseek(fileno(file.get()), 0, SEEK_CUR) == -1) {
+      compressed_ = std::move(file);
+    } else {
+      // carry on from wherever whoever had it had got to
+      context_->compressedPos_ = static_cast<size_t>(::ftell(file.get()));
+      file_ = std::make_shared<const PreadFile>(fname, std::move(file));
+    }
+    indexName_ = getIndexFilename(fname, indexFname, fd());
+    if (::access(indexName_.c_str(), F_OK) == 0)
+      index_ = std::make_shared<Zindex>(indexName_);
 
     if (index_ && index_->compressedFilename != getBaseName(fname))
       THROW_RT("Wrong compressed filename in index: '"
@@ -380,17 +2011,43 @@ struct ZipByteSource::Impl {
 
     if (index_) {
       struct stat stats;
-      if (fstat(fileno(compressed_.get()), &stats) != 0)
+      if (fstat(fd(), &stats) != 0)
         THROW_RT("Unable to get file stats"); // TODO errno
-      if (stats.st_size != static_cast<int64_t>(index_->compressedSize))
-        THROW_RT("Compressed size changed since index was built");
-      if (index_->compressedModTime != static_cast<uint64_t>(stats.st_mtime))
+      // an index of a file that's had more gzip members appended since (see
+      // au zindex --update) still does for the part of it that it covers, so
+      // long as that's still as it was
+      if (stats.st_size < static_cast<int64_t>(index_->compressedSize))
+        THROW_RT("Compressed file has shrunk since index was built");
+      if (stats.st_size == static_cast<int64_t>(index_->compressedSize)
+              ? index_->compressedModTime
+                    != static_cast<uint64_t>(stats.st_mtime)
+              : !stillEndsWhereItDid(fd(), *index_))
         THROW_RT("Compressed file has been modified since index was built");
+      auto seekLog = getSeekLogFilename(indexName_);
+      if (::access(seekLog.c_str(), W_OK) == 0) seekLog_ = seekLog;
     }
 
     context_->zs_.stream.avail_in = 0;
   }
 
+  /// A reader of from's file, from the start, sharing its descriptor, index
+  /// and block cache rather than opening them all again.
+  Impl(Cursor, const Impl &from)
+      : file_(from.file_),
+        fname_(from.fname_),
+        indexName_(from.indexName_),
+        throttle_(from.throttle_),
+        index_(from.index_),
+        blocks_(from.blocks_),
+        context_(new CachedContext()),
+        seekLog_(from.seekLog_) {
+    if (!file_)
+      THROW_RT("Can't read " << fname_ << " from more than one place at once");
+    context_->compressedPos_ = 0;
+    context_->zs_.stream.avail_in = 0;
+    if (from.cacheDropper_.attached()) cacheDropper_.attach(fd());
+  }
+
   Impl(const std::string &fname,
        const std::optional<std::string> &indexFname)
       : Impl(File(fopen(fname.c_str(), "rb")), fname, indexFname) {}
@@ -403,148 +2060,548 @@ struct ZipByteSource::Impl {
     // quite ugly. find a cleaner way to upgrade a file byte source to a
     // ZipByteSource...
     auto len = static_cast<size_t>(source.limit_ - source.cur_);
-    if (len > sizeof(input_))
+    if (len > ChunkSize)
       THROW_RT("Initializing ZipByteStream from FileInputSream with too much"
-        " buffered data (" << len << " > " << sizeof(input_) << ")");
-    ::memcpy(input_, source.cur_, len);
+        " buffered data (" << len << " > " << ChunkSize << ")");
+    ::memcpy(context_->input_.get(), source.cur_, len);
     context_->zs_.stream.avail_in = static_cast<uint32_t>(len);
-    context_->zs_.stream.next_in = input_;
+    context_->zs_.stream.next_in = context_->input_.get();
   }
 
   ~Impl() {
-    delete[] output_;
+    dropPrefetches();
+    stopParallel();
+    writeSeekLog();
+  }
+
+  const KeySamples *keySamples(const std::string &key) {
+    if (!index_) return nullptr;
+    auto &samples = index_->keySamples();
+    auto it = samples.find(key);
+    return it == samples.end() || it->second.empty() ? nullptr : &it->second;
+  }
+
+  void buildIndex() {
+    struct stat stats;
+    if (index_ || fstat(fd(), &stats) != 0
+        || !S_ISREG(stats.st_mode))
+      return;
+    // a FILE of our own, so as not to move context_'s
+    File from(fopen(fname_.c_str(), "rb"));
+    if (from.get() == nullptr)
+      THROW_RT("Could not open " << fname_ << " for reading");
+    auto &ifn = indexName_;
+    std::cerr << "Indexing " << fname_ << ", and saving the index to " << ifn
+              << " for next time...\n";
+
+    Zindex index(fname_, stats);
+    makeIndexDir(ifn);
+    IndexWriter out(ifn);
+    if (out.ok()) out.header(fname_, stats);
+    ZindexOptions options;
+    options.throttle = throttle_;
+    auto end = indexFile(from.get(), Checkpoint{}, options, nullptr,
+                         [&](const Checkpoint &checkpoint) {
+                           index.add(checkpoint);
+                           if (out.ok()) out.entry(checkpoint);
+                         });
+    index.add(end);
+    if (out.ok()) out.entry(end);
+    if (!out.ok() || !out.commit())
+      std::cerr << "Unable to write " << ifn
+                << ", so the index will only be used this once\n";
+    index_ = std::make_shared<Zindex>(std::move(index));
   }
 
   size_t doRead(char *buf, size_t len) {
-    auto &c = *context_;
-    if (c.cur_ == c.limit_) gzread();
-    auto n = std::min(c.limit_ - c.cur_, len);
-    ::memcpy(buf, output_+c.cur_, n);
-    c.cur_ += n;
-    c.pos_ += n;
+    if (!context_ || goParallel()) return readParallel(buf, len);
+    // stop at each checkpoint, to see if it's time to go parallel
+    if (rangesInFlight() && index_) {
+      auto next = index_->after(context_->pos_);
+      if (next < index_->numEntries())
+        len = std::min(len, index_->entry(next).uncompressedOffset
+                                - context_->pos_);
+    }
+    auto n = read(*context_, buf, len);
+    if (context_->compressedPos_)
+      cacheDropper_.update(*context_->compressedPos_);
+    else
+      cacheDropper_.update();
     return n;
   }
 
-  size_t endPos() const {
-    return index_.value().uncompressedSize();
+  /// Where the index ends, and then however much any gzip members appended
+  /// to the file since it was built inflate to, so that a binary search looks
+  /// at those too. Finding that out means inflating them, but only once for
+  /// each size the file grows to.
+  size_t endPos() {
+    if (!index_)
+      THROW_RT("Can't tell how long " << fname_ << " is without an index");
+    auto end = index_->uncompressedSize();
+    struct stat stats;
+    if (fstat(fd(), &stats) != 0
+        || static_cast<size_t>(stats.st_size) <= index_->compressedSize)
+      return end;
+    auto size = static_cast<size_t>(stats.st_size);
+    if (tailCountedTo_ != size) {
+      tailCountedTo_ = size;
+      tailLen_ = 0;
+      auto context = contextAt(index_->entry(index_->numEntries() - 1));
+      char discard[WindowSize];
+      try {
+        while (auto n = read(*context, discard, sizeof(discard)))
+          tailLen_ += n;
+      } catch (std::exception &) {
+        // a member still being written: what's there so far is the end
+      }
+    }
+    return end + tailLen_;
   }
 
   bool isSeekable() const {
-    return index_.has_value();
+    return index_ != nullptr;
   }
 
-  void doSeek(size_t abspos) {
-    auto &c = *context_;
-    if (!blockSize_) {
-      THROW_RT("blockSize_ is not set but trying to perform a seek");
-    }
+  /// FileByteSource takes care of seeks within what it has already buffered,
+  /// so we're only asked to go somewhere we haven't inflated. Up to
+  /// historyLen bytes from just before abspos are left in history, and we
+  /// return how many.
+  size_t doSeek(size_t abspos, char *history, size_t historyLen) {
     if (!index_) {
       THROW_RT("index_ is not set but trying to perform a seek");
     }
+    stopParallel();
+    seekPos_ = abspos;
+    if (!seekLog_.empty()
+        && abspos - index_->find(abspos).uncompressedOffset >= RefineEvery)
+      seeks_.push_back(abspos);
+    // a bisect prefetches both places its next probe might go, and this is
+    // the one it went to, if either. the other was mispredicted, and is
+    // dropped here.
+    auto prefetched = takePrefetched(abspos);
+    dropPrefetches();
+
+    if (blocks_ && abspos < index_->uncompressedSize()) {
+      auto entry = index_->after(abspos) - 1;
+      park(std::move(context_));
+      inflated_ = block(entry, NotCancelled);
+      nextRange_ = entry + 1;
+      inflatedUsed_ = abspos - index_->entry(entry).uncompressedOffset;
+      auto len = std::min(historyLen, inflatedUsed_);
+      ::memcpy(history, inflated_->data() + inflatedUsed_ - len, len);
+      return len;
+    }
 
-    if (abspos < c.pos_ && c.pos_ - abspos <= c.cur_) {
-      // we're seeking backward within current buffer
-      auto relseek = c.pos_ - abspos;
-      c.cur_ -= relseek;
-      c.pos_ -= relseek;
-      return;
+    if (prefetched) {
+      park(std::move(context_));
+      context_ = std::move(prefetched);
+      auto &c = *context_;
+      c.keepRecent();
+      c.remember(c.history_.get(), c.historyLen_);
+      auto len = std::min(historyLen, c.historyLen_);
+      ::memcpy(history, c.history_.get() + c.historyLen_ - len, len);
+      c.history_.reset();
+      c.historyLen_ = 0;
+      return len;
     }
 
-    size_t bufRemaining = c.limit_ - c.cur_;
-    if (abspos > c.pos_ && abspos - c.pos_ <= bufRemaining) {
-      // we're seeking forward within current buffer
-      auto relseek = abspos - c.pos_;
-      c.cur_ += relseek;
-      c.pos_ += relseek;
-      return;
+    resumeNearest(abspos);
+    auto &c = *context_;
+    // what it inflated last makes up whatever the skip doesn't
+    auto recalled =
+        c.recall(history, historyLen - std::min(historyLen, abspos - c.pos_));
+    return recalled + *skipTo(c, abspos, nullptr, history + recalled,
+                              historyLen - recalled);
+  }
+
+  /// Make context_ whichever of it and the parked contexts has the least to
+  /// inflate to get to abspos, or a new one if starting again from the
+  /// checkpoint before abspos would mean less (or they're all past it).
+  void resumeNearest(size_t abspos) {
+    auto from = index_->find(abspos).uncompressedOffset;
+    auto usable = [&](const std::unique_ptr<CachedContext> &c) {
+      return c && c->pos_ >= from && c->pos_ <= abspos;
+    };
+    auto best = parked_.end();
+    for (auto it = parked_.begin(); it != parked_.end(); ++it)
+      if (usable(*it) && (best == parked_.end() || (*it)->pos_ > (*best)->pos_))
+        best = it;
+    if (!usable(context_)
+        || (best != parked_.end() && context_->pos_ < (*best)->pos_)) {
+      auto next = best == parked_.end() ? contextAt(abspos) : std::move(*best);
+      if (best != parked_.end()) parked_.erase(best);
+      park(std::move(context_));
+      context_ = std::move(next);
+    }
+    context_->keepRecent();
+  }
+
+  void park(std::unique_ptr<CachedContext> context) {
+    if (!context || context->eof_) return;
+    parked_.emplace_back(std::move(context));
+    if (parked_.size() > MaxParked) parked_.pop_front();
+  }
+
+  /// Have the kernel start reading the compressed data from the checkpoint
+  /// before abspos. Then, if we've been given more than one thread (see
+  /// setThreads()), start building a context positioned at abspos on another,
+  /// for doSeek() to pick up if it's asked to go there. The oldest prefetch is
+  /// abandoned if there are already MaxPrefetches under way.
+  void prefetch(size_t abspos) {
+    if (!index_ || abspos >= index_->uncompressedSize()) return;
+#ifndef __APPLE__
+    auto &entry = index_->find(abspos);
+    // the final entry just marks the end, so there's always one after
+    auto &following = *(&entry + 1);
+    auto from = entry.compressedOffset - (entry.bitOffset ? 1 : 0);
+    ::posix_fadvise(fd(), static_cast<off_t>(from),
+                    static_cast<off_t>(following.compressedOffset - from),
+                    POSIX_FADV_WILLNEED);
+#endif
+    // with only the one thread, inflating ahead just steals time from
+    // whatever we're doing now, and half the time for nothing. and doSeek()
+    // reads whole blocks anyway, if it's keeping them.
+    if (threads() < 2 || blocks_) return;
+    for (auto &prefetch : prefetches_)
+      if (prefetch->pos == abspos) return;
+    while (prefetches_.size() >= MaxPrefetches) {
+      prefetches_.front()->cancelled = true;
+      prefetches_.pop_front();
+    }
+    auto prefetch = std::make_unique<Prefetch>();
+    prefetch->pos = abspos;
+    prefetch->context = std::async(
+        std::launch::async,
+        [this, abspos, cancelled = &prefetch->cancelled]()
+            -> std::unique_ptr<CachedContext> {
+          auto context = contextAt(abspos);
+          context->history_.reset(new char[HistorySize]);
+          auto len = skipTo(*context, abspos, cancelled,
+                            context->history_.get(), HistorySize);
+          if (!len) return nullptr;
+          context->historyLen_ = *len;
+          return context;
+        });
+    prefetches_.emplace_back(std::move(prefetch));
+  }
+
+  /// The prefetched context for abspos, if there is one, waiting for it to be
+  /// finished if need be.
+  std::unique_ptr<CachedContext> takePrefetched(size_t abspos) {
+    for (auto it = prefetches_.begin(); it != prefetches_.end(); ++it) {
+      if ((*it)->pos != abspos) continue;
+      auto prefetch = std::move(*it);
+      prefetches_.erase(it);
+      try {
+        return prefetch->context.get();
+      } catch (std::exception &) {
+        // doSeek() will do the same work again, and report whatever it was
+        return nullptr;
+      }
+    }
+    return nullptr;
+  }
+
+  /// Abandon every prefetch, cancelling whatever inflating is still under
+  /// way for them.
+  void dropPrefetches() {
+    for (auto &prefetch : prefetches_) prefetch->cancelled = true;
+    prefetches_.clear();
+  }
+
+  /// How many threads we may use, reading included (see setThreads()).
+  size_t threads() const {
+    return threads_ ? threads_
+                    : size_t{std::max(std::thread::hardware_concurrency(), 1u)};
+  }
+
+  /// How many ranges to inflate ahead of a sequential read. One thread is
+  /// left for the reading itself, so with only the one, none.
+  size_t rangesInFlight() const {
+    return std::min(MaxRangesInFlight, threads() - 1);
+  }
+
+  /// Every range between two index entries can be inflated by itself, be it a
+  /// whole gzip member or part of one. So once we've read all of one range
+  /// since the last seek, and are at the start of the next, we assume we're
+  /// going to read on, and start inflating the ranges ahead on other threads.
+  bool goParallel() {
+    if (!rangesInFlight() || !index_) return false;
+    auto pos = context_->pos_;
+    auto next = index_->after(pos);
+    if (next < 2 || next >= index_->numEntries()
+        || index_->entry(next - 1).uncompressedOffset != pos
+        || seekPos_ > index_->entry(next - 2).uncompressedOffset)
+      return false;
+    context_.reset();
+    nextRange_ = next - 1;
+    startRanges();
+    return true;
+  }
+
+  void startRanges() {
+    while (ranges_.size() < rangesInFlight()
+           && nextRange_ + 1 < index_->numEntries()) {
+      auto range = std::make_unique<Range>();
+      range->data = std::async(
+          std::launch::async,
+          [this, entry = nextRange_, cancelled = &range->cancelled] {
+            return block(entry, *cancelled);
+          });
+      ranges_.emplace_back(std::move(range));
+      nextRange_++;
+    }
+  }
+
+  /// Everything from the given index entry to the next.
+  std::shared_ptr<InflatedData> inflateRange(
+      size_t entry, const std::atomic<bool> &cancelled) {
+    auto &from = index_->entry(entry);
+    auto &to = index_->entry(entry + 1);
+    auto context = contextAt(from);
+    auto result = std::make_shared<InflatedData>(to.uncompressedOffset
+                                                 - from.uncompressedOffset);
+    for (size_t done = 0; done < result->size();) {
+      if (cancelled) return std::make_shared<InflatedData>(0);
+      auto n = read(*context, result->data() + done, result->size() - done);
+      if (!n)
+        THROW_RT("Compressed data ends before the index says it should, at "
+                 << context->pos_);
+      done += n;
     }
+    return result;
+  }
+
+  /// Everything from the given index entry to the next, from blocks_ if
+  /// we're keeping them, and kept there if it wasn't already.
+  BlockCache::Block block(size_t entry, const std::atomic<bool> &cancelled) {
+    auto pos = index_->entry(entry).uncompressedOffset;
+    auto len = index_->entry(entry + 1).uncompressedOffset - pos;
+    if (blocks_)
+      if (auto cached = blocks_->find(pos, len)) return cached;
+    BlockCache::Block inflated = inflateRange(entry, cancelled);
+    if (blocks_ && !cancelled) blocks_->add(pos, inflated);
+    return inflated;
+  }
 
-    // now we're either seeking backward, or else forward beyond end of
-    // buffer. do we really need to seek? or can we just skip ahead some?
-    if (abspos < c.pos_ || abspos > *blockSize_ + bufRemaining) {
-      // we're either seeking backward beyond the start of output_,
-      // or far enough forward that it's better to jump instead of scan.
-      Zindex::IndexEntry &indexEntry = index_->find(abspos);
-      auto compressedOffset = indexEntry.compressedOffset;
-      auto uncompressedOffset = indexEntry.uncompressedOffset;
-      auto bitOffset = indexEntry.bitOffset;
-      context_.reset(new CachedContext(uncompressedOffset));
-      uint8_t window[WindowSize];
-      uncompressWindow(indexEntry.window, window, WindowSize);
-
-      size_t seekPos = bitOffset ? compressedOffset - 1 : compressedOffset;
-      auto err = ::fseek(compressed_.get(), static_cast<long>(seekPos),
-        SEEK_SET);
-      if (err != 0)
-        THROW_RT("Error seeking in file"); // todo errno
-      context_->zs_.stream.avail_in = 0;
-      if (bitOffset) {
-        auto ch = fgetc(compressed_.get());
-        if (ch == -1)
-          throw ZlibError(ferror(compressed_.get()) ?
-              Z_ERRNO : Z_DATA_ERROR);
-        X(inflatePrime(&context_->zs_.stream, bitOffset,
-          ch >> (8 - bitOffset)));
+  size_t readParallel(char *buf, size_t len) {
+    while (!inflated_ || inflatedUsed_ == inflated_->size()) {
+      // reading on from the block a seek landed in, so go parallel if we can
+      if (ranges_.empty()) startRanges();
+      if (!ranges_.empty()) {
+        auto range = std::move(ranges_.front());
+        ranges_.pop_front();
+        inflated_ = range->data.get();
+        cacheDropper_.update(
+            index_->entry(nextRange_ - ranges_.size()).compressedOffset);
+        startRanges();
+      } else if (blocks_ && nextRange_ + 1 < index_->numEntries()) {
+        inflated_ = block(nextRange_++, NotCancelled);
+        cacheDropper_.update(index_->entry(nextRange_).compressedOffset);
+      } else {
+        return readUnindexed(buf, len);
       }
-      X(inflateSetDictionary(&context_->zs_.stream, &window[0], WindowSize));
+      inflatedUsed_ = 0;
     }
+    auto n = std::min(len, inflated_->size() - inflatedUsed_);
+    ::memcpy(buf, inflated_->data() + inflatedUsed_, n);
+    inflatedUsed_ += n;
+    return n;
+  }
+
+  /// Past the end of the index: read any gzip members appended to the file
+  /// since it was built, as reading on with a context would have.
+  size_t readUnindexed(char *buf, size_t len) {
+    struct stat stats;
+    if (fstat(fd(), &stats) != 0
+        || static_cast<size_t>(stats.st_size) <= index_->compressedSize)
+      return 0;
+    context_ = contextAt(index_->entry(index_->numEntries() - 1));
+    return doRead(buf, len);
+  }
 
-    if (abspos < context_->pos_)
+  /// Abandon any ranges still being inflated. doSeek() makes a new context_
+  /// if we'd dropped it.
+  void stopParallel() {
+    for (auto &range : ranges_) range->cancelled = true;
+    ranges_.clear();
+    inflated_.reset();
+    inflatedUsed_ = 0;
+  }
+
+  /// Append the seeks noted to the seek log, in one write so that other
+  /// readers' don't interleave with ours. It's only a hint, so failing to is
+  /// no matter.
+  void writeSeekLog() {
+    if (seeks_.empty()) return;
+    int fd = ::open(seekLog_.c_str(), O_WRONLY | O_APPEND);
+    if (fd < 0) return;
+    auto len = seeks_.size() * sizeof(uint64_t);
+    (void)!::write(fd, seeks_.data(), len);
+    ::close(fd);
+  }
+
+  /// A new context at the closest checkpoint before abspos. This, and
+  /// skipTo(), touch nothing but the index and the file descriptor, so they can
+  /// be run on any thread.
+  std::unique_ptr<CachedContext> contextAt(size_t abspos) {
+    return contextAt(index_->find(abspos));
+  }
+
+  std::unique_ptr<CachedContext> contextAt(
+      const IndexEntry &indexEntry) {
+    auto compressedOffset = indexEntry.compressedOffset;
+    auto uncompressedOffset = indexEntry.uncompressedOffset;
+    // at the start of a member, there's a gzip header to read, and nothing
+    // before to refer back to
+    if (!indexEntry.windowLen)
+      return std::make_unique<CachedContext>(
+          uncompressedOffset, compressedOffset, ZStream::Type::ZlibOrGzip);
+    auto bitOffset = static_cast<int>(indexEntry.bitOffset);
+    size_t seekPos = bitOffset ? compressedOffset - 1 : compressedOffset;
+    auto context = std::make_unique<CachedContext>(
+        uncompressedOffset, seekPos, ZStream::Type::Raw);
+    uint8_t window[WindowSize];
+    this->window(indexEntry, window);
+
+    context->zs_.stream.avail_in = 0;
+    if (bitOffset) {
+      uint8_t ch;
+      if (preadCompressed(&ch, 1, seekPos) != 1)
+        throw ZlibError(Z_DATA_ERROR);
+      ++*context->compressedPos_;
+      X(inflatePrime(&context->zs_.stream, bitOffset, ch >> (8 - bitOffset)));
+    }
+    X(inflateSetDictionary(&context->zs_.stream, &window[0], WindowSize));
+    return context;
+  }
+
+  /// Entry's window, decompressed into to, from those we've kept if it's
+  /// there.
+  void window(const IndexEntry &entry, uint8_t *to) {
+    {
+      std::lock_guard lock(windowsMutex_);
+      for (auto it = windows_.begin(); it != windows_.end(); ++it) {
+        if (it->offset != entry.windowOffset) continue;
+        ::memcpy(to, it->data.get(), WindowSize);
+        // it's the most recently used now
+        std::rotate(it, it + 1, windows_.end());
+        return;
+      }
+    }
+    index_->window(entry, to);
+    Window window{entry.windowOffset, std::make_unique<uint8_t[]>(WindowSize)};
+    ::memcpy(window.data.get(), to, WindowSize);
+    std::lock_guard lock(windowsMutex_);
+    for (auto &kept : windows_)
+      if (kept.offset == entry.windowOffset) return; // another thread's
+    windows_.emplace_back(std::move(window));
+    if (windows_.size() > MaxWindows) windows_.pop_front();
+  }
+
+  /// Inflate up to abspos. The last historyLen bytes (or as many as there are)
+  /// go to history, and the rest is discarded. Returns how many went to
+  /// history, or nullopt if cancelled first.
+  std::optional<size_t> skipTo(CachedContext &c, size_t abspos,
+                               const std::atomic<bool> *cancelled,
+                               char *history, size_t historyLen) {
+    if (abspos < c.pos_)
       THROW_RT("Invariant abspos >= context_->pos_ doesn't hold: abspos = "
-                   << abspos << ", context_->pos_ = " << context_->pos_);
+                   << abspos << ", context_->pos_ = " << c.pos_);
+    auto numToSkip = abspos - c.pos_;
+    auto keep = std::min(historyLen, numToSkip);
     char discardBuffer[WindowSize];
-    auto numToSkip = abspos - context_->pos_;
     while (numToSkip) {
-      auto skipNow = std::min(WindowSize, numToSkip);
-      auto numRead = doRead(discardBuffer, skipNow);
+      if (cancelled && *cancelled) return std::nullopt;
+      auto *to = numToSkip > keep ? discardBuffer : history + keep - numToSkip;
+      auto skipNow = numToSkip > keep ? std::min(WindowSize, numToSkip - keep)
+                                      : numToSkip;
+      auto numRead = read(c, to, skipNow);
       if (numRead <= 0) THROW_RT("Unable to skip any bytes!");
       numToSkip -= static_cast<size_t>(numRead);
     }
+    return keep;
   }
 
-  size_t gzread() {
-    if (context_->eof_) return 0;
+  int fd() const {
+    return file_ ? file_->fd() : fileno(compressed_.get());
+  }
 
-    if (context_->cur_ != context_->limit_)
-      THROW_RT("Shouldn't call gzread() unless cur_ == limit_!");
+  size_t preadCompressed(uint8_t *buf, size_t len, size_t offset) {
+    return preadRetrying(fd(), buf, len, offset);
+  }
 
-    if (context_->cur_ == outputSize_) {
-      // buffer is full. we're only called when we're supposed to read
-      // something, so just clear it and continue...
-      context_->cur_ = context_->limit_ = 0;
+  /// Read more input, after whatever of it is still unused. Returns how much
+  /// was read: 0 at eof.
+  size_t fillInput(CachedContext &c) {
+    auto &zs = c.zs_;
+    if (zs.stream.avail_in)
+      ::memmove(c.input_.get(), zs.stream.next_in, zs.stream.avail_in);
+    auto *to = c.input_.get() + zs.stream.avail_in;
+    auto room = ChunkSize - zs.stream.avail_in;
+    size_t bytesRead;
+    if (c.compressedPos_) {
+      bytesRead = preadCompressed(to, room, *c.compressedPos_);
+      *c.compressedPos_ += bytesRead;
+    } else {
+      bytesRead = ::fread(to, 1, room, compressed_.get());
+      if (ferror(compressed_.get())) throw ZlibError(Z_ERRNO);
     }
+    if (throttle_) throttle_->account(bytesRead);
+    zs.stream.next_in = c.input_.get();
+    zs.stream.avail_in += static_cast<uInt>(bytesRead);
+    return bytesRead;
+  }
 
-    auto &zs = context_->zs_;
-    zs.stream.next_out = output_+context_->limit_;
-    zs.stream.avail_out = static_cast<uInt>(
-        std::min(outputSize_ - context_->limit_, ChunkSize)); // TODO ChunkSize or whatever...
+  /// At the end of a gzip member: get ready to inflate the next one, if there
+  /// is one. Anything after the last member that isn't another member (zero
+  /// padding, say) is ignored, as gzip does.
+  bool nextMember(CachedContext &c) {
+    auto &stream = c.zs_.stream;
+    // inflating raw deflate data (from a checkpoint) stops short of the
+    // member's trailer. zindex checked it when building the index.
+    if (c.zs_.type == ZStream::Type::Raw) {
+      for (auto toSkip = GzipTrailerSize; toSkip;) {
+        if (!stream.avail_in && !fillInput(c)) return false;
+        auto n = std::min(toSkip, size_t{stream.avail_in});
+        stream.next_in += n;
+        stream.avail_in -= static_cast<uInt>(n);
+        toSkip -= n;
+      }
+    }
+    while (stream.avail_in < 2)
+      if (!fillInput(c)) return false;
+    if (!isGzipMagic(stream.next_in)) return false;
+    c.zs_.reset(ZStream::Type::ZlibOrGzip);
+    return true;
+  }
+
+  /// Inflate up to len bytes straight into buf. Returns 0 only at the end of
+  /// the stream.
+  size_t read(CachedContext &c, char *buf, size_t len) {
+    if (c.eof_) return 0;
+
+    auto &zs = c.zs_;
+    zs.stream.next_out = reinterpret_cast<uint8_t *>(buf);
+    zs.stream.avail_out = static_cast<uInt>(std::min(len, ChunkSize));
     size_t total = 0;
     do {
-      if (zs.stream.avail_in == 0) {
-        zs.stream.avail_in = static_cast<uInt>(
-          ::fread(input_, 1, sizeof(input_), compressed_.get()));
-        if (ferror(compressed_.get())) throw ZlibError(Z_ERRNO);
-        zs.stream.next_in = input_;
-      }
+      if (zs.stream.avail_in == 0 && !fillInput(c))
+        THROW_RT("Compressed data is truncated at uncompressed offset "
+                 << c.pos_ + total);
       auto availBefore = zs.stream.avail_out;
       auto ret = inflate(&zs.stream, Z_NO_FLUSH);
       if (ret == Z_NEED_DICT) throw ZlibError(Z_DATA_ERROR);
       if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
         throw ZlibError(ret);
-      auto numUncompressed = availBefore - zs.stream.avail_out;
-      context_->limit_ += numUncompressed;
-      total += numUncompressed;
-      if (ret == Z_STREAM_END) {
-        // this is the end of the first gzip block. we don't currently
-        // support multiple blocks... it's hard for us to detect here whether
-        // there are multiple blocks or not, because in the presence of the
-        // gzip framing data, the underlying file might not actually be at
-        // eof. so we don't bother to detect or warn. they will have gotten
-        // the warning when the built the index, at least.
-        context_->eof_ = true;
+      total += availBefore - zs.stream.avail_out;
+      if (ret == Z_STREAM_END && !nextMember(c)) {
+        c.eof_ = true;
         break;
       }
     } while (zs.stream.avail_out);
+    c.remember(buf, total);
+    c.pos_ += total;
     return total;
   }
 };
@@ -559,7 +2616,72 @@ ZipByteSource::ZipByteSource(FileByteSourceImpl &source,
 : FileByteSource(source.name()),
   impl_(std::make_unique<Impl>(source, indexFilename)) {}
 
-ZipByteSource::~ZipByteSource() {}
+ZipByteSource::ZipByteSource(const std::string &name,
+                             std::unique_ptr<Impl> impl)
+: FileByteSource(name),
+  impl_(std::move(impl)) {}
+
+ZipByteSource::~ZipByteSource() = default;
+
+std::unique_ptr<ZipByteSource> ZipByteSource::cursor() const {
+  std::unique_ptr<ZipByteSource> result(new ZipByteSource(
+      name_, std::make_unique<Impl>(Impl::Cursor{}, *impl_)));
+  result->setMaxBufferSize(maxBufSize_);
+  return result;
+}
+
+void ZipByteSource::setNoCache(bool noCache) {
+  if (noCache)
+    impl_->cacheDropper_.attach(impl_->fd());
+  else
+    impl_->cacheDropper_.detach();
+}
+
+void ZipByteSource::setThrottle(Throttle *throttle) {
+  impl_->throttle_ = throttle;
+}
+
+void ZipByteSource::setBlockCache(const std::string &dir) {
+  if (!impl_->index_) return;
+  struct stat stats;
+  if (fstat(impl_->fd(), &stats) != 0)
+    THROW_RT("Unable to get file stats");
+  impl_->blocks_ = std::make_shared<BlockCache>(dir, stats);
+}
+
+void ZipByteSource::setThreads(size_t threads) {
+  impl_->threads_ = threads;
+}
+
+const std::vector<KeySample> *ZipByteSource::keySamples(
+    const std::string &key) {
+  return impl_->keySamples(key);
+}
+
+std::optional<AuByteSource::KnownRecord> ZipByteSource::knownRecord(
+    size_t abspos) {
+  if (!impl_->index_) return std::nullopt;
+  return impl_->index_->knownRecord(abspos);
+}
+
+std::vector<size_t> ZipByteSource::recordStarts() const {
+  std::vector<size_t> result;
+  auto &index = impl_->index_;
+  if (!index || !index->records()) return result;
+  // the last entry just marks the end
+  for (size_t i = 1; i + 1 < index->numEntries(); i++) {
+    auto pos = index->records()[i].pos;
+    // a record big enough to span checkpoints is the first after each
+    if (pos == RecordStart::None || (!result.empty() && pos <= result.back()))
+      continue;
+    result.push_back(pos);
+  }
+  return result;
+}
+
+void ZipByteSource::buildIndex() {
+  impl_->buildIndex();
+}
 
 bool ZipByteSource::isSeekable() const {
   return impl_->isSeekable();
@@ -569,12 +2691,20 @@ size_t ZipByteSource::doRead(char *buf, size_t len) {
   return impl_->doRead(buf, len);
 }
 
+void ZipByteSource::doPrefetch(size_t abspos, size_t) {
+  impl_->prefetch(abspos);
+}
+
 size_t ZipByteSource::endPos() const {
   return impl_->endPos();
 }
 
 void ZipByteSource::doSeek(size_t abspos) {
-  return impl_->doSeek(abspos);
+  // within the --max-buffer limit, keeping half for reading on into, as
+  // SeekBufferSize does
+  growBuffer(std::min(SeekBufferSize, maxBufSize_));
+  auto historyLen = std::min({buffFree(), HistorySize, bufSize_ / 2});
+  limit_ += impl_->doSeek(abspos, limit_, historyLen);
 }
 
 }
@@ -5,17 +5,43 @@
 
 #include <memory>
 #include <optional>
+#include <string>
+#include <vector>
 
 namespace au {
 
 class FileByteSourceImpl;
+struct KeySample;
+
+struct ZindexOptions {
+  /// For compressing windows, and inflating bgzip files: 0 for one per cpu.
+  size_t threads = 0;
+  /// If not null, reading the input is held to its limits.
+  Throttle *throttle = nullptr;
+  /// Extend the existing index, if there is one and the file has only had
+  /// gzip members appended since, rather than starting again.
+  bool update = false;
+  /// Add checkpoints to the existing, up-to-date index where seeks have been
+  /// landing far from one, as noted in <index>.seeks, which this starts if
+  /// it isn't there yet. Nothing else about the index changes.
+  bool refine = false;
+  /// Keys to sample the value of at each checkpoint, for grep -o to search
+  /// without inflating anything: see KeySample. With update, the existing
+  /// index's are kept if this is empty.
+  std::vector<std::string> keys;
+};
 
 int zindexFile(const std::string &fileName,
-               const std::optional<std::string> &indexFilename);
+               const std::optional<std::string> &indexFilename,
+               const ZindexOptions &options = {});
 
 class ZipByteSource : public FileByteSource {
   struct Impl;
   std::unique_ptr<Impl> impl_;
+  ReadAheadSlot readAhead_{*this}; //< Last: see ReadAheadSlot
+
+  ZipByteSource(const std::string &name, std::unique_ptr<Impl> impl);
+
 public:
   ZipByteSource(const std::string &fname,
                 const std::optional<std::string> &indexFname);
@@ -23,10 +49,55 @@ public:
                 const std::optional<std::string> &indexFname);
   ~ZipByteSource() override;
 
+  /// Another reader of the same file, from its start, with its own buffer and
+  /// position but the same file descriptor (see PreadFile), index, block
+  /// cache, throttle and page cache policy. It reads on the one thread it's
+  /// used from, without reading ahead. Safe to call from any thread, so long
+  /// as this isn't being set up meanwhile. Throws for input that can't be
+  /// read from more than one place at once, such as stdin.
+  std::unique_ptr<ZipByteSource> cursor() const;
+
+  /// Keep the compressed input out of the page cache. See CacheDropper.
+  void setNoCache(bool noCache);
+  /// Hold reads of the compressed input to throttle's limits, if not null.
+  void setThrottle(Throttle *throttle);
+  /// Have seeks inflate the whole of the block between two checkpoints that
+  /// they land in, and keep it: the last few in memory, and every one in dir
+  /// (created if need be), unless that's empty, for later runs to read
+  /// instead of inflating again. dir is kept to 4GB (or AU_BLOCK_CACHE_SIZE
+  /// MiB), dropping what was used longest ago first. Does nothing without an
+  /// index.
+  void setBlockCache(const std::string &dir);
+  /// How many threads reading may use (0 for one per cpu). Given more than
+  /// the one, reading on from one checkpoint to the next starts inflating the
+  /// ranges ahead on the others, and a prefetch() starts inflating up to
+  /// where it's for. By default, only the one.
+  void setThreads(size_t threads);
+  /// If there's no index, build one now, which means inflating the whole
+  /// file, and save it for next time. Does nothing for input that can't be
+  /// read twice, such as stdin.
+  void buildIndex();
+  /// What the index knows of key (see ZindexOptions::keys), or null if
+  /// nothing.
+  const std::vector<KeySample> *keySamples(const std::string &key);
+
+  /// For abspos at a checkpoint of an au file, from the index: au zindex
+  /// notes where the first record after each checkpoint starts.
+  std::optional<KnownRecord> knownRecord(size_t abspos) override;
+  /// Where the first value record after each checkpoint but the first starts,
+  /// in order, as far as the index knows: places to split the file up to read
+  /// it on several threads (see scanInParallel()). Empty without an index, or
+  /// with one that doesn't know.
+  std::vector<size_t> recordStarts() const;
+
   bool isSeekable() const override;
   size_t doRead(char *buf, size_t len) override;
   size_t endPos() const override;
   void doSeek(size_t abspos) override;
+  /// With an index, reads ahead the compressed data, and inflates up to abspos
+  /// on another thread if there's a cpu to spare, ready for a seek there. len
+  /// is ignored: the unit of work is a checkpoint.
+  void doPrefetch(size_t abspos, size_t len) override;
 };
 
 }
@@ -11,9 +11,24 @@ void usage() {
       << "\n"
       << " Builds an index for a gzipped au file. Writes index to <path>.auzx.\n"
       << " <path> may be \"-\" for stdin, in which case index is written to stdin.auzx.\n"
+      << " If AU_INDEX_DIR is set and there's no index next to <path>, it's written\n"
+      << " there instead, where every au command will look for it.\n"
       << "\n"
       << "  -h --help          show usage and exit\n"
-      << "  -x --index <path>  write index to <path> (defaults to inputpath.au.auzx)\n";
+      << "  -x --index <path>  write index to <path> (defaults to inputpath.au.auzx)\n"
+      << "  -k --key <key>     sample the value of <key> at each checkpoint, so that\n"
+      << "                     grep -o <key> can go straight to the right one\n"
+      << "                     (may be given more than once)\n"
+      << "  -u --update        extend the existing index to cover gzip members\n"
+      << "                     appended since it was built, if that's all that's\n"
+      << "                     changed (otherwise it's rebuilt)\n"
+      << "     --refine        add checkpoints to the existing index where seeks\n"
+      << "                     have been landing far from one. The first time,\n"
+      << "                     just starts noting seeks in <index>.seeks\n"
+      << "     --threads <n>   use <n> threads to compress checkpoints, and to\n"
+      << "                     inflate bgzip files (default: 0, for one per cpu)\n"
+      << "     --max-rate <n>  read at most <n> MiB/s, to go easy on a busy host\n"
+      << "     --max-cpu <n>   use at most <n> percent of one cpu\n";
 
 }
 
@@ -26,14 +41,35 @@ int zindex(int argc, const char * const *argv) {
       "path", "", true, "", "path", tclap.cmd());
   TCLAP::ValueArg<std::string> index(
       "x", "index", "index", false, "", "string", tclap.cmd());
+  TCLAP::MultiArg<std::string> keys(
+      "k", "key", "key", false, "string", tclap.cmd());
+  TCLAP::SwitchArg update("u", "update", "update", tclap.cmd());
+  TCLAP::SwitchArg refine("", "refine", "refine", tclap.cmd());
+  TCLAP::ValueArg<size_t> threads(
+      "", "threads", "threads", false, 0, "count", tclap.cmd());
+  ThrottleArgs throttle(tclap.cmd());
 
-  if (!tclap.parse(argc, argv)) return 1;
+  if (!tclap.parse(argc, argv) || !throttle.apply()) return 1;
 
   std::optional<std::string> indexFile;
   if (index.isSet()) indexFile = index.getValue();
 
+  ZindexOptions options;
+  options.update = update.isSet();
+  options.refine = refine.isSet();
+  options.keys = keys.getValue();
+  if (options.refine && (options.update || !options.keys.empty())) {
+    std::cerr << "--refine keeps the index as it is otherwise, so can't be"
+              << " given with --update or --key\n";
+    return 1;
+  }
+  options.threads = threads.getValue();
+  options.throttle = throttle.throttle();
+
   // TODO support stdin
-  return zindexFile(path.getValue(), indexFile);
+  auto result = zindexFile(path.getValue(), indexFile, options);
+  throttle.report();
+  return result;
 }
 
 }
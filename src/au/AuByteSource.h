@@ -3,14 +3,53 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
-#include <functional>
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <type_traits>
+#include <utility>
 
 namespace au {
 
+/// Thrown by a source following a file (as in tail -f) when that file is
+/// truncated or replaced under it. The source has already started over from
+/// position 0 of the new data, so positions and dictionaries from before are
+/// meaningless.
+struct stream_restarted : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+/// A non-owning reference to a callable, for callbacks that are only invoked
+/// during the call they're passed to. Unlike std::function it never allocates
+/// or copies the callable: it's an object pointer and a trampoline.
+template <typename Sig>
+class FunctionRef;
+
+template <typename R, typename... Args>
+class FunctionRef<R(Args...)> {
+  const void *obj_;
+  R (*call_)(const void *, Args...);
+
+public:
+  template <typename F>
+  requires (!std::is_same_v<std::remove_cvref_t<F>, FunctionRef>
+            && std::is_invocable_r_v<R, F &, Args...>)
+  FunctionRef(F &&f)
+      : obj_(std::addressof(f)),
+        call_([](const void *obj, Args... args) -> R {
+          using Fn = std::remove_reference_t<F>;
+          return (*const_cast<Fn *>(static_cast<const Fn *>(obj)))(
+              std::forward<Args>(args)...);
+        }) {}
+
+  R operator()(Args... args) const {
+    return call_(obj_, std::forward<Args>(args)...);
+  }
+};
+
 class AuByteSource {
 public:
   class Byte {
@@ -71,16 +110,30 @@ public:
 
   template<typename T>
   void read(T *t, size_t len) {
-    char *buf = static_cast<char *>(static_cast<void *>(t));
+    readInto(t, len);
+  }
+
+  /// Copy the next len bytes from the underlying byte source into buf. Sources
+  /// override this to make fixed-size reads a bounds check and a memcpy.
+  virtual void readInto(void *buf, size_t len) {
+    auto *out = static_cast<char *>(buf);
     readFunc(len, [&](std::string_view fragment) {
-      ::memcpy(buf, fragment.data(), fragment.size());
-      buf += fragment.size();
+      ::memcpy(out, fragment.data(), fragment.size());
+      out += fragment.size();
     });
   }
 
-  using Fn = std::function<void(std::string_view)>;
+  using Fn = FunctionRef<void(std::string_view)>;
   /// Call func with the next len bytes from the underlying byte source.
-  virtual void readFunc(size_t len, Fn &&func) = 0;
+  virtual void readFunc(size_t len, Fn func) = 0;
+
+  /// The next len bytes, buffered in one piece, or nullptr if the source
+  /// can't or won't do that (at eof, say, or for more than it buffers), in
+  /// which case they're still there to read as usual. Nothing is consumed.
+  /// The pointer is good until the next call on the source.
+  virtual const char *peekContiguous([[maybe_unused]] size_t len) {
+    return nullptr;
+  }
 
   virtual void setPin(size_t abspos) = 0;
   virtual void clearPin() = 0;
@@ -91,6 +144,28 @@ public:
 
   virtual void skip(size_t len) = 0;
 
+  /// A hint that we're likely to seek to abspos soon and read about len bytes
+  /// from there. Sources that can start fetching them in the background do;
+  /// it never changes what's read. Only worth calling ahead of a seek.
+  virtual void prefetch([[maybe_unused]] size_t abspos,
+                        [[maybe_unused]] size_t len) {}
+
+  /// A record whose position is known without looking, and the dict-clear
+  /// record that starts its dictionary.
+  struct KnownRecord {
+    size_t pos;
+    size_t dictClear;
+  };
+
+  /// The first record at or after abspos, if the source knows where that is
+  /// without reading anything: an indexed gzip file knows it for each of its
+  /// checkpoints. Syncing there takes no scan, and no guessing at whether what
+  /// looks like a record really is one.
+  virtual std::optional<KnownRecord> knownRecord(
+      [[maybe_unused]] size_t abspos) {
+    return std::nullopt;
+  }
+
   /// Seek to length bytes from the end of the stream
   void tail(size_t length) {
     auto end = endPos();
@@ -2,6 +2,7 @@
 
 #include "au/AuCommon.h"
 #include "au/AuByteSource.h"
+#include "au/BufferByteSource.h"
 #include "au/Handlers.h"
 #include "au/ParseError.h"
 
@@ -42,13 +43,18 @@ public:
   const std::string &str() const { return str_; }
 };
 
+/** Parsers are templated on the byte source so that, given a concrete source
+ * type whose accessors are final, every next()/peek() in the decode loops is a
+ * direct (and inlinable) call rather than a virtual one. Instantiating on
+ * AuByteSource itself still works for any other source. */
+template<typename Source = AuByteSource>
 class BaseParser {
 protected:
   static constexpr int AU_FORMAT_VERSION = FormatVersion1::AU_FORMAT_VERSION;
 
-  AuByteSource &source_;
+  Source &source_;
 
-  explicit BaseParser(AuByteSource &source)
+  explicit BaseParser(Source &source)
       : source_(source) {}
 
   void expect(char e) const {
@@ -59,20 +65,20 @@ protected:
 
   uint32_t readBackref() const {
     uint32_t val;
-    source_.read<uint32_t>(&val, sizeof(val));
+    source_.readInto(&val, sizeof(val));
     return val;
   }
 
   double readDouble() const {
     double val;
     static_assert(sizeof(val) == 8, "sizeof(double) must be 8");
-    source_.read(&val, sizeof(val));
+    source_.readInto(&val, sizeof(val));
     return val;
   }
 
   time_point readTime() const {
     uint64_t nanos;
-    source_.read(&nanos, sizeof(nanos));
+    source_.readInto(&nanos, sizeof(nanos));
     std::chrono::nanoseconds n(nanos);
     return time_point() + n;
   }
@@ -157,9 +163,8 @@ struct TooDeeplyNested : std::runtime_error {
   TooDeeplyNested() : runtime_error("File too deeply nested") {}
 };
 
-template<typename Handler>
-class ValueParser : BaseParser {
-  Handler &handler_;
+/// What values are held to, however they're parsed.
+struct ValueLimits {
   /** A positive value that when multiplied by -1 represents the most negative
   number we support (std::numeric_limits<int64_t>::min() * -1). */
   static constexpr uint64_t NEG_INT_LIMIT =
@@ -169,6 +174,18 @@ class ValueParser : BaseParser {
   // that clang asan has ~3x stack overhead, so if this is ok, probably best
   // to put it back to 8192 by default and reduce it only for asan builds...
   static inline constexpr size_t MaxDepth = 2048;
+};
+
+template<typename Handler, typename Source = AuByteSource>
+class ValueParser : BaseParser<Source>, ValueLimits {
+  using BaseParser<Source>::source_;
+  using BaseParser<Source>::expect;
+  using BaseParser<Source>::readDouble;
+  using BaseParser<Source>::readTime;
+  using BaseParser<Source>::readVarint;
+  using BaseParser<Source>::parseString;
+
+  Handler &handler_;
   mutable size_t depth{0};
   struct DepthRaii {
     const ValueParser &parent;
@@ -181,8 +198,8 @@ class ValueParser : BaseParser {
   };
 
 public:
-  ValueParser(AuByteSource &source, Handler &handler)
-      : BaseParser(source), handler_(handler) {}
+  ValueParser(Source &source, Handler &handler)
+      : BaseParser<Source>(source), handler_(handler) {}
 
   void value() const {
     size_t sov = source_.pos();
@@ -231,13 +248,13 @@ public:
       }
       case marker::PosInt64: {
         uint64_t val;
-        source_.read(&val, sizeof(val));
+        source_.readInto(&val, sizeof(val));
         handler_.onUint(sov, val);
         break;
       }
       case marker::NegInt64: {
         uint64_t val;
-        source_.read(&val, sizeof(val));
+        source_.readInto(&val, sizeof(val));
         if (val > NEG_INT_LIMIT) {
           AU_THROW("Signed int overflows int64_t: (-)" << val << " 0x"
                 << std::setfill('0') << std::setw(16) << std::hex << val);
@@ -316,13 +333,222 @@ private:
   }
 };
 
+/** The same, but reading the buffer directly. RecordParser hands a value
+ * handler a BufferByteSource over the whole of a value when it has the record
+ * buffered, so this is what parses most values. Rather than checking for eof
+ * on every byte, a string or fixed-size value checks once that it all fits,
+ * and a value that begins at the end of the buffer goes no further. */
 template<typename Handler>
-class RecordParser : BaseParser {
+class ValueParser<Handler, BufferByteSource> : ValueLimits {
+  using Byte = AuByteSource::Byte;
+
+  BufferByteSource &source_;
   Handler &handler_;
+  const char *&cur_; //< The source's own, so its pos() is right in handlers
+  const char *const end_;
+
+  mutable size_t depth{0};
+  struct DepthRaii {
+    const ValueParser &parent;
+    explicit DepthRaii(const ValueParser &vp) : parent(vp) {
+      parent.depth++;
+      if (parent.depth > MaxDepth)
+        throw TooDeeplyNested();
+    }
+    ~DepthRaii() { parent.depth--; }
+  };
 
 public:
-  RecordParser(AuByteSource &source, Handler &handler)
-      : BaseParser(source), handler_(handler) {}
+  ValueParser(BufferByteSource &source, Handler &handler)
+      : source_(source), handler_(handler), cur_(source.cur_),
+        end_(source.end_) {}
+
+  void value() const {
+    size_t sov = source_.pos();
+    if (cur_ == end_)
+      AU_THROW("Unexpected EOF at start of value");
+    auto c = static_cast<uint8_t>(*cur_++);
+    if (c & 0x80) {
+      handler_.onDictRef(sov, c & ~0x80u);
+      return;
+    }
+    {
+      auto val = c & ~0xe0u;
+      if (c & marker::SmallInt::Negative) {
+        if (c & 0x20)
+          handler_.onUint(sov, val);
+        else
+          handler_.onInt(sov, -static_cast<int>(val));
+        return;
+      }
+      if (c & 0x20) {
+        parseString(sov, val);
+        return;
+      }
+    }
+    switch (c) {
+      case marker::True:
+        handler_.onBool(sov, true);
+        break;
+      case marker::False:
+        handler_.onBool(sov, false);
+        break;
+      case marker::Null:
+        handler_.onNull(sov);
+        break;
+      case marker::Varint:
+        handler_.onUint(sov, readVarint());
+        break;
+      case marker::NegVarint: {
+        auto i = readVarint();
+        if (i > NEG_INT_LIMIT) {
+          AU_THROW("Signed int overflows int64_t: (-)" << i << " 0x"
+                << std::setfill('0') << std::setw(16) << std::hex << i);
+        }
+        handler_.onInt(sov, -static_cast<int64_t>(i));
+        break;
+      }
+      case marker::PosInt64:
+        handler_.onUint(sov, read<uint64_t>());
+        break;
+      case marker::NegInt64: {
+        auto val = read<uint64_t>();
+        if (val > NEG_INT_LIMIT) {
+          AU_THROW("Signed int overflows int64_t: (-)" << val << " 0x"
+                << std::setfill('0') << std::setw(16) << std::hex << val);
+        }
+        // 0 should be encoded as PosInt64, so we expect val >= 1 for NegInt64.
+        handler_.onInt(sov, -static_cast<int64_t>(val - 1) - 1);
+        break;
+      }
+      case marker::Double:
+        handler_.onDouble(sov, read<double>());
+        break;
+      case marker::Timestamp: {
+        std::chrono::nanoseconds n(read<uint64_t>());
+        handler_.onTime(sov, time_point() + n);
+        break;
+      }
+      case marker::DictRef:
+        handler_.onDictRef(sov, readVarint());
+        break;
+      case marker::String:
+        parseString(sov, readVarint());
+        break;
+      case marker::ArrayStart:
+        parseArray();
+        break;
+      case marker::ObjectStart:
+        parseObject();
+        break;
+      default:
+        AU_THROW("Unexpected character at start of value: "
+                 << Byte(static_cast<char>(c)));
+    }
+  }
+
+private:
+  void need(size_t len) const {
+    if (len > static_cast<size_t>(end_ - cur_))
+      AU_THROW("reached eof while trying to read " << len << " bytes");
+  }
+
+  template<typename T>
+  T read() const {
+    need(sizeof(T));
+    T val;
+    ::memcpy(&val, cur_, sizeof(val));
+    cur_ += sizeof(val);
+    return val;
+  }
+
+  uint64_t readVarint() const {
+    uint64_t result = 0;
+    for (auto shift = 0u;; shift += 7) {
+      if (shift >= 64u)
+        AU_THROW("Bad varint encoding");
+      if (cur_ == end_)
+        AU_THROW("Unexpected end of file");
+      auto i = static_cast<uint8_t>(*cur_++);
+      result |= static_cast<uint64_t>(i & 0x7fu) << shift;
+      if (!(i & 0x80u)) return result;
+    }
+  }
+
+  void parseString(size_t sov, size_t len) const {
+    need(len);
+    handler_.onStringStart(sov, len);
+    handler_.onStringFragment(std::string_view(cur_, len));
+    cur_ += len;
+    handler_.onStringEnd();
+  }
+
+  /// Whether we're at the close of the array or object we're in, consuming it
+  /// if so. At eof we aren't, and the value() or key() that follows says so.
+  bool atClose(char close) const {
+    if (cur_ == end_ || *cur_ != close) return false;
+    cur_++;
+    return true;
+  }
+
+  void key() const {
+    size_t sov = source_.pos();
+    if (cur_ == end_)
+      AU_THROW("Unexpected EOF at start of key");
+    auto c = static_cast<uint8_t>(*cur_++);
+    if (c & 0x80) {
+      handler_.onDictRef(sov, c & ~0x80u);
+      return;
+    }
+    if ((c & ~0x1fu) == 0x20) {
+      parseString(sov, c & ~0xe0u);
+      return;
+    }
+    switch (c) {
+      case marker::DictRef:
+        handler_.onDictRef(sov, readVarint());
+        break;
+      case marker::String:
+        parseString(sov, readVarint());
+        break;
+      default:
+        AU_THROW("Unexpected character at start of key: "
+                 << Byte(static_cast<char>(c)));
+    }
+  }
+
+  void parseArray() const {
+    DepthRaii raii(*this);
+    handler_.onArrayStart();
+    while (!atClose(marker::ArrayEnd)) value();
+    handler_.onArrayEnd();
+  }
+
+  void parseObject() const {
+    DepthRaii raii(*this);
+    handler_.onObjectStart();
+    while (!atClose(marker::ObjectEnd)) {
+      key();
+      value();
+    }
+    handler_.onObjectEnd();
+  }
+};
+
+template<typename Handler, typename Source = AuByteSource>
+class RecordParser : BaseParser<Source> {
+  using BaseParser<Source>::source_;
+  using BaseParser<Source>::expect;
+  using BaseParser<Source>::readBackref;
+  using BaseParser<Source>::readVarint;
+  using BaseParser<Source>::parseFormatVersion;
+  using BaseParser<Source>::parseFullString;
+  using BaseParser<Source>::term;
+  Handler &handler_;
+
+public:
+  RecordParser(Source &source, Handler &handler)
+      : BaseParser<Source>(source), handler_(handler) {}
 
   void parseStream(bool expectHeader = true) const {
     if (expectHeader) checkHeader();
@@ -366,8 +592,18 @@ public:
       case 'V': {   // Add value
         auto backref = readBackref();
         auto len = readVarint();
+        if (len < 2)
+          AU_THROW("Value record too short: " << len << " bytes");
         auto startOfValue = source_.pos();
-        handler_.onValue(backref, len - 2, source_);
+        if (auto *buf = source_.peekContiguous(len)) {
+          // the whole record is buffered, so the value can be parsed from
+          // memory. see ValueParser<Handler, BufferByteSource>.
+          BufferByteSource value(buf, len - 2, startOfValue);
+          handler_.onValue(backref, len - 2, value);
+          source_.skip(value.pos() - startOfValue);
+        } else {
+          handler_.onValue(backref, len - 2, source_);
+        }
         term();
         if (source_.pos() - startOfValue != len)
           AU_THROW("could be a parse error, or internal error: value handler "
@@ -394,7 +630,7 @@ private:
     if (source_.peek().isEof()) return;
     HeaderHandler hh;
     try {
-      RecordParser<HeaderHandler>(source_, hh).record();
+      RecordParser<HeaderHandler, Source>(source_, hh).record();
     } catch (const au::bad_version &) {
       // we read a version, so it really is an au file, just not a readable
       // one. worth saying so rather than claiming it isn't au at all.
@@ -407,9 +643,9 @@ private:
   }
 };
 
-template<typename Handler>
-ValueParser(AuByteSource &source, Handler &handler) -> ValueParser<Handler>;
-template<typename Handler>
-RecordParser(AuByteSource &source, Handler &handler) -> RecordParser<Handler>;
+template<typename Handler, typename Source>
+ValueParser(Source &source, Handler &handler) -> ValueParser<Handler, Source>;
+template<typename Handler, typename Source>
+RecordParser(Source &source, Handler &handler) -> RecordParser<Handler, Source>;
 
 }
@@ -7,46 +7,75 @@
 
 namespace au {
 
-class BufferByteSource : public AuByteSource {
+template<typename Handler, typename Source>
+class ValueParser;
+
+/// Value parsers instantiated on a BufferByteSource read straight from its
+/// buffer rather than through next()/peek(): see ValueParser.
+class BufferByteSource final : public AuByteSource {
+  template<typename, typename> friend class ValueParser;
+
   const char *buf_; //< Underlying source buffer
-  size_t bufLen_;   //< Underlying source buffer length
-  size_t pos_ = 0;  //< Current position (this may be 1 past the end of buf_)
+  const char *cur_; //< Current position in it (this may be end_)
+  const char *end_; //< End of the underlying source buffer
+  size_t basePos_;  //< The position of buf_[0]
+
+  size_t avail() const { return static_cast<size_t>(end_ - cur_); }
 
 public:
-  BufferByteSource(const char *buf, size_t len) : buf_(buf), bufLen_(len) {}
+  BufferByteSource(const char *buf, size_t len)
+      : BufferByteSource(buf, len, 0) {}
+
+  /// For a piece of a larger stream that starts basePos into it, so that
+  /// positions are the stream's.
+  BufferByteSource(const char *buf, size_t len, size_t basePos)
+      : buf_(buf), cur_(buf), end_(buf + len), basePos_(basePos) {}
 
   BufferByteSource(std::string_view buf)
-  : buf_(buf.data()), bufLen_(buf.length())
-  {}
+      : BufferByteSource(buf.data(), buf.length()) {}
 
   std::string name() const override {
     return "<buffer>";
   }
 
   size_t pos() const override {
-    assert(pos_ <= bufLen_);
-    return pos_;
+    assert(cur_ <= end_);
+    return basePos_ + static_cast<size_t>(cur_ - buf_);
   }
 
-  size_t endPos() const override { return bufLen_; }
+  size_t endPos() const override {
+    return basePos_ + static_cast<size_t>(end_ - buf_);
+  }
 
   Byte peek() override {
-    return pos_ < bufLen_ ? Byte(buf_[pos_]) : Byte::Eof();
+    return cur_ < end_ ? Byte(*cur_) : Byte::Eof();
   }
 
   Byte next() override {
-    return pos_ < bufLen_ ? Byte(buf_[pos_++]) : Byte::Eof();
+    return cur_ < end_ ? Byte(*cur_++) : Byte::Eof();
   }
 
-  void readFunc(size_t len, Fn &&func) override {
-    size_t sz = std::min(len, bufLen_ - pos_);
-    func(std::string_view(buf_ + pos_, sz));
-    pos_ += sz;
+  void readInto(void *buf, size_t len) override {
+    if (len > avail())
+      AU_THROW("reached eof while trying to read " << len << " bytes");
+    ::memcpy(buf, cur_, len);
+    cur_ += len;
+  }
+
+  void readFunc(size_t len, Fn func) override {
+    if (len > avail())
+      AU_THROW("reached eof while trying to read " << len << " bytes");
+    func(std::string_view(cur_, len));
+    cur_ += len;
+  }
+
+  const char *peekContiguous(size_t len) override {
+    return len <= avail() ? cur_ : nullptr;
   }
 
   // ignored, the whole buffer is always available...
   void setPin(size_t abspos) override final {
-    assert(abspos <= bufLen_);
+    assert(abspos <= endPos());
     (void)abspos;
   }
   void clearPin() override final {}
@@ -54,22 +83,28 @@ public:
   bool isSeekable() const override { return true; }
 
   void seek(size_t abspos) override {
-    // i think we could allow a seek to eof (abspos == bufLen_), but in practice
-    // nothing has ever tried to do that, and it isn't needed for now.
-    if (abspos >= bufLen_) {
+    // i think we could allow a seek to eof (abspos == endPos()), but in
+    // practice nothing has ever tried to do that, and it isn't needed for now.
+    if (abspos < basePos_ || abspos >= endPos()) {
       THROW_RT("failed to seek to desired location: " << abspos);
     }
-    pos_ = abspos;
+    cur_ = buf_ + (abspos - basePos_);
   }
 
-  void skip(size_t len) override { seek(pos_ + len); }
+  // unlike seek(), skipping right up to eof is fine: it's what a value handler
+  // that isn't interested does with a whole value.
+  void skip(size_t len) override {
+    if (len > avail())
+      THROW_RT("failed to read from new location while skipping");
+    cur_ += len;
+  }
 
   bool scanTo(std::string_view needle) override {
-    char *found = static_cast<char *>(memmem(buf_ + pos_, bufLen_ - pos_,
-                        needle.data(), needle.length()));
+    auto *found = static_cast<const char *>(
+        memmem(cur_, avail(), needle.data(), needle.length()));
     if (found) {
-      assert(found >= buf_);
-      pos_ = static_cast<size_t>(found - buf_);
+      assert(found >= cur_);
+      cur_ = found;
       return true;
     }
     return false;
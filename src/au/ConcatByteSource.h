@@ -0,0 +1,199 @@
+#pragma once
+
+#include "au/AuByteSource.h"
+#include "au/FileByteSource.h"
+#include "au/ParseError.h"
+
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace au {
+
+/// Presents a list of seekable sources (say, a day's worth of rotated log
+/// files) as the single stream you'd get by concatenating them, with one
+/// offset space across all of them, so a single bisect can cover the lot.
+///
+/// A bisect over the lot only works if what it's bisecting on is in order
+/// across all of the parts, not just within each: the parts have to be given
+/// in order, and none can overlap the next.
+///
+/// Every au file begins with a header followed by a dictionary clear, so the
+/// decoders need no help at the boundaries: nothing in one file can refer to a
+/// dictionary in another. scanTo() won't find a needle that straddles a
+/// boundary, which is fine for the record separators it's used to look for.
+class ConcatByteSource final : public AuByteSource {
+  std::string name_;
+  std::vector<std::unique_ptr<AuByteSource>> parts_;
+  std::vector<size_t> starts_; //< Offset of each part, then the total length
+  size_t cur_ = 0;             //< The part we're reading from
+  std::optional<size_t> pinnedPart_;
+  bool readAhead_ = false;
+
+public:
+  /// Empty parts are dropped. Throws if any part isn't seekable, as we
+  /// couldn't know where the parts after it start.
+  explicit ConcatByteSource(std::vector<std::unique_ptr<AuByteSource>> parts) {
+    size_t start = 0;
+    for (auto &part : parts) {
+      name_ += (name_.empty() ? "" : ", ") + part->name();
+      if (!part->isSeekable())
+        THROW_RT("Cannot concatenate non-seekable file '" << part->name()
+                                                          << "'");
+      auto len = part->endPos();
+      if (!len) continue;
+      starts_.push_back(start);
+      parts_.emplace_back(std::move(part));
+      start += len;
+    }
+    starts_.push_back(start);
+  }
+
+  /// Have the part being read read ahead (see FileByteSource::setReadAhead()),
+  /// and only that one, so that a day of hourly files doesn't start a thread
+  /// apiece. Parts that can't read ahead are read as usual.
+  void setReadAhead(bool readAhead) {
+    readAhead_ = readAhead;
+    readAheadIn(cur_, readAhead);
+  }
+
+  /// The names of all of the parts, empty or not, whichever is being read.
+  std::string name() const override {
+    return name_.empty() ? "<empty>" : name_;
+  }
+
+  /// The name of the part currently being read.
+  std::string partName() const {
+    return parts_.empty() ? "<empty>" : parts_[cur_]->name();
+  }
+
+  size_t pos() const override {
+    return parts_.empty() ? 0 : starts_[cur_] + parts_[cur_]->pos();
+  }
+
+  size_t endPos() const override { return starts_.back(); }
+
+  Byte peek() override {
+    if (parts_.empty()) return Byte::Eof();
+    auto byte = part().peek();
+    while (byte.isEof() && advance()) byte = part().peek();
+    return byte;
+  }
+
+  Byte next() override {
+    if (parts_.empty()) return Byte::Eof();
+    auto byte = part().next();
+    while (byte.isEof() && advance()) byte = part().next();
+    return byte;
+  }
+
+  void readInto(void *buf, size_t len) override {
+    auto *out = static_cast<char *>(buf);
+    forEachPart(len, "read", [&](size_t n) {
+      part().readInto(out, n);
+      out += n;
+    });
+  }
+
+  void readFunc(size_t len, Fn func) override {
+    forEachPart(len, "read", [&](size_t n) { part().readFunc(n, func); });
+  }
+
+  const char *peekContiguous(size_t len) override {
+    if (parts_.empty() || len > partAvail()) return nullptr;
+    return part().peekContiguous(len);
+  }
+
+  // parts are all seekable, so there's never any need to hold on to data from
+  // an earlier part: seeking back to it just reads it again.
+  void setPin(size_t abspos) override {
+    clearPin();
+    if (parts_.empty() || abspos < starts_[cur_]) return;
+    part().setPin(abspos - starts_[cur_]);
+    pinnedPart_ = cur_;
+  }
+
+  void clearPin() override {
+    if (pinnedPart_) parts_[*pinnedPart_]->clearPin();
+    pinnedPart_.reset();
+  }
+
+  bool isSeekable() const override { return true; }
+
+  void seek(size_t abspos) override {
+    if (abspos >= endPos())
+      THROW_RT("failed to seek to desired location: " << abspos);
+    clearPin();
+    auto to = static_cast<size_t>(
+        std::upper_bound(starts_.begin(), starts_.end(), abspos)
+        - starts_.begin() - 1);
+    if (to != cur_) readAheadIn(cur_, false);
+    cur_ = to;
+    part().seek(abspos - starts_[cur_]);
+    readAheadIn(cur_, readAhead_);
+  }
+
+  bool scanTo(std::string_view needle) override {
+    if (parts_.empty()) return false;
+    while (!part().scanTo(needle))
+      if (!advance()) return false;
+    return true;
+  }
+
+  void skip(size_t len) override {
+    forEachPart(len, "skip", [&](size_t n) { part().skip(n); });
+  }
+
+  void prefetch(size_t abspos, size_t len) override {
+    auto i = static_cast<size_t>(
+        std::upper_bound(starts_.begin(), starts_.end(), abspos)
+        - starts_.begin());
+    for (; i < starts_.size() && len; i++) {
+      // starts_[i-1] <= abspos < starts_[i], so this is part i-1
+      auto n = std::min(len, starts_[i] - abspos);
+      parts_[i - 1]->prefetch(abspos - starts_[i - 1], n);
+      abspos += n;
+      len -= n;
+    }
+  }
+
+private:
+  AuByteSource &part() { return *parts_[cur_]; }
+
+  /// Bytes left in the current part.
+  size_t partAvail() const { return starts_[cur_ + 1] - pos(); }
+
+  /// Move on to the start of the next part, if there is one.
+  bool advance() {
+    if (cur_ + 1 >= parts_.size()) return false;
+    readAheadIn(cur_, false);
+    cur_++;
+    // only seek if we have to: a part we haven't touched yet is already at the
+    // start, and an unindexed gzip part couldn't seek there anyway.
+    if (part().pos() != 0) part().seek(0);
+    readAheadIn(cur_, readAhead_);
+    return true;
+  }
+
+  void readAheadIn(size_t i, bool readAhead) {
+    if (i >= parts_.size()) return;
+    if (auto *file = dynamic_cast<FileByteSource *>(parts_[i].get()))
+      file->setReadAhead(readAhead);
+  }
+
+  /// Split a len byte operation into pieces which each lie within one part.
+  template <typename F>
+  void forEachPart(size_t len, const char *what, F &&f) {
+    while (len) {
+      if (parts_.empty() || (!partAvail() && !advance()))
+        AU_THROW("reached eof while trying to " << what << " " << len
+                                                << " bytes");
+      auto n = std::min(len, partAvail());
+      f(n);
+      len -= n;
+    }
+  }
+};
+
+}
@@ -2,24 +2,51 @@
 
 #include "au/AuByteSource.h"
 #include "au/ParseError.h"
+#include "au/Throttle.h"
 
+#include <algorithm>
 #include <cassert>
+#include <condition_variable>
 #include <cstdio>
+#include <cstring>
+#include <exception>
 #include <fcntl.h>
+#include <filesystem>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <thread>
 #include <unistd.h>
+#include <utility>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
 
 namespace au {
 
+/// The byte-level accessors are final: subclasses only supply doRead() and
+/// doSeek(), so parsers instantiated on FileByteSource can inline the common
+/// case and only pay for a virtual call when the buffer needs refilling.
+///
+/// With read-ahead enabled, doRead() runs on a helper thread which stays one
+/// buffer's worth ahead of the parser. Only subclasses with a ReadAheadSlot
+/// can read ahead: see there.
 class FileByteSource : public AuByteSource { // TODO rename this and FileByteSourceImpl
+public:
+  static constexpr size_t DEFAULT_MAX_BUFFER_SIZE = 64 * 1024 * 1024;
+
 protected:
   static constexpr size_t MIN_HIST_SIZE = 1 * 1024;
 
   const size_t INIT_BUFFER_SIZE;
   std::string name_;
   size_t bufSize_; //< Allocated size of current working buffer
+  size_t maxBufSize_ = DEFAULT_MAX_BUFFER_SIZE;
+  std::optional<bool> seekable_; //< isSeekable(), once we've needed to know
   char *buf_;      //< Working buffer
   size_t pos_;     //< Current position in the underlying data stream
   char *cur_;      //< Current position in the working buffer
@@ -28,6 +55,109 @@ protected:
 
   bool waitForData_;
 
+  /// A single chunk buffer, filled by doRead() on the helper thread and
+  /// drained into the working buffer by read(). Copying out costs far less
+  /// than the read it overlaps, and leaves the working buffer (and so the pin
+  /// and history handling) entirely to the parsing thread.
+  struct ReadAhead {
+    FileByteSource &source_;
+    const size_t size_;
+    std::unique_ptr<char[]> buf_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    size_t off_ = 0;
+    size_t len_ = 0;
+    bool full_ = false;   //< buf_ holds the result of a doRead() not yet taken
+    bool stop_ = false;
+    std::exception_ptr error_;
+    std::thread thread_;
+
+    ReadAhead(FileByteSource &source, size_t size)
+        : source_(source), size_(size), buf_(new char[size]),
+          thread_([this]() { run(); }) {}
+
+    ~ReadAhead() { stop(); }
+
+    /// Stops the helper thread. Whatever it read that wasn't taken is left
+    /// where it was.
+    void stop() {
+      if (!thread_.joinable()) return;
+      {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+      }
+      cond_.notify_all();
+      thread_.join();
+    }
+
+    void run() {
+      std::unique_lock lock(mutex_);
+      while (true) {
+        cond_.wait(lock, [this]() { return stop_ || !full_; });
+        if (stop_) return;
+        lock.unlock();
+        size_t len = 0;
+        std::exception_ptr error;
+        try {
+          len = source_.doRead(buf_.get(), size_);
+        } catch (...) {
+          error = std::current_exception();
+        }
+        lock.lock();
+        off_ = 0;
+        len_ = len;
+        error_ = error;
+        full_ = true;
+        cond_.notify_all();
+      }
+    }
+
+    /// Like doRead(): returns 0 only if the underlying doRead() did. Errors
+    /// from the helper thread are rethrown here.
+    size_t take(char *buf, size_t len) {
+      std::unique_lock lock(mutex_);
+      cond_.wait(lock, [this]() { return full_; });
+      if (auto error = std::exchange(error_, nullptr)) {
+        full_ = false;
+        cond_.notify_all();
+        std::rethrow_exception(error);
+      }
+      auto n = std::min(len, len_ - off_);
+      ::memcpy(buf, buf_.get() + off_, n);
+      off_ += n;
+      if (off_ == len_) {
+        full_ = false;
+        cond_.notify_all();
+      }
+      return n;
+    }
+  };
+
+  /// Where a subclass that can read ahead keeps its ReadAhead. The helper
+  /// thread calls doRead(), so it has to stop before anything doRead() depends
+  /// on goes: declared as the subclass's last member, the slot is destroyed
+  /// (and the thread joined) before any of the others.
+  class ReadAheadSlot {
+    friend class FileByteSource;
+    FileByteSource &source_;
+    std::unique_ptr<ReadAhead> readAhead_;
+
+  public:
+    explicit ReadAheadSlot(FileByteSource &source) : source_(source) {
+      source_.readAheadSlot_ = this;
+    }
+    ReadAheadSlot(const ReadAheadSlot &) = delete;
+    ReadAheadSlot &operator=(const ReadAheadSlot &) = delete;
+
+    ~ReadAheadSlot() {
+      readAhead_.reset();
+      source_.readAheadSlot_ = nullptr;
+    }
+  };
+
+private:
+  ReadAheadSlot *readAheadSlot_ = nullptr; //< Null if we can't read ahead
+
 public:
   explicit FileByteSource(const std::string &fname,
                           size_t bufferSizeInK = 256)
@@ -50,25 +180,63 @@ public:
     return name_;
   }
 
+  /// Wait for more data at eof, rather than returning it. Following a file
+  /// reads on the parsing thread, so it turns off read-ahead.
   void setFollow(bool follow) {
     waitForData_ = follow;
+    if (follow) stopReadAhead();
+  }
+
+  /// Pins hold history in the buffer, which grows to fit. Past this size, a
+  /// seekable source lets go of the pin instead, and seeking back to it reads
+  /// from the underlying stream again. Non-seekable streams have no such
+  /// option, so they keep growing.
+  void setMaxBufferSize(size_t maxBufferSize) {
+    maxBufSize_ = std::max(maxBufferSize, 2 * INIT_BUFFER_SIZE);
+  }
+
+  /// Overlap reading the underlying stream with parsing it. Pins and history
+  /// behave exactly as without: only what's handed to the working buffer
+  /// changes hands, and it's handed over in order. It can be turned off again
+  /// at any point, keeping whatever was read ahead. Does nothing if the
+  /// subclass has no ReadAheadSlot.
+  void setReadAhead(bool readAhead) {
+    if (!readAheadSlot_) return;
+    auto &slot = readAheadSlot_->readAhead_;
+    if (!readAhead || waitForData_)
+      stopReadAhead();
+    else if (!slot)
+      slot = std::make_unique<ReadAhead>(*this, INIT_BUFFER_SIZE);
   }
 
+  // the private read() below would otherwise hide this
+  using AuByteSource::read;
+
   /// Position in the underlying data stream
-  size_t pos() const override { return pos_; }
+  size_t pos() const override final { return pos_; }
 
-  Byte next() override {
+  Byte next() override final {
     while (cur_ == limit_) if (!read()) return Byte::Eof();
     pos_++;
     return Byte(*cur_++);
   }
 
-  Byte peek() override {
+  Byte peek() override final {
     while (cur_ == limit_) if (!read()) return Byte::Eof();
     return Byte(*cur_);
   }
 
-  void readFunc(size_t len, Fn &&func) override {
+  void readInto(void *buf, size_t len) override final {
+    if (len <= buffAvail()) {
+      ::memcpy(buf, cur_, len);
+      pos_ += len;
+      cur_ += len;
+      return;
+    }
+    AuByteSource::readInto(buf, len);
+  }
+
+  void readFunc(size_t len, Fn func) override final {
     while (len) {
       while (cur_ == limit_)
         if (!read())
@@ -81,7 +249,22 @@ public:
     }
   }
 
-  void skip(size_t len) override {
+  const char *peekContiguous(size_t len) override final {
+    // not worth growing the buffer for: records that big are rare, and are
+    // read piecemeal as well as ever.
+    if (len > INIT_BUFFER_SIZE) return nullptr;
+    while (buffAvail() < len)
+      if (!read()) return nullptr;
+    return cur_;
+  }
+
+  void prefetch(size_t abspos, size_t len) override final {
+    auto bufStartPos = pos_ - static_cast<size_t>(cur_ - buf_);
+    if (abspos >= bufStartPos && abspos + len <= pos_ + buffAvail()) return;
+    doPrefetch(abspos, len);
+  }
+
+  void skip(size_t len) override final {
     // it's better to avoid using seek() even for large skips. not all streams
     // are seekable, and the overwhelming majority of skips are tiny.
     while (len) {
@@ -96,8 +279,13 @@ public:
 
   void setPin(size_t abspos) override final {
     // pin should be within the current buffer, but certainly ahead of the
-    // current start of buffer
-    assert(abspos >= pos_ - static_cast<size_t>(cur_ - buf_));
+    // current start of buffer. unless we've had to let go of it already, in
+    // which case there's nothing left to hold on to.
+    if (abspos < pos_ - static_cast<size_t>(cur_ - buf_)) {
+      assert(canDropPin());
+      pinPos_.reset();
+      return;
+    }
     pinPos_ = abspos;
   }
 
@@ -105,7 +293,7 @@ public:
     pinPos_.reset();
   }
 
-  void seek(size_t abspos) override {
+  void seek(size_t abspos) override final {
     assert(!pinPos_);
     clearPin(); // assert AND clear is a little much.
     auto bufStartPos = pos_ - static_cast<size_t>(cur_ - buf_);
@@ -115,14 +303,21 @@ public:
       return;
     }
 
-    doSeek(abspos);
+    // anything read ahead is from the wrong place now, and the helper mustn't
+    // be reading while we move the underlying stream.
+    bool readingAhead = readAhead() != nullptr;
+    if (readingAhead) readAheadSlot_->readAhead_.reset();
     cur_ = limit_ = buf_;
+    doSeek(abspos);
+    // whatever doSeek() left in the buffer is history
+    cur_ = limit_;
     pos_ = abspos;
+    setReadAhead(readingAhead);
     if (read()) return;
     THROW_RT("failed to read from new location");
   }
 
-  bool scanTo(std::string_view needle) override {
+  bool scanTo(std::string_view needle) override final {
     while (true) {
       while (buffAvail() < needle.length()) {
         // we might have just done a seek that left us with a very small
@@ -157,23 +352,78 @@ public:
     }
   }
 
-private:
-  virtual size_t doRead(char *buf, size_t len) = 0;
-  virtual void doSeek(size_t abspos) = 0;
+protected:
+  /// Stop reading ahead, moving whatever the helper read that we hadn't taken
+  /// yet into the working buffer, so that the underlying stream carries on
+  /// from where the buffer ends, as it would have without.
+  void stopReadAhead() {
+    auto *readAhead = this->readAhead();
+    if (!readAhead) return;
+    readAhead->stop();
+    if (readAhead->full_ && !readAhead->error_) {
+      auto len = readAhead->len_ - readAhead->off_;
+      if (buffFree() < len) growBuffer(bufSize_ + len);
+      ::memcpy(limit_, readAhead->buf_.get() + readAhead->off_, len);
+      limit_ += len;
+    }
+    readAheadSlot_->readAhead_.reset();
+  }
 
   /// Free space in the buffer
   size_t buffFree() const {
     return bufSize_ - static_cast<size_t>(limit_ - buf_);
   }
 
+  /// Grow the buffer to at least size bytes, keeping what's in it.
+  void growBuffer(size_t size) {
+    if (size <= bufSize_) return;
+    auto curPos = cur_ - buf_;
+    auto limitPos = limit_ - buf_;
+    auto *grown = static_cast<char *>(realloc(buf_, size));
+    if (!grown) THROW_RT("Unable to grow buffer to " << size << " bytes!");
+    buf_ = grown;
+    bufSize_ = size;
+    cur_ = buf_ + curPos;
+    limit_ = buf_ + limitPos;
+  }
+
+  /// For a followed source whose underlying data has been replaced: forget
+  /// everything buffered, and let the parser know it must start over.
+  [[noreturn]] void restart(const std::string &why) {
+    pinPos_.reset();
+    pos_ = 0;
+    cur_ = limit_ = buf_;
+    throw stream_restarted(name_ + ": " + why);
+  }
+
+private:
+  ReadAhead *readAhead() const {
+    return readAheadSlot_ ? readAheadSlot_->readAhead_.get() : nullptr;
+  }
+
+  virtual size_t doRead(char *buf, size_t len) = 0;
+  /// Called with an empty buffer. If the bytes just before abspos come to
+  /// hand anyway, they can be written at limit_ (up to buffFree() of them,
+  /// advancing limit_), and seeking back over them will then be free.
+  virtual void doSeek(size_t abspos) = 0;
+  /// See prefetch(). Only called for data we don't already have buffered.
+  virtual void doPrefetch([[maybe_unused]] size_t abspos,
+                          [[maybe_unused]] size_t len) {}
+  /// Called at eof when following, before trying doRead() again.
+  virtual void waitForData() { ::sleep(1); }
+
   /// Available to be consumed
   size_t buffAvail() const {
     return static_cast<size_t>(limit_ - cur_);
   }
 
-private:
-  /// @return true if some data was read, false if 0 bytes were read.
-  bool read() {
+  bool canDropPin() {
+    if (!seekable_) seekable_ = isSeekable();
+    return *seekable_;
+  }
+
+  /// Discard all but the history we've been asked to keep.
+  void dropHistory() {
     // Keep a minimum amount of consumed data in the buffer so we can seek back
     // even in non-seekable data streams. we rely on this to inspect the first
     // few bytes of a file to guess the file type, and in a few other places.
@@ -191,27 +441,38 @@ private:
       cur_ -= shift;
       limit_ -= shift;
     }
+  }
 
-    // now see if we need to increase the size of the buffer.
-    if (buffFree() == 0) {
-        auto curPos = cur_ - buf_;
-        auto limitPos = limit_ - buf_;
-        // always grow the buffer by a constant amount, there's no particular
-        // reason to believe it's going to need to grow exponentially or
-        // anything like that.
-        bufSize_ += INIT_BUFFER_SIZE;
-        buf_ = static_cast<char *>(realloc(buf_, bufSize_));
-        if (!buf_)
-            THROW_RT("Unable to grow buffer to " << bufSize_ << " bytes!");
-        cur_ = buf_ + curPos;
-        limit_ = buf_ +  limitPos;
+private:
+  /// @return true if some data was read, false if 0 bytes were read.
+  bool read() {
+    // compact once we're running out of room, rather than on every read:
+    // until then, everything already read stays put, and seeking back over it
+    // is free. but not only once we're out, or every read from then on would
+    // be for the sliver just consumed.
+    if (buffFree() < bufSize_ / 4) dropHistory();
+
+    // a pin that would take us past the limit is dropped if the stream can
+    // get the data back some other way.
+    if (buffFree() == 0 && pinPos_ && bufSize_ + INIT_BUFFER_SIZE > maxBufSize_
+        && canDropPin()) {
+      pinPos_.reset();
+      dropHistory();
     }
 
+    // now see if we need to increase the size of the buffer.
+    // always grow the buffer by a constant amount, there's no particular
+    // reason to believe it's going to need to grow exponentially or anything
+    // like that.
+    if (buffFree() == 0) growBuffer(bufSize_ + INIT_BUFFER_SIZE);
+
     size_t bytesRead = 0;
     do {
-      bytesRead = doRead(limit_, buffFree());
+      auto *readAhead = this->readAhead();
+      bytesRead = readAhead ? readAhead->take(limit_, buffFree())
+                            : doRead(limit_, buffFree());
       if (bytesRead == 0 && waitForData_)
-        sleep(1);
+        waitForData();
     } while (!bytesRead && waitForData_);
 
     if (!bytesRead) return false;
@@ -229,14 +490,84 @@ struct Closer {
 // A File is a self-closing FILE *.
 using File = std::unique_ptr<FILE, Closer>;
 
+/// Asks the kernel to drop a file's pages from the page cache once the reader
+/// is done with them, so a one-off scan of a huge file doesn't evict the
+/// working set of everything else on the box. Pages are dropped in chunks,
+/// trailing the read position; anything seeked back over is simply read (and
+/// dropped) again. Disabled until attach()ed, and a no-op for pipes.
+class CacheDropper {
+  static constexpr size_t CHUNK_SIZE = 8 * 1024 * 1024;
+
+  int fd_ = -1;
+  size_t from_ = 0; //< Start of the range not yet dropped
+
+public:
+  CacheDropper() = default;
+  CacheDropper(const CacheDropper &) = delete;
+  CacheDropper &operator=(const CacheDropper &) = delete;
+
+  /// fd must stay open until this is destroyed, or detached first.
+  void attach(int fd) {
+    detach();
+    fd_ = fd;
+    from_ = 0;
+  }
+
+  void detach() {
+    if (fd_ >= 0) drop(std::numeric_limits<size_t>::max());
+    fd_ = -1;
+  }
+
+  bool attached() const { return fd_ >= 0; }
+
+  ~CacheDropper() { detach(); }
+
+  /// Call after each read. Cheap unless there's a whole chunk to drop.
+  void update() {
+    if (fd_ < 0) return;
+    auto pos = ::lseek(fd_, 0, SEEK_CUR);
+    if (pos < 0) return;
+    update(static_cast<size_t>(pos));
+  }
+
+  /// As update(), for a reader that tracks its own position (pread() say).
+  void update(size_t upTo) {
+    if (fd_ < 0) return;
+    if (upTo < from_)
+      from_ = upTo;
+    else if (upTo - from_ >= CHUNK_SIZE)
+      drop(upTo);
+  }
+
+private:
+  void drop([[maybe_unused]] size_t upTo) {
+#ifndef __APPLE__
+    // a len of 0 means "to the end of the file". failures (pipes, mostly)
+    // don't matter.
+    auto len = upTo == std::numeric_limits<size_t>::max() ? 0 : upTo - from_;
+    ::posix_fadvise(fd_, static_cast<off_t>(from_),
+                    static_cast<off_t>(len), POSIX_FADV_DONTNEED);
+#endif
+    from_ = upTo;
+  }
+};
+
 class FileByteSourceImpl : public FileByteSource {
   friend class ZipByteSource;
+  std::string path_;
   File file_;
+  CacheDropper cacheDropper_;
+  Throttle *throttle_ = nullptr;
+#ifdef __linux__
+  int inotify_ = -1;   //< Set up the first time we reach eof following
+  int fileWatch_ = -1;
+#endif
+  ReadAheadSlot readAhead_{*this}; //< Last: see ReadAheadSlot
 
 public:
   explicit FileByteSourceImpl(const std::string &fname,
                               size_t bufferSizeInK = 256)
-      : FileByteSource(fname, bufferSizeInK) {
+      : FileByteSource(fname, bufferSizeInK), path_(fname) {
     if (fname == "-") {
       file_ = File(stdin);
     } else {
@@ -250,6 +581,23 @@ public:
 #endif
   }
 
+  ~FileByteSourceImpl() override {
+#ifdef __linux__
+    if (inotify_ >= 0) ::close(inotify_);
+#endif
+  }
+
+  /// Keep what we read out of the page cache. See CacheDropper.
+  void setNoCache(bool noCache) {
+    if (noCache)
+      cacheDropper_.attach(::fileno(file_.get()));
+    else
+      cacheDropper_.detach();
+  }
+
+  /// Hold reads to throttle's limits, if not null. It must outlive this.
+  void setThrottle(Throttle *throttle) { throttle_ = throttle; }
+
   size_t endPos() const override {
     struct stat stat;
     if (auto res = fstat(fileno(file_.get()), &stat); res < 0)
@@ -260,12 +608,33 @@ public:
   }
 
   bool isSeekable() const override {
-    return ::fseek(file_.get(), 0, SEEK_CUR) != -1;
+    // lseek rather than fseek: it leaves the FILE alone, which a read-ahead
+    // thread may be in the middle of reading.
+    return ::lseek(::fileno(file_.get()), 0, SEEK_CUR) != -1;
+  }
+
+protected:
+  void waitForData() override {
+    // some stdio implementations make eof sticky, which would hide anything
+    // appended from here on.
+    ::clearerr(file_.get());
+    if (path_ == "-") {
+      ::sleep(1);
+      return;
+    }
+    waitForChange();
+    checkReplaced();
   }
 
 private:
   size_t doRead(char *buf, size_t len) override {
-    return ::fread(buf, 1, len, file_.get());
+    auto bytesRead = ::fread(buf, 1, len, file_.get());
+    cacheDropper_.update();
+    if (throttle_) throttle_->account(bytesRead);
+    // watch from eof on, not just from when we wait, or a change in between
+    // would go unnoticed until the wait times out
+    if (!bytesRead && waitForData_ && path_ != "-") startWatching();
+    return bytesRead;
   }
 
   void doSeek(size_t abspos) override {
@@ -274,6 +643,348 @@ private:
       THROW_RT("failed to seek to desired location: " << strerror(errno));
     }
   }
+
+  void doPrefetch([[maybe_unused]] size_t abspos,
+                  [[maybe_unused]] size_t len) override {
+#ifndef __APPLE__
+    // starts the reads without waiting for them. failures don't matter.
+    ::posix_fadvise(::fileno(file_.get()), static_cast<off_t>(abspos),
+                    static_cast<off_t>(len), POSIX_FADV_WILLNEED);
+#endif
+  }
+
+  /// Watch for the file being written to, or something being created or
+  /// moved into its directory (which is what rotation looks like), if we
+  /// aren't already.
+  void startWatching() {
+#ifdef __linux__
+    if (inotify_ >= 0) return;
+    inotify_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_ < 0) return;
+    auto dir = std::filesystem::path(path_).parent_path();
+    ::inotify_add_watch(inotify_, dir.empty() ? "." : dir.c_str(),
+                        IN_CREATE | IN_MOVED_TO);
+    watchFile();
+#endif
+  }
+
+  /// Wakes as soon as anything startWatching() watches for happens. The
+  /// timeout covers filesystems that don't deliver events, nfs for one.
+  void waitForChange() {
+#ifdef __linux__
+    startWatching();
+    if (inotify_ >= 0) {
+      pollfd pfd{inotify_, POLLIN, 0};
+      if (::poll(&pfd, 1, 1000) > 0) {
+        // we re-examine the file whatever happened, so the events themselves
+        // don't matter. just drain them.
+        char events[4096];
+        while (::read(inotify_, events, sizeof(events)) > 0) {}
+      }
+      return;
+    }
+#endif
+    ::sleep(1);
+  }
+
+  /// Whether the file still has what we read from just before offset, as far
+  /// as the last few bytes of it still in the buffer can tell.
+  bool stillHolds(size_t offset) {
+    char bytes[64];
+    auto len = std::min({sizeof(bytes), static_cast<size_t>(limit_ - buf_),
+                         offset});
+    if (!len) return true;
+    auto bytesRead = ::pread(::fileno(file_.get()), bytes, len,
+                             static_cast<off_t>(offset - len));
+    if (bytesRead < 0) return true; // we can't tell
+    return static_cast<size_t>(bytesRead) == len
+           && ::memcmp(bytes, limit_ - len, len) == 0;
+  }
+
+#ifdef __linux__
+  void watchFile() {
+    if (fileWatch_ >= 0) ::inotify_rm_watch(inotify_, fileWatch_);
+    fileWatch_ = ::inotify_add_watch(
+        inotify_, path_.c_str(),
+        IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+  }
+#endif
+
+  /// At eof: if the file has shrunk, or what's before where we'd got to isn't
+  /// what we read there, it was truncated in place (copytruncate), and maybe
+  /// written past there again since. If its path now leads to a different
+  /// file, it was rotated, and once we've read everything from the old one we
+  /// move on to the new one. Either way the stream starts over.
+  void checkReplaced() {
+    struct stat byFd;
+    auto offset = ::ftell(file_.get());
+    if (offset < 0 || ::fstat(::fileno(file_.get()), &byFd) < 0) return;
+    if (byFd.st_size < offset || !stillHolds(static_cast<size_t>(offset))) {
+      ::fseek(file_.get(), 0, SEEK_SET);
+      restart("file truncated, following from the start");
+    }
+    if (byFd.st_size > offset) return; // still more to read from this one
+
+    struct stat byPath;
+    // nothing there (yet) means it's been moved away; keep following that.
+    if (::stat(path_.c_str(), &byPath) < 0) return;
+    if (byPath.st_dev == byFd.st_dev && byPath.st_ino == byFd.st_ino) return;
+    File reopened(::fopen(path_.c_str(), "rb"));
+    if (!reopened) return; // we'll try again next time
+    bool noCache = cacheDropper_.attached();
+    cacheDropper_.detach();
+    file_ = std::move(reopened);
+    if (noCache) cacheDropper_.attach(::fileno(file_.get()));
+#ifdef __linux__
+    if (inotify_ >= 0) watchFile();
+#endif
+    restart("file replaced, following the new one from the start");
+  }
+};
+
+/// An open file which any number of PreadByteSources can read at once. pread()
+/// takes an explicit offset, so there's no shared file position to fight
+/// over. The size is taken when the file is opened: data appended later isn't
+/// seen.
+class PreadFile {
+  std::string name_;
+  File file_; //< Only ever pread(): its FILE position goes unused
+  size_t size_;
+
+public:
+  explicit PreadFile(const std::string &fname)
+      : PreadFile(fname, open(fname)) {}
+
+  /// Takes over file, which must be seekable, for reading with pread() from
+  /// now on. Whatever was read from it before makes no difference.
+  PreadFile(const std::string &fname, File file)
+      : name_(fname), file_(std::move(file)) {
+    struct stat stat;
+    if (::fstat(fd(), &stat) < 0)
+      THROW_RT("failed to stat file: " << strerror(errno) << " (" << fname
+                                       << ")");
+    size_ = static_cast<size_t>(stat.st_size);
+#ifndef __APPLE__
+    // we don't care if this fails
+    ::posix_fadvise(fd(), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  }
+
+  PreadFile(const PreadFile &) = delete;
+  PreadFile(PreadFile &&) = delete;
+  PreadFile &operator=(const PreadFile &) = delete;
+  PreadFile &operator=(PreadFile &&) = delete;
+
+  const std::string &name() const { return name_; }
+  size_t size() const { return size_; }
+  int fd() const { return ::fileno(file_.get()); }
+
+  /// Start reading [offset, offset+len) into the page cache, without waiting.
+  void prefetch([[maybe_unused]] size_t offset,
+                [[maybe_unused]] size_t len) const {
+#ifndef __APPLE__
+    ::posix_fadvise(fd(), static_cast<off_t>(offset), static_cast<off_t>(len),
+                    POSIX_FADV_WILLNEED);
+#endif
+  }
+
+  /// Like pread(), but retries interrupted calls and throws on error.
+  size_t read(char *buf, size_t len, size_t offset) const {
+    while (true) {
+      auto bytesRead = ::pread(fd(), buf, len, static_cast<off_t>(offset));
+      if (bytesRead >= 0) return static_cast<size_t>(bytesRead);
+      if (errno != EINTR)
+        THROW_RT("pread: " << strerror(errno) << " (" << name_ << ")");
+    }
+  }
+
+private:
+  static File open(const std::string &fname) {
+    File file(::fopen(fname.c_str(), "rb"));
+    if (!file)
+      THROW_RT("fopen: " << strerror(errno) << " (" << fname << ")");
+    return file;
+  }
+};
+
+/// A cursor over a PreadFile, with its own buffer and position. Cursors over
+/// the same file are independent, so each thread splitting up a big file can
+/// have its own without opening the file again.
+class PreadByteSource : public FileByteSource {
+  std::shared_ptr<const PreadFile> file_;
+  size_t readPos_ = 0; //< Offset of the next doRead()
+  ReadAheadSlot readAhead_{*this}; //< Last: see ReadAheadSlot
+
+public:
+  explicit PreadByteSource(const std::string &fname,
+                           size_t bufferSizeInK = 256)
+      : PreadByteSource(std::make_shared<const PreadFile>(fname),
+                        bufferSizeInK) {}
+
+  explicit PreadByteSource(std::shared_ptr<const PreadFile> file,
+                           size_t bufferSizeInK = 256)
+      : FileByteSource(file->name(), bufferSizeInK), file_(std::move(file)) {}
+
+  /// Another cursor over the same file, starting at its beginning.
+  std::unique_ptr<PreadByteSource> cursor(size_t bufferSizeInK = 256) const {
+    return std::make_unique<PreadByteSource>(file_, bufferSizeInK);
+  }
+
+  size_t endPos() const override { return file_->size(); }
+
+  bool isSeekable() const override { return true; }
+
+private:
+  size_t doRead(char *buf, size_t len) override {
+    if (readPos_ >= file_->size()) return 0;
+    len = std::min(len, file_->size() - readPos_);
+    auto bytesRead = file_->read(buf, len, readPos_);
+    readPos_ += bytesRead;
+    return bytesRead;
+  }
+
+  void doSeek(size_t abspos) override {
+    readPos_ = abspos;
+  }
+
+  void doPrefetch(size_t abspos, size_t len) override {
+    file_->prefetch(abspos, len);
+  }
+};
+
+/// Serves a regular file straight from a read-only mapping of the whole
+/// thing, so nothing is copied on the way in and seeks are free. The mapping is
+/// taken once at construction: it won't see data appended afterwards, so it's
+/// no good for following a growing file. And touching a page past the end of a
+/// file that's been truncated since (copytruncate log rotation, say) raises
+/// SIGBUS, so it's only for files that nothing is still writing.
+class MmapByteSource final : public AuByteSource {
+  std::string name_;
+  const char *buf_ = nullptr; //< Start of the mapping
+  size_t len_ = 0;            //< Length of the mapping (the file size)
+  size_t pos_ = 0;            //< Current position
+
+public:
+  explicit MmapByteSource(const std::string &fname) : name_(fname) {
+    auto fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0)
+      THROW_RT("open: " << strerror(errno) << " (" << fname << ")");
+    struct stat stat;
+    if (::fstat(fd, &stat) < 0 || stat.st_size <= 0) {
+      ::close(fd);
+      THROW_RT("can't map " << fname << ": unable to determine size");
+    }
+    len_ = static_cast<size_t>(stat.st_size);
+    auto *map = ::mmap(nullptr, len_, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping holds its own reference to the file
+    ::close(fd);
+    if (map == MAP_FAILED)
+      THROW_RT("mmap: " << strerror(errno) << " (" << fname << ")");
+    buf_ = static_cast<const char *>(map);
+#ifndef __APPLE__
+    // we don't care if this fails
+    ::posix_madvise(map, len_, POSIX_MADV_SEQUENTIAL);
+#endif
+  }
+
+  MmapByteSource(const MmapByteSource &) = delete;
+  MmapByteSource(MmapByteSource &&) = delete;
+  MmapByteSource &operator=(const MmapByteSource &) = delete;
+  MmapByteSource &operator=(MmapByteSource &&) = delete;
+
+  ~MmapByteSource() override {
+    ::munmap(const_cast<char *>(buf_), len_);
+  }
+
+  /// Whether fname is something we can map: a non-empty regular file. Anything
+  /// else (stdin, pipes, devices, empty files) should use FileByteSourceImpl.
+  static bool canMap(const std::string &fname) {
+    if (fname == "-") return false;
+    struct stat stat;
+    if (::stat(fname.c_str(), &stat) < 0) return false;
+    return S_ISREG(stat.st_mode) && stat.st_size > 0;
+  }
+
+  std::string name() const override {
+    return name_;
+  }
+
+  size_t pos() const override { return pos_; }
+
+  size_t endPos() const override { return len_; }
+
+  Byte peek() override {
+    return pos_ < len_ ? Byte(buf_[pos_]) : Byte::Eof();
+  }
+
+  Byte next() override {
+    return pos_ < len_ ? Byte(buf_[pos_++]) : Byte::Eof();
+  }
+
+  void readInto(void *buf, size_t len) override {
+    if (len > len_ - pos_)
+      AU_THROW("reached eof while trying to read " << len << " bytes");
+    ::memcpy(buf, buf_ + pos_, len);
+    pos_ += len;
+  }
+
+  void readFunc(size_t len, Fn func) override {
+    if (len > len_ - pos_)
+      AU_THROW("reached eof while trying to read " << len << " bytes");
+    func(std::string_view(buf_ + pos_, len));
+    pos_ += len;
+  }
+
+  const char *peekContiguous(size_t len) override {
+    return len <= len_ - pos_ ? buf_ + pos_ : nullptr;
+  }
+
+  // ignored, the whole file is always available...
+  void setPin(size_t abspos) override final {
+    assert(abspos <= len_);
+    (void)abspos;
+  }
+  void clearPin() override final {}
+
+  bool isSeekable() const override { return true; }
+
+  void seek(size_t abspos) override {
+    // same contract as FileByteSource: seeking to eof is an error.
+    if (abspos >= len_)
+      THROW_RT("failed to seek to desired location: " << abspos);
+    pos_ = abspos;
+  }
+
+  void skip(size_t len) override {
+    if (len > len_ - pos_)
+      THROW_RT("failed to read from new location while skipping");
+    pos_ += len;
+  }
+
+  void prefetch(size_t abspos, size_t len) override {
+    if (abspos >= len_) return;
+    // madvise wants a page-aligned start
+    static const auto pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    auto start = abspos / pageSize * pageSize;
+    len = std::min(len, len_ - abspos) + (abspos - start);
+    ::posix_madvise(const_cast<char *>(buf_) + start, len,
+                    POSIX_MADV_WILLNEED);
+  }
+
+  bool scanTo(std::string_view needle) override {
+    auto *found = static_cast<const char *>(
+        memmem(buf_ + pos_, len_ - pos_, needle.data(), needle.length()));
+    if (found) {
+      assert(found >= buf_);
+      pos_ = static_cast<size_t>(found - buf_);
+      return true;
+    }
+    // leave things where FileByteSource would: with too few bytes left for
+    // the needle to fit.
+    if (len_ - pos_ >= needle.length())
+      pos_ = len_ - (needle.length() - 1);
+    return false;
+  }
 };
 
 }
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <ctime>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <thread>
+
+namespace au {
+
+/// Keeps a background scan from competing with whatever else the box is
+/// doing, by holding it to a rate of bytes read per second (a token bucket,
+/// which allows a short burst) and/or a share of one cpu's time. Sources call
+/// account() after each read from disk, which sleeps as long as it takes to get
+/// back under both limits. One Throttle can be shared by several sources (and
+/// their read-ahead threads), so the limits hold across all of them.
+class Throttle {
+public:
+  using Clock = std::chrono::steady_clock;
+  using Duration = std::chrono::duration<double>;
+
+  /// Where a Throttle gets the time and the cpu time used, and how it waits.
+  /// Tests substitute their own, so that what's owed doesn't depend on how
+  /// busy the box is.
+  struct Clocks {
+    virtual ~Clocks() = default;
+    virtual Clock::time_point now() { return Clock::now(); }
+    /// Counts every thread in the process.
+    virtual Duration cpuTime() {
+      timespec ts;
+      ::clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+      return Duration(static_cast<double>(ts.tv_sec)
+                      + static_cast<double>(ts.tv_nsec) * 1e-9);
+    }
+    virtual void sleep(Duration wait) { std::this_thread::sleep_for(wait); }
+  };
+
+private:
+  Clocks &clocks_;
+  mutable std::mutex mutex_;
+  double bytesPerSec_ = 0; //< 0 for no limit
+  double cpuShare_ = 0;    //< Of a single cpu. 0 for no limit
+  double tokens_ = 0;      //< Bytes we may read now; negative when in debt
+  Clock::time_point lastRefill_;
+  // cpu use is measured over a window of about a second, so one long stall
+  // long ago can't buy an unbounded burst now
+  Clock::time_point windowStart_;
+  Duration windowCpuStart_{};
+  Duration throttled_{};
+
+public:
+  explicit Throttle(Clocks &clocks = systemClocks())
+      : clocks_(clocks), lastRefill_(clocks_.now()),
+        windowStart_(lastRefill_) {}
+  Throttle(const Throttle &) = delete;
+  Throttle &operator=(const Throttle &) = delete;
+
+  void setBytesPerSecond(size_t bytesPerSec) {
+    std::scoped_lock lock(mutex_);
+    bytesPerSec_ = static_cast<double>(bytesPerSec);
+    tokens_ = burst();
+    lastRefill_ = clocks_.now();
+  }
+
+  /// share is a fraction of one cpu, so 0.25 lets us run a quarter of the
+  /// time. Counts every thread in the process.
+  void setCpuShare(double share) {
+    std::scoped_lock lock(mutex_);
+    cpuShare_ = share;
+    windowStart_ = clocks_.now();
+    windowCpuStart_ = clocks_.cpuTime();
+  }
+
+  bool enabled() const {
+    std::scoped_lock lock(mutex_);
+    return bytesPerSec_ > 0 || cpuShare_ > 0;
+  }
+
+  /// Call after reading bytesRead bytes. Sleeps if we're over either limit.
+  void account(size_t bytesRead) {
+    Duration wait{};
+    {
+      std::scoped_lock lock(mutex_);
+      if (bytesPerSec_ > 0) wait = std::max(wait, waitForBytes(bytesRead));
+      if (cpuShare_ > 0) wait = std::max(wait, waitForCpu());
+      throttled_ += wait;
+    }
+    if (wait.count() > 0) clocks_.sleep(wait);
+  }
+
+  /// Total time spent asleep in account(), across every caller.
+  Duration throttled() const {
+    std::scoped_lock lock(mutex_);
+    return throttled_;
+  }
+
+  /// A line for stderr at the end of a command, if we were limited at all.
+  void report(std::ostream &os) const {
+    if (!enabled()) return;
+    os << "Throttled for " << std::fixed << std::setprecision(1)
+       << throttled().count() << "s\n";
+  }
+
+private:
+  static Clocks &systemClocks() {
+    static Clocks clocks;
+    return clocks;
+  }
+
+  double burst() const {
+    // a tenth of a second's worth, but never less than a typical read
+    return std::max(bytesPerSec_ / 10, 256.0 * 1024);
+  }
+
+  Duration waitForBytes(size_t bytesRead) {
+    auto now = clocks_.now();
+    tokens_ = std::min(
+        burst(),
+        tokens_ + Duration(now - lastRefill_).count() * bytesPerSec_);
+    lastRefill_ = now;
+    tokens_ -= static_cast<double>(bytesRead);
+    if (tokens_ >= 0) return {};
+    // the debt is paid off by the time we wake up. refilling then credits the
+    // sleep back, so count it as spent already.
+    auto debt = Duration(-tokens_ / bytesPerSec_);
+    tokens_ = 0;
+    lastRefill_ = now + std::chrono::duration_cast<Clock::duration>(debt);
+    return debt;
+  }
+
+  Duration waitForCpu() {
+    auto now = clocks_.now();
+    auto cpu = clocks_.cpuTime();
+    auto elapsed = Duration(now - windowStart_);
+    auto used = cpu - windowCpuStart_;
+    // sleeping until used is cpuShare_ of the time brings us back in line
+    auto wait = used / cpuShare_ - elapsed;
+    if (elapsed.count() > 1.0) {
+      windowStart_ = now + std::chrono::duration_cast<Clock::duration>(
+          std::max(wait, Duration{}));
+      windowCpuStart_ = cpu;
+    }
+    return std::max(wait, Duration{});
+  }
+};
+
+}
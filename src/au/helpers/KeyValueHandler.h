@@ -50,7 +50,8 @@ struct KeyValueHandler : public au::NoopValueHandler {
     context_.emplace_back(Context::BARE, "", "");
   }
 
-  void onValue(au::AuByteSource &src, au::Dictionary::Dict &dict) {
+  template <typename Source>
+  void onValue(Source &src, au::Dictionary::Dict &dict) {
     dict_ = &dict;
     au::ValueParser parser(src, *this);
     parser.value();
@@ -1,9 +1,121 @@
+#include "au/AuDecoder.h"
+#include "au/AuEncoder.h"
+#include "au/BufferByteSource.h"
+#include "au/FileByteSource.h"
+#include "AuRecordHandler.h"
 #include "JsonOutputHandler.h"
 
 #include "gtest/gtest.h"
 
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <string_view>
+
 namespace au {
 
+namespace {
+
+/// A file full of known content, removed again at the end of the test.
+struct TempFile {
+  std::string path;
+
+  explicit TempFile(std::string_view content) {
+    auto tmpl = (std::filesystem::temp_directory_path() / "au-test-XXXXXX")
+        .string();
+    auto fd = ::mkstemp(tmpl.data());
+    if (fd < 0) throw std::runtime_error("mkstemp failed");
+    ::close(fd);
+    path = tmpl;
+    std::ofstream out(path, std::ios::binary);
+    out << content;
+  }
+
+  ~TempFile() { ::unlink(path.c_str()); }
+};
+
+/// Reads as a BufferByteSource does, but never has anything contiguous to
+/// offer, so that every record is parsed a byte at a time.
+class PiecemealSource : public AuByteSource {
+  BufferByteSource source_;
+
+public:
+  explicit PiecemealSource(std::string_view buf) : source_(buf) {}
+
+  std::string name() const override { return source_.name(); }
+  size_t pos() const override { return source_.pos(); }
+  size_t endPos() const override { return source_.endPos(); }
+  Byte peek() override { return source_.peek(); }
+  Byte next() override { return source_.next(); }
+  void readFunc(size_t len, Fn func) override { source_.readFunc(len, func); }
+  const char *peekContiguous(size_t) override { return nullptr; }
+  void setPin(size_t abspos) override { source_.setPin(abspos); }
+  void clearPin() override { source_.clearPin(); }
+  bool isSeekable() const override { return true; }
+  void seek(size_t abspos) override { source_.seek(abspos); }
+  bool scanTo(std::string_view needle) override {
+    return source_.scanTo(needle);
+  }
+  void skip(size_t len) override { source_.skip(len); }
+};
+
+template <typename F>
+void encode(AuEncoder &au, std::string &out, F &&f) {
+  au.encode(f, [&](std::string_view a, std::string_view b) {
+    out.append(a).append(b);
+    return a.size() + b.size();
+  });
+}
+
+/// Records with one of each kind of value in them, and then some.
+std::string everyKindOfValue() {
+  AuEncoder au;
+  std::string result;
+  auto t0 = std::chrono::system_clock::time_point() + std::chrono::hours(1);
+  for (int i = 0; i < 100; i++) {
+    encode(au, result, [&](AuWriter &writer) {
+      writer.map(
+          "null", nullptr,
+          "bools", writer.arrayVals([&]() {
+            writer.value(true).value(false);
+          }),
+          "ints", writer.arrayVals([&]() {
+            writer.value(i).value(-i).value(i * 1000).value(-i * 1000)
+                .value(std::numeric_limits<int64_t>::min() + i)
+                .value(std::numeric_limits<uint64_t>::max() - 1);
+          }),
+          "double", 1.5 * i,
+          "time", t0 + std::chrono::nanoseconds(i),
+          "short", "abc",
+          "long", std::string(100 + i, 'x'),
+          "nested", writer.mapVals([&](auto &sink) {
+            sink("empty", writer.arrayVals([]() {}));
+            sink("deeper", writer.mapVals([](auto &) {}));
+          }));
+    });
+  }
+  // bigger than a 1k buffer, which can't have it all at once
+  encode(au, result, [&](AuWriter &writer) {
+    writer.map("huge", std::string(3000, 'y'));
+  });
+  return result;
+}
+
+std::string json(AuByteSource &source) {
+  std::stringstream ss;
+  JsonOutputHandler handler(ss);
+  Dictionary dictionary;
+  AuRecordHandler recordHandler(dictionary, handler);
+  RecordParser(source, recordHandler).parseStream();
+  return ss.str();
+}
+
+}
+
 TEST(JsonOutputHandler, Time) {
   using namespace std::chrono;
   JsonOutputHandler json;
@@ -11,4 +123,62 @@ TEST(JsonOutputHandler, Time) {
   EXPECT_EQ(json.str(), R"("1970-01-01T00:00:00.123456789")");
 }
 
-}
\ No newline at end of file
+TEST(RecordParser, ParsesBufferedRecordsAsItDoesAnyOthers) {
+  auto records = everyKindOfValue();
+  PiecemealSource piecemeal(records);
+  auto expected = json(piecemeal);
+  ASSERT_NE(std::string::npos, expected.find(std::string(3000, 'y')));
+
+  BufferByteSource buffer(records);
+  EXPECT_EQ(expected, json(buffer));
+  // records straddle the end of a 1k buffer all the time, and the huge one
+  // never fits in it
+  TempFile file(records);
+  FileByteSourceImpl small(file.path, 1);
+  EXPECT_EQ(expected, json(small));
+}
+
+TEST(ValueParser, ReadsNothingPastTheEndOfItsBuffer) {
+  using namespace std::string_literals;
+  Dictionary::Dict dict(0);
+  for (auto &value : {"\x28" "abcdefgh"s, "\x05\x03" "abc"s,
+                      "\x0b\x61\x62\x63\x0c"s, "\x0d\x21k\x61\x0e"s,
+                      "\x06\x81\x01"s, "\x03\0\0\0\0\0\0\xf8\x3f"s,
+                      "\x04\0\0\0\0\0\0\0\x01"s, "\x08\0\0\0\0\0\0\0\x01"s}) {
+    std::ostringstream out;
+    JsonOutputHandler handler(out);
+    BufferByteSource whole(value);
+    EXPECT_NO_THROW(handler.onValue(whole, dict));
+    // where the byte past the end would have made a whole value of it
+    BufferByteSource cut(value.data(), value.size() - 1);
+    EXPECT_THROW(handler.onValue(cut, dict), parse_error) << out.str();
+  }
+}
+
+TEST(RecordParser, KeepsValuesWithinTheirRecord) {
+  auto corrupt = [](std::string_view value, std::string_view corrupted) {
+    AuEncoder au;
+    std::string records;
+    encode(au, records, [](AuWriter &writer) { writer.value("before"); });
+    encode(au, records, [](AuWriter &writer) { writer.value("abcdefgh"); });
+    encode(au, records, [](AuWriter &writer) { writer.array(1, 2, 3); });
+    encode(au, records, [](AuWriter &writer) {
+      writer.value(std::string(100, 'z'));
+    });
+    auto at = records.find(value);
+    EXPECT_NE(std::string::npos, at);
+    records.replace(at, corrupted.size(), corrupted);
+    return records;
+  };
+  // a string claiming to be longer than its record, and an array that's never
+  // closed, neither of which may read on into the next record.
+  for (auto &records : {corrupt("\x28" "abcdefgh", "\x3f"),
+                        corrupt("\x61\x62\x63\x0c", "\x61\x62\x63\x64")}) {
+    BufferByteSource buffer(records);
+    EXPECT_THROW(json(buffer), parse_error);
+    PiecemealSource piecemeal(records);
+    EXPECT_THROW(json(piecemeal), parse_error);
+  }
+}
+
+}
@@ -0,0 +1,266 @@
+#include "au/AuEncoder.h"
+#include "au/BufferByteSource.h"
+#include "au/ConcatByteSource.h"
+#include "AuRecordHandler.h"
+#include "GrepHandler.h"
+#include "JsonOutputHandler.h"
+#include "Tail.h"
+#include "main.h"
+
+#include <gmock/gmock.h>
+
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace au {
+
+namespace {
+
+std::unique_ptr<ConcatByteSource> concat(
+    const std::vector<std::string_view> &parts) {
+  std::vector<std::unique_ptr<AuByteSource>> sources;
+  for (auto part : parts)
+    sources.emplace_back(std::make_unique<BufferByteSource>(part));
+  return std::make_unique<ConcatByteSource>(std::move(sources));
+}
+
+std::string readAll(AuByteSource &source, size_t len) {
+  std::string result;
+  source.readFunc(len, [&](std::string_view frag) { result.append(frag); });
+  return result;
+}
+
+/// An au file with the given records, each an object with an "n" value.
+std::string auFile(int first, int count) {
+  AuEncoder au;
+  std::string result;
+  for (int n = first; n < first + count; n++) {
+    au.encode([&](AuWriter &w) { w.map("n", n, "s", "a repeated string"); },
+              [&](std::string_view a, std::string_view b) {
+                result.append(a).append(b);
+                return a.size() + b.size();
+              });
+  }
+  return result;
+}
+
+std::string decodeToJson(AuByteSource &source, Dictionary &dictionary) {
+  std::stringstream ss;
+  JsonOutputHandler handler(ss);
+  AuRecordHandler recordHandler(dictionary, handler);
+  RecordParser(source, recordHandler).parseStream();
+  return ss.str();
+}
+
+/// Serves data as a file would, counting the reads it's asked for, from
+/// whichever thread.
+class CountingSource : public FileByteSource {
+  std::string data_;
+  size_t readPos_ = 0;
+
+public:
+  std::atomic<size_t> reads = 0;
+
+private:
+  ReadAheadSlot readAhead_{*this}; //< Last: see ReadAheadSlot
+
+public:
+  explicit CountingSource(std::string data)
+      : FileByteSource("<counting>", 1), data_(std::move(data)) {}
+
+  size_t endPos() const override { return data_.size(); }
+  bool isSeekable() const override { return true; }
+
+private:
+  size_t doRead(char *buf, size_t len) override {
+    len = std::min(len, data_.size() - readPos_);
+    ::memcpy(buf, data_.data() + readPos_, len);
+    readPos_ += len;
+    reads++;
+    return len;
+  }
+
+  void doSeek(size_t abspos) override { readPos_ = abspos; }
+};
+
+/// A file full of known content, removed again at the end of the test.
+struct TempFile {
+  std::string path;
+
+  explicit TempFile(std::string_view content) {
+    auto tmpl = (std::filesystem::temp_directory_path() / "au-test-XXXXXX")
+        .string();
+    auto fd = ::mkstemp(tmpl.data());
+    if (fd < 0) throw std::runtime_error("mkstemp failed");
+    ::close(fd);
+    path = tmpl;
+    std::ofstream out(path, std::ios::binary);
+    out << content;
+  }
+
+  ~TempFile() { ::unlink(path.c_str()); }
+};
+
+/// What au grep with args writes to stdout.
+std::string grep(std::vector<std::string> args) {
+  args.insert(args.begin(), {"au", "grep"});
+  std::vector<const char *> argv;
+  for (auto &arg : args) argv.push_back(arg.c_str());
+  testing::internal::CaptureStdout();
+  auto result = au::grep(static_cast<int>(argv.size()), argv.data());
+  auto out = testing::internal::GetCapturedStdout();
+  EXPECT_EQ(0, result);
+  return out;
+}
+
+}
+
+TEST(ConcatByteSource, ReadsAcrossParts) {
+  auto source = concat({"abc", "", "defg", "h"});
+  EXPECT_EQ(8u, source->endPos());
+  EXPECT_EQ('a', source->next().charValue());
+  EXPECT_EQ("bcd", readAll(*source, 3));
+  EXPECT_EQ(4u, source->pos());
+  source->skip(2);
+  EXPECT_EQ('g', source->next().charValue());
+  char buf[2];
+  source->seek(2);
+  source->readInto(buf, sizeof(buf));
+  EXPECT_EQ("cd", std::string_view(buf, sizeof(buf)));
+  EXPECT_EQ('h', (source->seek(7), source->peek().charValue()));
+  source->next();
+  EXPECT_TRUE(source->peek().isEof());
+  EXPECT_EQ(8u, source->pos());
+  EXPECT_THROW(source->seek(8), std::runtime_error);
+  source->seek(6);
+  EXPECT_THROW(readAll(*source, 3), parse_error);
+}
+
+TEST(ConcatByteSource, NamesTheWholeSet) {
+  auto source = concat({"abc", "", "def"});
+  EXPECT_EQ("<buffer>, <buffer>, <buffer>", source->name());
+  EXPECT_EQ("<buffer>", source->partName());
+  source->seek(4);
+  EXPECT_EQ("<buffer>, <buffer>, <buffer>", source->name());
+  EXPECT_EQ("<empty>", concat({})->name());
+}
+
+TEST(ConcatByteSource, ReadsAheadInThePartBeingRead) {
+  std::string data;
+  for (int i = 0; data.size() < 30000; i++) data += std::to_string(i) + "\n";
+  std::vector<CountingSource *> counted;
+  std::vector<std::unique_ptr<AuByteSource>> parts;
+  for (size_t pos = 0; pos < data.size(); pos += 10000) {
+    auto part = std::make_unique<CountingSource>(data.substr(pos, 10000));
+    counted.push_back(part.get());
+    parts.emplace_back(std::move(part));
+  }
+  ConcatByteSource source(std::move(parts));
+  source.setReadAhead(true);
+  EXPECT_EQ(data.substr(0, 100), readAll(source, 100));
+  // the first part's helper reads on past what we've taken...
+  while (counted[0]->reads < 2) std::this_thread::yield();
+  // ...and leaving the part stops it, keeping what it read, so that coming
+  // back carries on from the right place
+  source.seek(25000);
+  EXPECT_EQ(data.substr(25000, 3000), readAll(source, 3000));
+  EXPECT_EQ(0u, counted[1]->reads);
+  source.seek(50);
+  EXPECT_EQ(data.substr(50, 25000), readAll(source, 25000));
+  source.seek(9990);
+  EXPECT_EQ(data.substr(9990), readAll(source, data.size() - 9990));
+  EXPECT_TRUE(source.peek().isEof());
+}
+
+TEST(ConcatByteSource, ScansAndPeeksWithinParts) {
+  auto source = concat({"abcd", "xyz!", "xyz"});
+  EXPECT_TRUE(source->scanTo("xyz"));
+  EXPECT_EQ(4u, source->pos());
+  source->seek(5);
+  EXPECT_TRUE(source->scanTo("xyz"));
+  EXPECT_EQ(8u, source->pos());
+  source->seek(2);
+  ASSERT_NE(nullptr, source->peekContiguous(2));
+  EXPECT_EQ(nullptr, source->peekContiguous(3)) << "spans two parts";
+}
+
+TEST(ConcatByteSource, DecodesLikeConcatenatedFiles) {
+  auto first = auFile(0, 100);
+  auto second = auFile(100, 100);
+  auto joined = first + second;
+  BufferByteSource whole(joined);
+  auto source = concat({first, second});
+  Dictionary d1, d2;
+  EXPECT_EQ(decodeToJson(whole, d1), decodeToJson(*source, d2));
+}
+
+TEST(ConcatByteSource, SyncsToRecordsInLaterParts) {
+  auto first = auFile(0, 100);
+  auto second = auFile(100, 100);
+  auto source = concat({first, second});
+  // land in the middle of the second file, with no dictionary at all
+  source->seek(first.size() + second.size() / 2);
+  Dictionary dictionary;
+  TailHandler tailHandler(dictionary, *source);
+  std::stringstream ss;
+  JsonOutputHandler handler(ss);
+  tailHandler.parseStream(handler);
+  auto json = ss.str();
+  EXPECT_THAT(json, testing::StartsWith(R"({"n":1)"));
+  EXPECT_THAT(json, testing::HasSubstr(R"("n":199)"));
+  EXPECT_THAT(json, testing::Not(testing::HasSubstr(R"("n":99,)")));
+}
+
+TEST(ConcatByteSource, BisectsAcrossPartsInOrder) {
+  // each part is more than a bisect scans, so that it really does bisect
+  auto first = auFile(0, 150000);
+  auto second = auFile(150000, 150000);
+  ASSERT_LT(2u * 1024 * 1024, first.size());
+  auto find = [](const std::vector<std::string_view> &parts, int n) {
+    auto source = concat(parts);
+    Pattern pattern;
+    pattern.keyPattern = std::string("n");
+    pattern.intPattern = n;
+    pattern.uintPattern = static_cast<uint64_t>(n);
+    pattern.bisect = true;
+    pattern.numMatches = 1;
+    std::stringstream ss;
+    JsonOutputHandler handler(ss);
+    EXPECT_EQ(0, AuGrepper(pattern, *source, handler).doGrep());
+    return ss.str();
+  };
+  for (auto n : {0, 75000, 149999, 150000, 225000, 299999})
+    EXPECT_THAT(find({first, second}, n),
+                testing::StartsWith(R"({"n":)" + std::to_string(n) + ","))
+        << n;
+  // the keys have to be in order across the parts, not just within each: out
+  // of order, the bisect goes looking in the wrong part
+  EXPECT_EQ("", find({second, first}, 75000));
+}
+
+TEST(ConcatByteSource, GrepBisectsEachFileByItselfUnlessConcatenating) {
+  TempFile first(auFile(0, 150000));
+  TempFile second(auFile(150000, 150000));
+  auto find = [](std::vector<std::string> args, int n,
+                 const std::vector<std::string> &files) {
+    args.insert(args.end(), {"-o", "n", "-m", "1", std::to_string(n)});
+    args.insert(args.end(), files.begin(), files.end());
+    return grep(args);
+  };
+  // out of order, each file is still bisected by itself
+  for (auto n : {75000, 225000})
+    EXPECT_THAT(find({}, n, {second.path, first.path}),
+                testing::StartsWith(R"({"n":)" + std::to_string(n) + ","))
+        << n;
+  // in order, --concat bisects them as one
+  EXPECT_THAT(find({"--concat"}, 225000, {first.path, second.path}),
+              testing::StartsWith(R"({"n":225000,)"));
+}
+
+}
@@ -0,0 +1,456 @@
+#include "au/BufferByteSource.h"
+#include "au/FileByteSource.h"
+
+#include <gmock/gmock.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace au {
+
+namespace {
+
+/// A file full of known content, removed again at the end of the test.
+struct TempFile {
+  std::string path;
+
+  explicit TempFile(std::string_view content) {
+    auto tmpl = (std::filesystem::temp_directory_path() / "au-test-XXXXXX")
+        .string();
+    auto fd = ::mkstemp(tmpl.data());
+    if (fd < 0) throw std::runtime_error("mkstemp failed");
+    ::close(fd);
+    path = tmpl;
+    std::ofstream out(path, std::ios::binary);
+    out << content;
+  }
+
+  ~TempFile() { ::unlink(path.c_str()); }
+};
+
+std::string content(size_t len) {
+  std::string result;
+  for (size_t i = 0; i < len; i++)
+    result.push_back(static_cast<char>('a' + i % 26));
+  return result;
+}
+
+std::string readAll(AuByteSource &source, size_t len) {
+  std::string result;
+  source.readFunc(len, [&](std::string_view frag) { result.append(frag); });
+  return result;
+}
+
+}
+
+TEST(MmapByteSource, CanMapOnlyNonEmptyRegularFiles) {
+  TempFile empty("");
+  TempFile full("abc");
+  EXPECT_FALSE(MmapByteSource::canMap("-"));
+  EXPECT_FALSE(MmapByteSource::canMap(empty.path));
+  EXPECT_FALSE(MmapByteSource::canMap(full.path + ".does-not-exist"));
+  EXPECT_FALSE(MmapByteSource::canMap(
+      std::filesystem::temp_directory_path().string()));
+  EXPECT_TRUE(MmapByteSource::canMap(full.path));
+}
+
+TEST(MmapByteSource, ReadsLikeFileByteSource) {
+  auto data = content(10000);
+  TempFile file(data);
+  MmapByteSource mapped(file.path);
+  FileByteSourceImpl buffered(file.path, 1);
+
+  EXPECT_EQ(data.size(), mapped.endPos());
+  for (auto *source : {static_cast<AuByteSource *>(&mapped),
+                       static_cast<AuByteSource *>(&buffered)}) {
+    SCOPED_TRACE(source == &mapped ? "mapped" : "buffered");
+    EXPECT_EQ('a', source->peek().charValue());
+    EXPECT_EQ('a', source->next().charValue());
+    EXPECT_EQ(data.substr(1, 3000), readAll(*source, 3000));
+    source->skip(1000);
+    EXPECT_EQ(4001u, source->pos());
+    EXPECT_TRUE(source->scanTo("zab"));
+    EXPECT_EQ(4003u, source->pos());
+    source->seek(2);
+    EXPECT_EQ('c', source->next().charValue());
+    source->seek(data.size() - 2);
+    EXPECT_EQ(data.substr(data.size() - 2), readAll(*source, 2));
+    EXPECT_TRUE(source->peek().isEof());
+    EXPECT_TRUE(source->next().isEof());
+  }
+}
+
+TEST(FileByteSource, ReadIntoCrossesBufferBoundaries) {
+  auto data = content(3000);
+  TempFile file(data);
+  MmapByteSource mapped(file.path);
+  FileByteSourceImpl buffered(file.path, 1);
+  BufferByteSource buffer(data);
+
+  for (auto *source : {static_cast<AuByteSource *>(&mapped),
+                       static_cast<AuByteSource *>(&buffered),
+                       static_cast<AuByteSource *>(&buffer)}) {
+    // 1020..1028 straddles the end of the first 1k buffer
+    source->seek(1020);
+    char buf[8];
+    source->readInto(buf, sizeof(buf));
+    EXPECT_EQ(data.substr(1020, 8), std::string_view(buf, sizeof(buf)));
+    EXPECT_EQ(1028u, source->pos());
+    source->seek(2996);
+    EXPECT_THROW(source->readInto(buf, sizeof(buf)), parse_error);
+  }
+}
+
+TEST(FileByteSource, ReadAheadKeepsHistoryAndPins) {
+  auto data = content(20000);
+  TempFile file(data);
+  FileByteSourceImpl source(file.path, 1);
+  source.setReadAhead(true);
+
+  EXPECT_EQ('a', source.next().charValue());
+  source.seek(0);
+  EXPECT_EQ(data.substr(0, 3000), readAll(source, 3000));
+  // a pin holds history well beyond MIN_HIST_SIZE, across many refills
+  source.setPin(3000);
+  EXPECT_EQ(data.substr(3000, 9000), readAll(source, 9000));
+  source.clearPin();
+  source.seek(3000);
+  EXPECT_EQ(data.substr(3000, 10), readAll(source, 10));
+  // and seeks outside the buffer restart the read-ahead in the right place
+  source.seek(15000);
+  EXPECT_EQ(data.substr(15000), readAll(source, 5000));
+  EXPECT_TRUE(source.next().isEof());
+  source.seek(100);
+  EXPECT_TRUE(source.scanTo("xyz"));
+  EXPECT_EQ(101u, source.pos());
+}
+
+TEST(FileByteSource, NoCacheDoesNotChangeWhatIsRead) {
+  auto data = content(20000);
+  TempFile file(data);
+  FileByteSourceImpl source(file.path, 1);
+  source.setNoCache(true);
+
+  EXPECT_EQ(data.substr(0, 15000), readAll(source, 15000));
+  source.seek(10);
+  EXPECT_EQ(data.substr(10), readAll(source, data.size() - 10));
+  source.setNoCache(false);
+  EXPECT_TRUE(source.next().isEof());
+}
+
+TEST(FileByteSource, PinsAreDroppedPastTheBufferLimit) {
+  struct Source : FileByteSourceImpl {
+    using FileByteSourceImpl::FileByteSourceImpl;
+    size_t allocated() const { return bufSize_; }
+  };
+  auto data = content(20000);
+  TempFile file(data);
+  Source source(file.path, 1);
+  source.setMaxBufferSize(4096);
+
+  source.setPin(0);
+  EXPECT_EQ(data.substr(0, 15000), readAll(source, 15000));
+  EXPECT_LE(source.allocated(), 4096u);
+  // pinning something we've already let go of is fine too
+  source.setPin(10);
+  source.clearPin();
+  // the pinned data is re-read rather than held
+  source.seek(0);
+  EXPECT_EQ(data.substr(0, 100), readAll(source, 100));
+
+  // within the (default) limit, the pin holds everything
+  Source unlimited(file.path, 1);
+  unlimited.setPin(0);
+  EXPECT_EQ(data.substr(0, 15000), readAll(unlimited, 15000));
+  EXPECT_GT(unlimited.allocated(), 15000u);
+}
+
+TEST(FileByteSource, CompactsBeforeTheBufferFills) {
+  /// Serves data from memory a little at a time, as a pipe might, noting how
+  /// much each read asks for.
+  class Source : public FileByteSource {
+    std::string data_;
+    size_t at_ = 0;
+
+  public:
+    std::vector<size_t> reads;
+    size_t seeks = 0;
+
+    explicit Source(std::string data)
+        : FileByteSource("counting", 4), data_(std::move(data)) {}
+
+    size_t endPos() const override { return data_.size(); }
+    bool isSeekable() const override { return true; }
+    size_t allocated() const { return bufSize_; }
+
+  private:
+    size_t doRead(char *buf, size_t len) override {
+      reads.push_back(len);
+      auto n = std::min({len, data_.size() - at_, size_t(100)});
+      memcpy(buf, data_.data() + at_, n);
+      at_ += n;
+      return n;
+    }
+    void doSeek(size_t abspos) override {
+      seeks++;
+      at_ = abspos;
+    }
+  };
+  auto data = content(50000);
+  Source source(data);
+
+  for (size_t pos = 0; pos < 40000; pos += 300)
+    ASSERT_EQ(data.substr(pos, 300), readAll(source, 300));
+  // the buffer was compacted, rather than grown, and never so late that a
+  // read was for less than a quarter of it
+  EXPECT_EQ(4096u, source.allocated());
+  EXPECT_LT(10u, source.reads.size());
+  for (auto len : source.reads) EXPECT_LE(1024u, len);
+  // and what was read just before is still there to seek back over
+  source.seek(39500);
+  EXPECT_EQ(data.substr(39500, 1000), readAll(source, 1000));
+  EXPECT_EQ(0u, source.seeks);
+}
+
+/// A followed FileByteSourceImpl that says when it's waiting at eof, so a test
+/// can change the file then, rather than after a guess at how long it takes to
+/// get there. It gives up after a while, failing the test rather than hanging.
+class WaitingSource : public FileByteSourceImpl {
+  static constexpr size_t MaxWaits = 20;
+
+  std::mutex mutex_;
+  std::condition_variable waiting_;
+  size_t waits_ = 0;
+
+public:
+  explicit WaitingSource(const std::string &fname)
+      : FileByteSourceImpl(fname, 1) {
+    setFollow(true);
+  }
+
+  /// Runs change on another thread, once we're next waiting at eof.
+  std::thread whenWaiting(std::function<void()> change) {
+    std::unique_lock lock(mutex_);
+    return std::thread([this, change, waits = waits_] {
+      {
+        std::unique_lock lock(mutex_);
+        waiting_.wait_for(lock, std::chrono::seconds(10),
+                          [&] { return waits_ > waits; });
+      }
+      change();
+    });
+  }
+
+protected:
+  void waitForData() override {
+    {
+      std::unique_lock lock(mutex_);
+      if (++waits_ > MaxWaits)
+        throw std::runtime_error("gave up waiting for the file to change");
+    }
+    waiting_.notify_all();
+    FileByteSourceImpl::waitForData();
+  }
+};
+
+TEST(FileByteSource, FollowingNoticesRotationAndTruncation) {
+  TempFile file("abc");
+  WaitingSource source(file.path);
+  EXPECT_EQ("abc", readAll(source, 3));
+
+  // rotated: a new file is moved into place, as logrotate would
+  auto rotate = source.whenWaiting([&] {
+    auto next = file.path + ".next";
+    std::ofstream(next, std::ios::binary) << "wxyz";
+    std::filesystem::rename(next, file.path);
+  });
+  EXPECT_THROW(source.next(), stream_restarted);
+  rotate.join();
+  EXPECT_EQ(0u, source.pos());
+  EXPECT_EQ("wxyz", readAll(source, 4));
+
+  // truncated in place, then written to again
+  auto truncate = source.whenWaiting([&] {
+    std::ofstream(file.path, std::ios::binary | std::ios::trunc) << "12";
+  });
+  EXPECT_THROW(source.next(), stream_restarted);
+  truncate.join();
+  EXPECT_EQ("12", readAll(source, 2));
+
+  // and written past where we'd got to before we noticed
+  auto rewrite = source.whenWaiting([&] {
+    std::ofstream(file.path, std::ios::binary | std::ios::trunc) << "34567";
+  });
+  EXPECT_THROW(source.next(), stream_restarted);
+  rewrite.join();
+  EXPECT_EQ("34567", readAll(source, 5));
+
+  // while what's only appended to is read on from where we were
+  auto append = source.whenWaiting([&] {
+    std::ofstream(file.path, std::ios::binary | std::ios::app) << "89";
+  });
+  EXPECT_EQ("89", readAll(source, 2));
+  append.join();
+}
+
+/// Time that passes only when a test says so, or when the Throttle sleeps.
+struct FakeClocks : Throttle::Clocks {
+  Throttle::Clock::time_point time;
+  Throttle::Duration cpu{};
+
+  Throttle::Clock::time_point now() override { return time; }
+  Throttle::Duration cpuTime() override { return cpu; }
+  void sleep(Throttle::Duration wait) override { pass(wait); }
+
+  void pass(Throttle::Duration wait) {
+    time += std::chrono::duration_cast<Throttle::Clock::duration>(wait);
+  }
+
+  void busy(Throttle::Duration wait) {
+    pass(wait);
+    cpu += wait;
+  }
+};
+
+TEST(Throttle, HoldsReadsToTheRate) {
+  auto data = content(1 << 20);
+  TempFile file(data);
+  FakeClocks clocks;
+  Throttle throttle(clocks);
+  EXPECT_FALSE(throttle.enabled());
+  throttle.setBytesPerSecond(4 << 20);
+  FileByteSourceImpl source(file.path);
+  source.setThrottle(&throttle);
+
+  EXPECT_EQ(data, readAll(source, data.size()));
+  // a burst of 0.4MiB is free, the rest comes at 4MiB/s
+  EXPECT_NEAR(0.15, throttle.throttled().count(), 1e-6);
+}
+
+TEST(Throttle, HoldsCpuToItsShare) {
+  FakeClocks clocks;
+  Throttle throttle(clocks);
+  throttle.setCpuShare(0.5);
+  // busy for 0.1s, so at half a cpu we owe another 0.1s asleep
+  clocks.busy(Throttle::Duration(0.1));
+  throttle.account(0);
+  EXPECT_DOUBLE_EQ(0.1, throttle.throttled().count());
+  // which paid it off
+  throttle.account(0);
+  EXPECT_DOUBLE_EQ(0.1, throttle.throttled().count());
+
+  // busy for 2s more: 2.1s of 2.2s, so another 2s asleep. that's over the
+  // window, so a new one starts once we've slept...
+  clocks.busy(Throttle::Duration(2));
+  throttle.account(0);
+  EXPECT_DOUBLE_EQ(2.1, throttle.throttled().count());
+  // ...and what we owe is counted from there
+  clocks.busy(Throttle::Duration(0.1));
+  throttle.account(0);
+  EXPECT_DOUBLE_EQ(2.2, throttle.throttled().count());
+}
+
+TEST(PreadByteSource, CursorsAreIndependent) {
+  auto data = content(100000);
+  TempFile file(data);
+  PreadByteSource first(file.path, 1);
+  EXPECT_EQ(data.size(), first.endPos());
+
+  std::vector<std::unique_ptr<PreadByteSource>> cursors;
+  std::vector<std::string> results(4);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < results.size(); i++)
+    cursors.emplace_back(first.cursor(1));
+  for (size_t i = 0; i < results.size(); i++) {
+    threads.emplace_back([&, i]() {
+      auto &cursor = *cursors[i];
+      cursor.seek(i * 20000);
+      results[i] = readAll(cursor, 30000);
+    });
+  }
+  EXPECT_EQ(data.substr(0, 50000), readAll(first, 50000));
+  for (auto &t : threads) t.join();
+  for (size_t i = 0; i < results.size(); i++)
+    EXPECT_EQ(data.substr(i * 20000, 30000), results[i]);
+}
+
+TEST(PreadByteSource, ReadsLikeFileByteSource) {
+  auto data = content(10000);
+  TempFile file(data);
+  PreadByteSource source(file.path, 1);
+  EXPECT_EQ(data.substr(0, 3000), readAll(source, 3000));
+  EXPECT_TRUE(source.scanTo("zab"));
+  EXPECT_EQ(3015u, source.pos());
+  source.seek(data.size() - 2);
+  EXPECT_EQ(data.substr(data.size() - 2), readAll(source, 2));
+  EXPECT_TRUE(source.next().isEof());
+  EXPECT_THROW(source.seek(data.size()), std::runtime_error);
+}
+
+TEST(FileByteSource, PeekContiguousDoesNotConsume) {
+  auto data = content(10000);
+  TempFile file(data);
+  MmapByteSource mapped(file.path);
+  FileByteSourceImpl buffered(file.path, 1);
+  BufferByteSource buffer(data);
+
+  for (auto *source : {static_cast<AuByteSource *>(&mapped),
+                       static_cast<AuByteSource *>(&buffered),
+                       static_cast<AuByteSource *>(&buffer)}) {
+    source->seek(9000);
+    auto *peeked = source->peekContiguous(1000);
+    ASSERT_NE(nullptr, peeked);
+    EXPECT_EQ(data.substr(9000), std::string_view(peeked, 1000));
+    EXPECT_EQ(9000u, source->pos());
+    EXPECT_EQ(nullptr, source->peekContiguous(1001));
+    EXPECT_EQ(data.substr(9000, 10), readAll(*source, 10));
+  }
+}
+
+TEST(BufferByteSource, ReportsPositionsRelativeToBase) {
+  auto data = content(100);
+  BufferByteSource source(data.data() + 50, 50, 1050);
+  EXPECT_EQ(1050u, source.pos());
+  EXPECT_EQ(1100u, source.endPos());
+  source.seek(1060);
+  EXPECT_EQ(data[60], source.next().charValue());
+  EXPECT_THROW(source.seek(1049), std::runtime_error);
+  EXPECT_THROW(source.skip(40), std::runtime_error);
+  EXPECT_EQ(1061u, source.pos());
+  source.skip(39);
+  EXPECT_TRUE(source.peek().isEof());
+  EXPECT_EQ(1100u, source.pos());
+}
+
+TEST(MmapByteSource, FailsLikeFileByteSource) {
+  auto data = content(100);
+  TempFile file(data);
+  MmapByteSource mapped(file.path);
+  FileByteSourceImpl buffered(file.path, 1);
+
+  for (auto *source : {static_cast<AuByteSource *>(&mapped),
+                       static_cast<AuByteSource *>(&buffered)}) {
+    SCOPED_TRACE(source == &mapped ? "mapped" : "buffered");
+    source->seek(90);
+    EXPECT_THROW(readAll(*source, 11), parse_error);
+    source->seek(90);
+    EXPECT_THROW(source->skip(11), std::runtime_error);
+    EXPECT_THROW(source->seek(data.size()), std::runtime_error);
+    source->seek(90);
+    EXPECT_FALSE(source->scanTo("xyz!"));
+    EXPECT_EQ(data.size() - 3, source->pos());
+  }
+}
+
+}
@@ -0,0 +1,89 @@
+#include "au/BufferByteSource.h"
+#include "JsonOutputHandler.h"
+#include "ParallelScan.h"
+#include "TestAuFile.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace au {
+
+TEST(ParallelScan, MatchesSequentialDecode) {
+  std::vector<AuByteSource::KnownRecord> records;
+  auto file = auFile(records, 100000);
+
+  std::stringstream sequential;
+  {
+    Dictionary dictionary;
+    JsonOutputHandler handler(sequential);
+    AuRecordHandler recordHandler(dictionary, handler);
+    BufferByteSource source(file);
+    RecordParser(source, recordHandler).parseStream();
+  }
+
+  std::vector<ScanRange> ranges;
+  size_t start = 0;
+  for (size_t i = 250; i < records.size(); i += 250) {
+    ranges.push_back(ScanRange{start, records[i].pos});
+    start = records[i].pos;
+  }
+  ranges.push_back(ScanRange{start, std::numeric_limits<size_t>::max()});
+
+  std::string parallel;
+  scanInParallel(
+      ranges, 4,
+      [&]() -> std::unique_ptr<AuByteSource> {
+        return std::make_unique<KnowingSource>(file, records);
+      },
+      [&](AuByteSource &source, const ScanRange &range) {
+        std::stringstream out;
+        Dictionary dictionary;
+        JsonOutputHandler handler(out);
+        AuRecordHandler recordHandler(dictionary, handler);
+        startRange(source, dictionary, range);
+        parseRange(source, range, recordHandler);
+        return std::move(out).str();
+      },
+      [&](std::string &&json) {
+        parallel += json;
+        return true;
+      });
+
+  // line by line, since a diff of the whole would be enormous
+  std::istringstream expected(sequential.str()), actual(parallel);
+  std::string expectedLine, actualLine;
+  size_t line = 0, wrong = 0;
+  while (std::getline(expected, expectedLine)) {
+    line++;
+    ASSERT_TRUE(std::getline(actual, actualLine)) << "ends at line " << line;
+    if (expectedLine != actualLine && !wrong++)
+      ADD_FAILURE() << "first wrong at line " << line << ": " << actualLine
+                    << "\ninstead of: " << expectedLine;
+  }
+  EXPECT_EQ(0u, wrong);
+  EXPECT_FALSE(std::getline(actual, actualLine)) << "goes on past line "
+                                                 << line;
+}
+
+TEST(ParallelScan, StopsWhenDoneSaysSo) {
+  std::vector<ScanRange> ranges;
+  for (size_t i = 0; i < 100; i++) ranges.push_back(ScanRange{i, i + 1});
+  std::vector<size_t> seen;
+  scanInParallel(
+      ranges, 4,
+      [] { return std::make_unique<BufferByteSource>("", 0); },
+      [](AuByteSource &, const ScanRange &range) { return range.start; },
+      [&](size_t start) {
+        seen.push_back(start);
+        return seen.size() < 10;
+      });
+  std::vector<size_t> expected(10);
+  for (size_t i = 0; i < expected.size(); i++) expected[i] = i;
+  EXPECT_EQ(expected, seen);
+}
+
+}
@@ -0,0 +1,82 @@
+#include "JsonOutputHandler.h"
+#include "Tail.h"
+#include "TestAuFile.h"
+
+#include <gmock/gmock.h>
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace au {
+
+namespace {
+
+/// The next record, as json.
+std::string nextRecord(AuByteSource &source, Dictionary &dictionary) {
+  std::stringstream ss;
+  JsonOutputHandler handler(ss);
+  AuRecordHandler recordHandler(dictionary, handler);
+  RecordParser(source, recordHandler).parseUntilValue();
+  return ss.str();
+}
+
+}
+
+TEST(TailHandler, SyncsToKnownRecord) {
+  std::vector<AuByteSource::KnownRecord> records;
+  auto file = auFile(records, 1000);
+  auto &record = records[700];
+  ASSERT_NE(0u, record.dictClear) << "the test needs a later dict-clear";
+  KnowingSource source(file, {record}, records[699].pos + 1);
+  source.seek(record.pos - 1);
+  Dictionary dictionary;
+  ASSERT_TRUE(TailHandler(dictionary, source).sync());
+  EXPECT_EQ(record.pos, source.pos());
+  EXPECT_THAT(nextRecord(source, dictionary),
+              testing::StartsWith(R"({"n":700,)"));
+  EXPECT_EQ(record.dictClear, dictionary.latest()->startPos_);
+}
+
+TEST(TailHandler, ExtendsDictionaryToKnownRecord) {
+  std::vector<AuByteSource::KnownRecord> records;
+  auto file = auFile(records, 1000);
+  auto &record = records[900];
+  // an earlier record with the same dictionary, which it's since added to
+  size_t earlier = 0;
+  while (records[earlier].dictClear != record.dictClear) earlier++;
+  earlier += 10;
+  ASSERT_LT(earlier + 10, 900u);
+  KnowingSource source(file, {record}, records[899].pos + 1);
+  Dictionary dictionary;
+  source.seek(records[earlier].pos);
+  ASSERT_TRUE(TailHandler(dictionary, source).sync());
+  auto *dict = dictionary.latest();
+  auto size = dict->size();
+  source.seek(record.pos);
+  ASSERT_TRUE(TailHandler(dictionary, source).sync());
+  EXPECT_THAT(nextRecord(source, dictionary),
+              testing::StartsWith(R"({"n":900,)"));
+  EXPECT_EQ(dict, dictionary.latest());
+  EXPECT_GT(dict->size(), size);
+}
+
+TEST(TailHandler, IgnoresWrongKnownRecord) {
+  std::vector<AuByteSource::KnownRecord> records;
+  auto file = auFile(records, 1000);
+  auto &record = records[500];
+  // not a record at all, so sync must scan for one as usual
+  KnowingSource source(
+      file, {AuByteSource::KnownRecord{record.pos + 3, record.dictClear}},
+      record.pos);
+  source.seek(record.pos + 1);
+  Dictionary dictionary;
+  testing::internal::CaptureStderr();
+  ASSERT_TRUE(TailHandler(dictionary, source).sync());
+  testing::internal::GetCapturedStderr();
+  EXPECT_EQ(records[501].pos, source.pos());
+  EXPECT_THAT(nextRecord(source, dictionary),
+              testing::StartsWith(R"({"n":501,)"));
+}
+
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "au/AuEncoder.h"
+#include "au/BufferByteSource.h"
+
+#include <algorithm>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace au {
+
+/// A BufferByteSource that knows where records start, as an index that notes
+/// where records start knows the first after each of its checkpoints: the
+/// first of records at or after any position from from on.
+class KnowingSource : public AuByteSource {
+  BufferByteSource source_;
+  std::vector<KnownRecord> records_; //< In order
+  size_t from_;
+
+public:
+  KnowingSource(std::string_view buf, std::vector<KnownRecord> records,
+                size_t from = 0)
+      : source_(buf), records_(std::move(records)), from_(from) {}
+
+  std::optional<KnownRecord> knownRecord(size_t abspos) override {
+    if (abspos < from_) return std::nullopt;
+    auto it = std::lower_bound(
+        records_.begin(), records_.end(), abspos,
+        [](const KnownRecord &record, size_t pos) { return record.pos < pos; });
+    if (it == records_.end()) return std::nullopt;
+    return *it;
+  }
+
+  std::string name() const override { return source_.name(); }
+  size_t pos() const override { return source_.pos(); }
+  size_t endPos() const override { return source_.endPos(); }
+  Byte peek() override { return source_.peek(); }
+  Byte next() override { return source_.next(); }
+  void readFunc(size_t len, Fn func) override { source_.readFunc(len, func); }
+  void setPin(size_t abspos) override { source_.setPin(abspos); }
+  void clearPin() override { source_.clearPin(); }
+  bool isSeekable() const override { return true; }
+  void seek(size_t abspos) override { source_.seek(abspos); }
+  bool scanTo(std::string_view needle) override {
+    return source_.scanTo(needle);
+  }
+  void skip(size_t len) override { source_.skip(len); }
+};
+
+/// An au file of count timestamped records, with dictionary additions all
+/// through it and a clear every few hundred records. Where each record starts
+/// goes in records.
+inline std::string auFile(std::vector<AuByteSource::KnownRecord> &records,
+                          int count) {
+  AuEncoder au("", 0, 50, 0, AuStringIntern::Config{}, 1u << 14);
+  std::string result;
+  size_t dictClear = 0;
+  // hours apart, so that any mix-up between records shows in the time of day
+  auto start = std::chrono::system_clock::time_point(
+      std::chrono::seconds(1531728000));
+  for (int n = 0; n < count; n++) {
+    au.encode(
+        [&](AuWriter &w) {
+          w.startMap();
+          w.key("n");
+          w.value(n);
+          w.key("time");
+          w.value(start + std::chrono::minutes(97 * n)
+                  + std::chrono::milliseconds(n % 1000));
+          w.key("key" + std::to_string(n / 3));
+          w.value(n);
+          w.endMap();
+        },
+        [&](std::string_view dict, std::string_view value) {
+          if (dict[0] == 'C')
+            dictClear = result.size();
+          else if (auto clear = dict.find("\x0f\nC"); clear != dict.npos)
+            dictClear = result.size() + clear + 2;
+          auto sor = dict.rfind("\x0f\nV");
+          records.push_back(AuByteSource::KnownRecord{
+              result.size() + (sor == dict.npos ? 0 : sor + 2), dictClear});
+          result.append(dict).append(value);
+          return dict.size() + value.size();
+        });
+  }
+  return result;
+}
+
+}
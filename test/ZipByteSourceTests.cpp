@@ -0,0 +1,474 @@
+#include "GrepHandler.h"
+#include "JsonOutputHandler.h"
+#include "KeySamples.h"
+#include "Zindex.h"
+
+#include <gtest/gtest.h>
+#include <zlib.h>
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace au {
+
+namespace {
+
+/// A file full of known content, removed again (index and all) at the end of
+/// the test.
+struct TempFile {
+  std::string path;
+
+  explicit TempFile(std::string_view content) {
+    auto tmpl = (std::filesystem::temp_directory_path() / "au-test-XXXXXX")
+        .string();
+    auto fd = ::mkstemp(tmpl.data());
+    if (fd < 0) throw std::runtime_error("mkstemp failed");
+    ::close(fd);
+    path = tmpl;
+    std::ofstream out(path, std::ios::binary);
+    out << content;
+  }
+
+  std::string index() const { return path + ".auzx"; }
+
+  ~TempFile() {
+    ::unlink(path.c_str());
+    ::unlink(index().c_str());
+  }
+};
+
+/// Text that compresses, but not to nothing.
+std::string content(size_t lines) {
+  std::string result;
+  uint32_t x = 12345;
+  for (size_t i = 0; i < lines; i++) {
+    x = x * 1103515245u + 12345u;
+    result += "line " + std::to_string(i) + " " + std::to_string(x >> 8)
+              + "\n";
+  }
+  return result;
+}
+
+/// data as one gzip member, a BGZF one (as bgzip writes, which mustn't be
+/// more than 64K) if bgzf.
+std::string gzipMember(std::string_view data, bool bgzf) {
+  z_stream zs{};
+  if (deflateInit2(&zs, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    throw std::runtime_error("deflateInit2 failed");
+  std::string deflated(deflateBound(&zs, static_cast<uLong>(data.size())),
+                       '\0');
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  zs.avail_in = static_cast<uInt>(data.size());
+  zs.next_out = reinterpret_cast<Bytef *>(deflated.data());
+  zs.avail_out = static_cast<uInt>(deflated.size());
+  if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+    throw std::runtime_error("deflate failed");
+  deflated.resize(zs.total_out);
+  deflateEnd(&zs);
+
+  std::string member{'\x1f', '\x8b', '\x08', bgzf ? '\x04' : '\0',
+                     0, 0, 0, 0, 0, '\xff'};
+  auto put16 = [&](size_t value) {
+    member.push_back(static_cast<char>(value & 0xff));
+    member.push_back(static_cast<char>(value >> 8 & 0xff));
+  };
+  auto put32 = [&](size_t value) {
+    put16(value & 0xffff);
+    put16(value >> 16 & 0xffff);
+  };
+  if (bgzf) {
+    put16(6);
+    member += "BC";
+    put16(2);
+    put16(18 + deflated.size() + 8 - 1);
+  }
+  member += deflated;
+  put32(crc32(0, reinterpret_cast<const Bytef *>(data.data()),
+              static_cast<uInt>(data.size())));
+  put32(data.size());
+  return member;
+}
+
+/// data in gzip members of up to memberSize each.
+std::string gzipMembers(std::string_view data, size_t memberSize, bool bgzf) {
+  std::string result;
+  for (size_t pos = 0; pos < data.size(); pos += memberSize)
+    result += gzipMember(data.substr(pos, memberSize), bgzf);
+  return result;
+}
+
+std::string readAll(AuByteSource &source) {
+  std::string result;
+  while (!source.peek().isEof())
+    source.readFunc(1, [&](std::string_view frag) { result.append(frag); });
+  return result;
+}
+
+std::string readAll(AuByteSource &source, size_t len) {
+  std::string result;
+  source.readFunc(len, [&](std::string_view frag) { result.append(frag); });
+  return result;
+}
+
+/// A ZipByteSource that lets on how big its buffer has grown.
+struct MeasuredZipByteSource : ZipByteSource {
+  using ZipByteSource::ZipByteSource;
+  size_t bufferSize() const { return bufSize_; }
+};
+
+/// Reads file every way there is, and checks each gets data.
+void readsAsPlain(const TempFile &file, const std::string &data) {
+  {
+    SCOPED_TRACE("sequential, without an index");
+    ZipByteSource source(file.path, std::nullopt);
+    EXPECT_EQ(data, readAll(source));
+  }
+
+  ZindexOptions options;
+  options.threads = 2;
+  testing::internal::CaptureStdout();
+  auto result = zindexFile(file.path, file.index(), options);
+  testing::internal::GetCapturedStdout();
+  ASSERT_EQ(0, result);
+
+  {
+    SCOPED_TRACE("indexed, from the start");
+    ZipByteSource source(file.path, file.index());
+    EXPECT_EQ(data, readAll(source));
+  }
+  {
+    SCOPED_TRACE("indexed, inflating ahead");
+    ZipByteSource source(file.path, file.index());
+    source.setThreads(4);
+    EXPECT_EQ(data, readAll(source));
+  }
+  // well into the last member, and back into the first
+  auto late = data.size() - data.size() / 5;
+  auto early = data.size() / 7;
+  {
+    SCOPED_TRACE("indexed, after seeks");
+    ZipByteSource source(file.path, file.index());
+    source.seek(late);
+    EXPECT_EQ(data.substr(late, 1000), readAll(source, 1000));
+    source.seek(early);
+    EXPECT_EQ(data.substr(early), readAll(source));
+  }
+  {
+    SCOPED_TRACE("indexed, after seeks within --max-buffer");
+    MeasuredZipByteSource source(file.path, file.index());
+    source.setMaxBufferSize(1024 * 1024);
+    source.seek(late);
+    EXPECT_EQ(data.substr(late, 1000), readAll(source, 1000));
+    source.seek(early);
+    EXPECT_EQ(data.substr(early), readAll(source));
+    EXPECT_GE(1024u * 1024, source.bufferSize());
+  }
+  {
+    SCOPED_TRACE("indexed, after prefetches");
+    ZipByteSource source(file.path, file.index());
+    source.setThreads(2);
+    // as a bisect does: both ways the next probe might go, then one of them
+    source.prefetch(early, 1000);
+    source.prefetch(late, 1000);
+    source.seek(late);
+    EXPECT_EQ(data.substr(late, 1000), readAll(source, 1000));
+    source.prefetch(early, 1000);
+    source.seek(early);
+    EXPECT_EQ(data.substr(early), readAll(source));
+  }
+  {
+    SCOPED_TRACE("indexed, in blocks");
+    ZipByteSource source(file.path, file.index());
+    source.setBlockCache("");
+    source.seek(late);
+    EXPECT_EQ(data.substr(late), readAll(source));
+    source.seek(early);
+    EXPECT_EQ(data.substr(early, 1000), readAll(source, 1000));
+  }
+}
+
+}
+
+TEST(ZipByteSource, ReadsConcatenatedMembers) {
+  auto data = content(40000);
+  TempFile file(gzipMembers(data, data.size() / 2 + 1, false));
+  readsAsPlain(file, data);
+}
+
+TEST(ZipByteSource, ReadsBgzfMembers) {
+  auto data = content(40000);
+  TempFile file(gzipMembers(data, 60000, true));
+  readsAsPlain(file, data);
+}
+
+TEST(ZipByteSource, CursorsShareTheFileAndIndex) {
+  auto data = content(40000);
+  TempFile file(gzipMembers(data, data.size() / 4 + 1, false));
+  testing::internal::CaptureStdout();
+  auto result = zindexFile(file.path, file.index(), ZindexOptions{});
+  testing::internal::GetCapturedStdout();
+  ASSERT_EQ(0, result);
+
+  ZipByteSource source(file.path, file.index());
+#ifdef __linux__
+  auto openFiles = [] {
+    auto fds = std::filesystem::directory_iterator("/proc/self/fd");
+    return std::distance(begin(fds), end(fds));
+  };
+  auto before = openFiles();
+#endif
+  std::vector<std::unique_ptr<ZipByteSource>> cursors;
+  for (size_t i = 0; i < 4; i++) cursors.emplace_back(source.cursor());
+#ifdef __linux__
+  EXPECT_EQ(before, openFiles());
+#endif
+
+  std::vector<std::string> results(cursors.size());
+  std::vector<std::thread> threads;
+  auto step = data.size() / (cursors.size() + 1);
+  for (size_t i = 0; i < cursors.size(); i++) {
+    threads.emplace_back([&, i] {
+      cursors[i]->seek(i * step);
+      results[i] = readAll(*cursors[i], 2 * step);
+    });
+  }
+  EXPECT_EQ(data.substr(0, 1000), readAll(source, 1000));
+  for (auto &t : threads) t.join();
+  for (size_t i = 0; i < cursors.size(); i++)
+    EXPECT_EQ(data.substr(i * step, 2 * step), results[i]) << i;
+}
+
+TEST(ZipByteSource, BlockCacheDropsBlocksOfEarlierVersions) {
+  auto data = content(40000);
+  TempFile file(gzipMembers(data, data.size() / 2 + 1, false));
+  testing::internal::CaptureStdout();
+  auto result = zindexFile(file.path, file.index(), ZindexOptions{});
+  testing::internal::GetCapturedStdout();
+  ASSERT_EQ(0, result);
+
+  auto tmpl = (std::filesystem::temp_directory_path() / "au-test-XXXXXX")
+      .string();
+  ASSERT_NE(nullptr, ::mkdtemp(tmpl.data()));
+  std::filesystem::path dir = tmpl;
+  auto other = dir / "1-2-3-4-0-10.block";
+  std::ofstream(other) << "some other file's";
+  auto blocks = [&] {
+    size_t n = 0;
+    for (auto &entry : std::filesystem::directory_iterator(dir))
+      n += entry.path() != other;
+    return n;
+  };
+
+  {
+    ZipByteSource source(file.path, file.index());
+    source.setBlockCache(dir.string());
+    source.seek(data.size() / 7);
+    EXPECT_EQ(data.substr(data.size() / 7, 1000), readAll(source, 1000));
+  }
+  EXPECT_LT(0u, blocks());
+
+  std::ofstream(file.path, std::ios::binary | std::ios::app)
+      << gzipMember("more\n", false);
+  {
+    ZipByteSource source(file.path, file.index());
+    source.setBlockCache(dir.string());
+  }
+  EXPECT_EQ(0u, blocks());
+  EXPECT_TRUE(std::filesystem::exists(other));
+  std::filesystem::remove_all(dir);
+}
+
+TEST(ZipByteSource, IndexCoversMembersAppendedSince) {
+  auto data = content(40000);
+  auto half = data.size() / 2;
+  TempFile file(gzipMember(data.substr(0, half), false));
+  ZindexOptions options;
+  testing::internal::CaptureStdout();
+  auto result = zindexFile(file.path, file.index(), options);
+  testing::internal::GetCapturedStdout();
+  ASSERT_EQ(0, result);
+
+  std::ofstream(file.path, std::ios::binary | std::ios::app)
+      << gzipMember(data.substr(half), false);
+  auto late = data.size() - data.size() / 5;
+  {
+    SCOPED_TRACE("appended to since");
+    ZipByteSource source(file.path, file.index());
+    EXPECT_EQ(data.size(), source.endPos());
+    source.seek(late);
+    EXPECT_EQ(data.substr(late, 1000), readAll(source, 1000));
+  }
+
+  options.update = true;
+  testing::internal::CaptureStdout();
+  result = zindexFile(file.path, file.index(), options);
+  auto out = testing::internal::GetCapturedStdout();
+  ASSERT_EQ(0, result);
+  EXPECT_NE(std::string::npos,
+            out.find("Keeping 1 checkpoints of existing index"))
+      << out;
+  {
+    SCOPED_TRACE("updated");
+    ZipByteSource source(file.path, file.index());
+    EXPECT_EQ(data.size(), source.endPos());
+    source.seek(late);
+    EXPECT_EQ(data.substr(late), readAll(source));
+  }
+
+  // as big as it was, and bigger, but not by being appended to
+  std::ofstream(file.path, std::ios::binary | std::ios::trunc)
+      << gzipMember("rewritten\n" + data + data, false);
+  EXPECT_THROW(ZipByteSource(file.path, file.index()), std::runtime_error);
+  testing::internal::CaptureStdout();
+  result = zindexFile(file.path, file.index(), options);
+  out = testing::internal::GetCapturedStdout();
+  ASSERT_EQ(0, result);
+  EXPECT_NE(std::string::npos,
+            out.find("Can't update existing index " + file.index()
+                     + ": the file has been modified, not just appended to"))
+      << out;
+}
+
+TEST(KeySamples, SurviveEncoding) {
+  std::vector<std::string> keys{"n", "time", "name", "none"};
+  std::vector<KeySamples> samples{
+      {{0, int64_t{-5}}, {100, uint64_t{1} << 63}, {200, 2.5}},
+      {{7, time_point(std::chrono::nanoseconds(1531728000123456789))}},
+      {{0, std::string()}, {9, std::string("abc\0def", 7)}},
+      {}};
+  auto encoded = encodeKeySamples(keys, samples);
+  auto decoded = decodeKeySamples(encoded);
+  ASSERT_EQ(keys.size(), decoded.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    SCOPED_TRACE(keys[i]);
+    auto &got = decoded.at(keys[i]);
+    ASSERT_EQ(samples[i].size(), got.size());
+    for (size_t j = 0; j < got.size(); j++) {
+      EXPECT_EQ(samples[i][j].pos, got[j].pos);
+      EXPECT_TRUE(samples[i][j].value == got[j].value);
+    }
+  }
+  EXPECT_TRUE(decodeKeySamples("").empty());
+  EXPECT_THROW(decodeKeySamples(encoded.substr(0, encoded.size() - 1)),
+               std::runtime_error);
+}
+
+TEST(ZipByteSource, SamplesNarrowABisect) {
+  // enough for a few checkpoints, so there are samples to narrow it down
+  std::string data;
+  int64_t last = 0;
+  for (; data.size() < 17 * 1024 * 1024; last++)
+    data += "{\"n\":" + std::to_string(last) + "}\n";
+  last--;
+  TempFile file(gzipMember(data, false));
+  ZindexOptions options;
+  options.keys = {"n"};
+  testing::internal::CaptureStdout();
+  auto result = zindexFile(file.path, file.index(), options);
+  testing::internal::GetCapturedStdout();
+  ASSERT_EQ(0, result);
+
+  ZipByteSource sampled(file.path, file.index());
+  auto *samples = sampled.keySamples("n");
+  ASSERT_NE(nullptr, samples);
+  ASSERT_LE(3u, samples->size());
+  // each sample, and just before it, where the search starts and ends
+  std::vector<int64_t> targets{0, last};
+  for (auto &sample : *samples) {
+    ASSERT_TRUE(std::holds_alternative<uint64_t>(sample.value));
+    auto n = static_cast<int64_t>(std::get<uint64_t>(sample.value));
+    for (auto target : {n - 1, n})
+      if (target >= 0 && target <= last) targets.push_back(target);
+  }
+  targets.push_back(last + 1);
+
+  for (auto target : targets) {
+    SCOPED_TRACE(target);
+    ZipByteSource source(file.path, file.index());
+    // so that the search inflates each block just the once
+    source.setBlockCache("");
+    Pattern pattern;
+    pattern.keyPattern = std::string("n");
+    pattern.intPattern = target;
+    pattern.uintPattern = static_cast<uint64_t>(target);
+    pattern.bisect = true;
+    pattern.numMatches = 1;
+    pattern.keySamples = samples;
+    std::ostringstream out;
+    JsonOutputHandler handler(out);
+    EXPECT_EQ(0, JsonGrepper(pattern, source, handler).doGrep());
+    if (target > last)
+      EXPECT_EQ("", out.str());
+    else
+      EXPECT_EQ("{\"n\":" + std::to_string(target) + "}\n", out.str());
+  }
+}
+
+TEST(ZipByteSource, RefiningAddsCheckpointsWhereSeeksLand) {
+  auto data = content(170000);
+  ASSERT_LT(3u * 1024 * 1024, data.size());
+  TempFile file(gzipMember(data, false));
+  auto zindex = [&](const ZindexOptions &options) {
+    testing::internal::CaptureStdout();
+    auto result = zindexFile(file.path, file.index(), options);
+    auto out = testing::internal::GetCapturedStdout();
+    EXPECT_EQ(0, result);
+    return out;
+  };
+  zindex(ZindexOptions{});
+  ZindexOptions refine;
+  refine.refine = true;
+  // the first only starts noting seeks
+  zindex(refine);
+  std::filesystem::path seekLog = file.index() + ".seeks";
+  EXPECT_TRUE(std::filesystem::exists(seekLog));
+
+  // both far enough past the one checkpoint, at the start, to be noted
+  size_t far = 1024 * 1024 + 100, further = 2 * 1024 * 1024;
+  for (auto pos : {far, further}) {
+    ZipByteSource source(file.path, file.index());
+    source.seek(pos);
+    EXPECT_EQ(data.substr(pos, 100), readAll(source, 100));
+  }
+  auto out = zindex(refine);
+  EXPECT_NE(std::string::npos, out.find("Adding ")) << out;
+  EXPECT_EQ(std::string::npos, out.find("Adding 0 ")) << out;
+  EXPECT_NE(std::string::npos, out.find("Index refined.")) << out;
+  EXPECT_EQ(0u, std::filesystem::file_size(seekLog));
+
+  ZipByteSource source(file.path, file.index());
+  source.seek(further);
+  EXPECT_EQ(data.substr(further), readAll(source));
+  std::filesystem::remove(seekLog);
+}
+
+TEST(ZipByteSource, RejectsAnIndexFromANewerVersion) {
+  auto data = content(1000);
+  TempFile file(gzipMember(data, false));
+  testing::internal::CaptureStdout();
+  auto result = zindexFile(file.path, file.index(), ZindexOptions{});
+  testing::internal::GetCapturedStdout();
+  ASSERT_EQ(0, result);
+  EXPECT_NO_THROW(ZipByteSource(file.path, file.index()));
+
+  // the version follows the 8-byte magic
+  std::fstream index(file.index(),
+                     std::ios::binary | std::ios::in | std::ios::out);
+  uint32_t version;
+  index.seekg(8);
+  index.read(reinterpret_cast<char *>(&version), sizeof(version));
+  version++;
+  index.seekp(8);
+  index.write(reinterpret_cast<const char *>(&version), sizeof(version));
+  index.close();
+  EXPECT_THROW(ZipByteSource(file.path, file.index()), std::runtime_error);
+}
+
+}